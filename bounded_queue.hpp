@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+
+namespace cu
+{
+
+/// A fixed capacity queue for any number of producer and consumer threads,
+/// after Dmitry Vyukov's bounded MPMC queue. Pushing and popping never lock
+/// and never allocate. Every cell carries a sequence number, which tells
+/// whether it is ready to be written or read in the current lap around the
+/// ring, so producers and consumers only contend on their own position
+/// counter.
+template <typename T>
+class BoundedQueue
+{
+public:
+  /// The capacity is rounded up to a power of two.
+  explicit BoundedQueue( std::size_t capacity )
+  {
+    std::size_t size = 1;
+    while ( size < capacity )
+      size *= 2;
+    mask_ = size - 1;
+    cells_.reset( new Cell[size] );
+    for ( std::size_t i = 0; i < size; ++i )
+      cells_[i].sequence.store( i, std::memory_order_relaxed );
+  }
+
+  std::size_t getCapacity() const { return mask_ + 1; }
+
+  /// The number of elements. It may be outdated as soon as it is returned.
+  std::size_t getSize() const
+  {
+    const auto end = enqueuePos_.load( std::memory_order_relaxed );
+    const auto begin = dequeuePos_.load( std::memory_order_relaxed );
+    return end > begin ? end - begin : 0;
+  }
+
+  /// Moves the value into the queue and returns true, unless the queue is
+  /// full. Then the value is left untouched.
+  bool tryPush( T & value )
+  {
+    auto pos = enqueuePos_.load( std::memory_order_relaxed );
+    for (;;)
+    {
+      auto & cell = cells_[pos & mask_];
+      const auto sequence = cell.sequence.load( std::memory_order_acquire );
+      const auto diff = std::ptrdiff_t(sequence) - std::ptrdiff_t(pos);
+      if ( diff == 0 )
+      {
+        if ( enqueuePos_.compare_exchange_weak( pos, pos+1, std::memory_order_relaxed ) )
+        {
+          cell.value = std::move( value );
+          cell.sequence.store( pos+1, std::memory_order_release );
+          return true;
+        }
+      }
+      else if ( diff < 0 )
+        return false;
+      else
+        pos = enqueuePos_.load( std::memory_order_relaxed );
+    }
+  }
+
+  bool tryPush( T && value )
+  {
+    return tryPush( value );
+  }
+
+  /// Moves the oldest element into value and returns true, unless the
+  /// queue is empty.
+  bool tryPop( T & value )
+  {
+    auto pos = dequeuePos_.load( std::memory_order_relaxed );
+    for (;;)
+    {
+      auto & cell = cells_[pos & mask_];
+      const auto sequence = cell.sequence.load( std::memory_order_acquire );
+      const auto diff = std::ptrdiff_t(sequence) - std::ptrdiff_t(pos+1);
+      if ( diff == 0 )
+      {
+        if ( dequeuePos_.compare_exchange_weak( pos, pos+1, std::memory_order_relaxed ) )
+        {
+          value = std::move( cell.value );
+          cell.sequence.store( pos + mask_ + 1, std::memory_order_release );
+          return true;
+        }
+      }
+      else if ( diff < 0 )
+        return false;
+      else
+        pos = dequeuePos_.load( std::memory_order_relaxed );
+    }
+  }
+
+private:
+  struct Cell
+  {
+    std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells_;
+  std::size_t mask_{};
+  // separate cache lines, so producers and consumers do not slow each
+  // other down
+  alignas(64) std::atomic<std::size_t> enqueuePos_{0};
+  alignas(64) std::atomic<std::size_t> dequeuePos_{0};
+};
+
+} // namespace cu
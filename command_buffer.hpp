@@ -0,0 +1,319 @@
+#pragma once
+
+#include "framebuffer.hpp"
+#include "instancing.hpp"
+#include "job_system.hpp"
+#include "mat.hpp"
+#include "mesh.hpp"
+#include "msaa.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+
+namespace cu
+{
+
+/// A recorded sequence of rendering commands in a compact binary encoding.
+///
+/// Command buffers do not share any state, so several threads can record
+/// into different buffers at the same time. The buffers are then executed
+/// in order by a CommandExecutor. Every command buffer starts with the
+/// default state, i.e. it must set the projection, transform and color
+/// before drawing.
+class CommandBuffer
+{
+public:
+  enum class Opcode : std::uint8_t
+  {
+    Clear,
+    SetProjection,
+    SetTransform,
+    SetColor,
+    DrawMesh
+  };
+
+  CommandBuffer() = default;
+  explicit CommandBuffer( std::vector<std::uint8_t> data )
+    : data_( std::move(data) )
+  {}
+
+  /// Sets all pixels to color and the depth of all pixels to depth.
+  void clear( std::uint8_t color, float depth )
+  {
+    write( Opcode::Clear );
+    write( color );
+    write( depth );
+  }
+
+  void setProjection( const Projection<float> & projection )
+  {
+    write( Opcode::SetProjection );
+    write( projection );
+  }
+
+  /// Sets the transformation from model space to view space.
+  void setTransform( const Mat<float,4,4> & transform )
+  {
+    write( Opcode::SetTransform );
+    write( transform );
+  }
+
+  void setColor( std::uint8_t color )
+  {
+    write( Opcode::SetColor );
+    write( color );
+  }
+
+  /// Draws the mesh with the given index in the mesh table of the executor
+  /// with the current transform and color.
+  void drawMesh( std::uint32_t meshId )
+  {
+    write( Opcode::DrawMesh );
+    write( meshId );
+  }
+
+  void reset() { data_.clear(); }
+  bool empty() const { return data_.empty(); }
+  const std::vector<std::uint8_t> & getData() const { return data_; }
+
+  /// Decodes the commands and calls the corresponding member functions
+  /// onClear(), onSetProjection(), onSetTransform(), onSetColor() and
+  /// onDrawMesh() of the visitor. Throws std::runtime_error if the data is
+  /// malformed.
+  template <typename Visitor>
+  void visit( Visitor && visitor ) const
+  {
+    std::size_t pos = 0;
+    while ( pos != data_.size() )
+    {
+      switch ( read<Opcode>( pos ) )
+      {
+      case Opcode::Clear:
+      {
+        const auto color = read<std::uint8_t>( pos );
+        visitor.onClear( color, read<float>( pos ) );
+        break;
+      }
+      case Opcode::SetProjection:
+        visitor.onSetProjection( read<Projection<float>>( pos ) );
+        break;
+      case Opcode::SetTransform:
+        visitor.onSetTransform( read<Mat<float,4,4>>( pos ) );
+        break;
+      case Opcode::SetColor:
+        visitor.onSetColor( read<std::uint8_t>( pos ) );
+        break;
+      case Opcode::DrawMesh:
+        visitor.onDrawMesh( read<std::uint32_t>( pos ) );
+        break;
+      default:
+        throw std::runtime_error( "Invalid opcode in command buffer." );
+      }
+    }
+  }
+
+private:
+  template <typename T>
+  void write( const T & value )
+  {
+    static_assert( std::is_trivially_copyable<T>::value, "" );
+    const auto pos = data_.size();
+    data_.resize( pos + sizeof(T) );
+    std::memcpy( &data_[pos], &value, sizeof(T) );
+  }
+
+  template <typename T>
+  T read( std::size_t & pos ) const
+  {
+    static_assert( std::is_trivially_copyable<T>::value, "" );
+    if ( data_.size() - pos < sizeof(T) )
+      throw std::runtime_error( "Truncated command buffer." );
+    T value;
+    std::memcpy( &value, &data_[pos], sizeof(T) );
+    pos += sizeof(T);
+    return value;
+  }
+
+  std::vector<std::uint8_t> data_;
+};
+
+
+namespace detail
+{
+
+  constexpr char commandFileMagic[8] = { 'R','3','D','C','M','D','S','\0' };
+  constexpr std::uint32_t commandFileVersion = 1;
+
+  template <typename T>
+  void writeBinary( std::ostream & stream, const T & value )
+  {
+    stream.write( reinterpret_cast<const char*>(&value), sizeof(T) );
+  }
+
+  template <typename T>
+  T readBinary( std::istream & stream )
+  {
+    T value;
+    if ( !stream.read( reinterpret_cast<char*>(&value), sizeof(T) ) )
+      throw std::runtime_error( "Unexpected end of command file." );
+    return value;
+  }
+
+} // namespace detail
+
+
+/// Writes a captured frame, i.e. the command buffers in submission order.
+/// The file uses the byte order of the machine. Meshes are referenced by
+/// index and are not part of the file.
+inline void writeCommandBuffers( std::ostream & stream,
+                                 const std::vector<CommandBuffer> & buffers )
+{
+  stream.write( detail::commandFileMagic, sizeof(detail::commandFileMagic) );
+  detail::writeBinary( stream, detail::commandFileVersion );
+  detail::writeBinary( stream, std::uint64_t(buffers.size()) );
+  for ( const auto & buffer : buffers )
+  {
+    const auto & data = buffer.getData();
+    detail::writeBinary( stream, std::uint64_t(data.size()) );
+    stream.write( reinterpret_cast<const char*>(data.data()), data.size() );
+  }
+  if ( !stream )
+    throw std::runtime_error( "Could not write command file." );
+}
+
+
+inline std::vector<CommandBuffer> readCommandBuffers( std::istream & stream )
+{
+  char magic[sizeof(detail::commandFileMagic)];
+  if ( !stream.read( magic, sizeof(magic) ) ||
+       std::memcmp( magic, detail::commandFileMagic, sizeof(magic) ) != 0 )
+    throw std::runtime_error( "Not a command file." );
+  if ( detail::readBinary<std::uint32_t>( stream ) != detail::commandFileVersion )
+    throw std::runtime_error( "Unsupported command file version." );
+  const auto nBuffers = detail::readBinary<std::uint64_t>( stream );
+  std::vector<CommandBuffer> buffers;
+  for ( std::uint64_t i = 0; i < nBuffers; ++i )
+  {
+    const auto size = detail::readBinary<std::uint64_t>( stream );
+    std::vector<std::uint8_t> data;
+    // grow while reading, so a corrupt size cannot exhaust memory
+    constexpr std::uint64_t chunkSize = 1 << 20;
+    for ( std::uint64_t pos = 0; pos < size; pos += chunkSize )
+    {
+      const auto n = std::min( chunkSize, size - pos );
+      data.resize( pos + n );
+      if ( !stream.read( reinterpret_cast<char*>(&data[pos]), n ) )
+        throw std::runtime_error( "Unexpected end of command file." );
+    }
+    buffers.emplace_back( std::move(data) );
+  }
+  return buffers;
+}
+
+
+/// Executes command buffers. Consecutive draws of the same mesh are
+/// collected and drawn as instances in one go.
+class CommandExecutor
+{
+public:
+  /// The mesh ids used in the command buffers index into the given meshes.
+  CommandExecutor( JobSystem & jobSystem,
+                   std::vector<MeshView<float>> meshes )
+    : jobSystem_( jobSystem )
+    , meshes_( std::move(meshes) )
+    , renderer_( jobSystem )
+  {}
+
+  /// Executes the buffers in order. Every triangle is drawn with the color
+  /// shadeFace( normal, color ) as for InstancedRenderer::draw().
+  template <typename Image, typename ZBuffer, typename ShadeFace>
+  void execute( const CommandBuffer * buffers,
+                std::size_t nBuffers,
+                Image & img,
+                ZBuffer & zBuffer,
+                ShadeFace && shadeFace )
+  {
+    for ( std::size_t i = 0; i < nBuffers; ++i )
+    {
+      Visitor<Image,ZBuffer,ShadeFace> visitor{
+        *this, img, zBuffer, shadeFace, {}, {}, 0 };
+      buffers[i].visit( visitor );
+      visitor.flush();
+    }
+  }
+
+private:
+  template <typename Image, typename ZBuffer, typename ShadeFace>
+  struct Visitor
+  {
+    CommandExecutor & executor;
+    Image & img;
+    ZBuffer & zBuffer;
+    ShadeFace & shadeFace;
+    Projection<float> projection;
+    Mat<float,4,4> transform;
+    std::uint8_t color;
+
+    void onClear( std::uint8_t clearColor, float depth )
+    {
+      flush();
+      cu::clear( img, clearColor, executor.jobSystem_ );
+      cu::clear( zBuffer, depth, executor.jobSystem_ );
+    }
+
+    void onSetProjection( const Projection<float> & newProjection )
+    {
+      flush();
+      projection = newProjection;
+    }
+
+    void onSetTransform( const Mat<float,4,4> & newTransform )
+    {
+      transform = newTransform;
+    }
+
+    void onSetColor( std::uint8_t newColor )
+    {
+      color = newColor;
+    }
+
+    void onDrawMesh( std::uint32_t meshId )
+    {
+      if ( meshId >= executor.meshes_.size() )
+        throw std::out_of_range( "Mesh id out of range." );
+      if ( meshId != executor.batchMeshId_ )
+        flush();
+      executor.batchMeshId_ = meshId;
+      executor.transforms_.push_back( transform );
+      executor.colors_.push_back( color );
+    }
+
+    void flush()
+    {
+      if ( !executor.transforms_.empty() )
+        executor.renderer_.draw( img, zBuffer,
+                                 executor.meshes_[executor.batchMeshId_],
+                                 executor.transforms_.data(),
+                                 executor.colors_.data(),
+                                 executor.transforms_.size(),
+                                 projection, shadeFace );
+      executor.transforms_.clear();
+      executor.colors_.clear();
+    }
+  };
+
+  JobSystem & jobSystem_;
+  std::vector<MeshView<float>> meshes_;
+  InstancedRenderer<float> renderer_;
+  std::uint32_t batchMeshId_{};
+  std::vector<Mat<float,4,4>> transforms_;
+  std::vector<std::uint8_t> colors_;
+};
+
+} // namespace cu
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "command_buffer.hpp"
+#include "instancing.hpp"
+#include "mat.hpp"
+#include "quaternion.hpp"
+#include "shading.hpp"
+#include "trafo_mats.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cstdint>
+
+
+namespace cu
+{
+
+/// The demo scene: a cube in front of the camera, which is tilted about the
+/// x-axis and rotated about the y-axis. It is shared by the window and the
+/// render server. The cube must have the mesh id 0 in the executor.
+struct CubeScene
+{
+  float angle = 0;
+  float pitch = -0.3f;
+  float distance = 6;
+  std::uint8_t color = 0xFF;
+
+  static constexpr float maxZ = -0.1f;
+  static constexpr float minZ = -100.f;
+
+  Mat<float,4,4> getTransform() const
+  {
+    const auto rotation =
+            makeAxisAngleQuaternion( makeVec( 1.f, 0.f, 0.f ), pitch ) *
+            makeAxisAngleQuaternion( makeVec( 0.f, 1.f, 0.f ), angle );
+    return makeExtendedMat( makeAffineMat( TrsTransform<float>{
+            makeVec( 0.f, 0.f, -distance ), rotation, 1.f } ) );
+  }
+
+  static Projection<float> getProjection( std::size_t width, std::size_t height )
+  {
+    const auto scaleFactor = std::min( width, height );
+    return { 1.5f*scaleFactor, float(width), float(height), maxZ };
+  }
+
+  /// A key light from the upper left front and a dim headlight at the
+  /// camera, both fixed in view space. Unlike the original flat shading
+  /// 0.2 + 0.8*cos^2 the faces get highlights and the one facing the camera
+  /// is lit a little by the headlight.
+  static Lighting getLighting()
+  {
+    Material material;
+    material.ambient = 0.15f;
+    material.diffuse = 0.7f;
+    material.specular = 0.4f;
+    material.shininess = 24;
+    material.isTwoSided = true;
+    return { { DirectionalLight{ makeVec( -1.f, -1.f, 2.f ) } },
+             { PointLight{ makeVec( 0.f, 0.f, 0.f ), makeVec( 0.3f, 0.3f, 0.3f ), 0.01f } },
+             material };
+  }
+
+  void record( CommandBuffer & commands, std::size_t width, std::size_t height ) const
+  {
+    commands.clear( 0, minZ );
+    commands.setProjection( getProjection( width, height ) );
+    commands.setTransform( getTransform() );
+    commands.setColor( color );
+    commands.drawMesh( 0 );
+  }
+};
+
+} // namespace cu
@@ -0,0 +1,847 @@
+#include "differential_fuzz.hpp"
+
+#include "command_buffer.hpp"
+#include "drawing.hpp"
+#include "fast_trig.hpp"
+#include "framebuffer.hpp"
+#include "instancing.hpp"
+#include "job_system.hpp"
+#include "mat.hpp"
+#include "mesh.hpp"
+#include "msaa.hpp"
+#include "quaternion.hpp"
+#include "shading.hpp"
+#include "texture.hpp"
+#include "trafo_mats.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+namespace cu
+{
+
+namespace
+{
+
+  constexpr float minZ = -100.f;
+  constexpr float maxZ = -0.1f;
+
+
+  struct Triangle
+  {
+    Vec<float,2> A, B, C;
+    float z;
+    std::uint8_t color;
+  };
+
+
+  std::string describe( const Triangle & t )
+  {
+    std::ostringstream stream;
+    stream << std::setprecision(9)
+           << "{ (" << t.A[0] << ", " << t.A[1] << "), ("
+                    << t.B[0] << ", " << t.B[1] << "), ("
+                    << t.C[0] << ", " << t.C[1] << "), z = " << t.z
+           << ", color = " << int(t.color) << " }";
+    return stream.str();
+  }
+
+
+  double getDistanceToSegment( double x, double y,
+                               const Vec<float,2> & P,
+                               const Vec<float,2> & Q )
+  {
+    const double dx = double(Q[0]) - P[0];
+    const double dy = double(Q[1]) - P[1];
+    const double sqrLength = dx*dx + dy*dy;
+    double t = 0;
+    if ( sqrLength > 0 )
+      t = std::clamp( ( ( x - P[0] )*dx + ( y - P[1] )*dy ) / sqrLength, 0., 1. );
+    return std::hypot( x - ( P[0] + t*dx ), y - ( P[1] + t*dy ) );
+  }
+
+
+  /// The distance between two floats in units in the last place.
+  std::int64_t getUlpDistance( float lhs, float rhs )
+  {
+    std::int32_t lhsBits, rhsBits;
+    std::memcpy( &lhsBits, &lhs, sizeof(lhsBits) );
+    std::memcpy( &rhsBits, &rhs, sizeof(rhsBits) );
+    // Map the sign-magnitude representation onto a monotonic integer scale.
+    const auto toOrdered = []( std::int32_t bits ) -> std::int64_t
+    { return bits < 0 ? std::int64_t(INT32_MIN) - bits : bits; };
+    return std::abs( toOrdered( lhsBits ) - toOrdered( rhsBits ) );
+  }
+
+
+  template <std::size_t nRows, std::size_t nCols>
+  Mat<double,nRows,nCols> toDouble( const Mat<float,nRows,nCols> & m )
+  {
+    Mat<double,nRows,nCols> result;
+    for ( std::size_t row = 0; row < nRows; ++row )
+      for ( std::size_t col = 0; col < nCols; ++col )
+        result[row][col] = m[row][col];
+    return result;
+  }
+
+
+  template <std::size_t nRows, std::size_t nCols>
+  double getMaxDifference( const Mat<float,nRows,nCols> & lhs,
+                           const Mat<double,nRows,nCols> & rhs )
+  {
+    double result = 0;
+    for ( std::size_t row = 0; row < nRows; ++row )
+      for ( std::size_t col = 0; col < nCols; ++col )
+        result = std::max( result, std::abs( lhs[row][col] - rhs[row][col] ) );
+    return result;
+  }
+
+
+  /// Runs one case with its own random numbers.
+  class FuzzCase
+  {
+  public:
+    FuzzCase( std::uint64_t seed, std::ostream & out, JobSystem & jobSystem )
+      : seed_( seed )
+      , rng_( seed )
+      , out_( out )
+      , jobSystem_( jobSystem )
+    {}
+
+    bool run()
+    {
+      checkRasterizers();
+      checkTexturedTriangles();
+      checkCommandExecutor();
+      checkTransforms();
+      checkSinCos();
+      checkLighting();
+      return isOk_;
+    }
+
+  private:
+    float getUniform( float min, float max )
+    {
+      return std::uniform_real_distribution<float>( min, max )( rng_ );
+    }
+
+    std::size_t getIndex( std::size_t n )
+    {
+      return std::uniform_int_distribution<std::size_t>( 0, n-1 )( rng_ );
+    }
+
+    void fail( const std::string & what )
+    {
+      out_ << "case " << seed_ << ": " << what << '\n';
+      isOk_ = false;
+    }
+
+    Vec<float,2> makePoint( float nCols, float nRows, float margin )
+    {
+      return { getUniform( -margin*nCols, (1+margin)*nCols ),
+               getUniform( -margin*nRows, (1+margin)*nRows ) };
+    }
+
+    Triangle makeTriangle( std::size_t nRows, std::size_t nCols )
+    {
+      const auto w = float(nCols);
+      const auto h = float(nRows);
+      Triangle t;
+      switch ( getIndex( 7 ) )
+      {
+      case 0: // anywhere around the image
+        t.A = makePoint( w, h, 0.25f );
+        t.B = makePoint( w, h, 0.25f );
+        t.C = makePoint( w, h, 0.25f );
+        break;
+      case 1: // sliver
+      {
+        t.A = makePoint( w, h, 0.f );
+        const Vec<float,2> d{ getUniform( -w, w ), getUniform( -h, h ) };
+        const auto thickness = std::pow( 10.f, getUniform( -4.f, 0.f ) );
+        t.B = t.A + d;
+        t.C = t.A + getUniform( 0.f, 1.f ) * d +
+              thickness * Vec<float,2>{ -d[1], d[0] } / ( l2Norm( d ) + 1e-3f );
+        break;
+      }
+      case 2: // degenerate
+        t.A = makePoint( w, h, 0.1f );
+        t.B = getIndex( 2 ) ? t.A : makePoint( w, h, 0.1f );
+        t.C = t.A + getUniform( -1.f, 2.f ) * ( t.B - t.A );
+        break;
+      case 3: // off-screen
+      {
+        t.A = makePoint( w, h, 0.f );
+        t.B = t.A + Vec<float,2>{ getUniform( 1.f, 20.f ), getUniform( -20.f, 20.f ) };
+        t.C = t.A + Vec<float,2>{ getUniform( -20.f, 20.f ), getUniform( 1.f, 20.f ) };
+        const Vec<float,2> shifts[] = {
+          { -w-25, 0 }, { w+5, 0 }, { 0, -h-25 }, { 0, h+5 } };
+        const auto & shift = shifts[getIndex( 4 )];
+        t.A += shift;
+        t.B += shift;
+        t.C += shift;
+        break;
+      }
+      case 4: // huge
+        t.A = makePoint( w, h, 1e4f );
+        t.B = makePoint( w, h, 1e4f );
+        t.C = makePoint( w, h, 1e4f );
+        break;
+      case 5: // on the pixel grid and halfway between, which causes ties
+        for ( auto P : { &t.A, &t.B, &t.C } )
+          *P = { std::round( 2*getUniform( -2.f, w+2 ) ) / 2,
+                 std::round( 2*getUniform( -2.f, h+2 ) ) / 2 };
+        break;
+      default: // with a horizontal edge
+        t.A = makePoint( w, h, 0.1f );
+        t.B = { getUniform( -0.1f*w, 1.1f*w ), t.A[1] };
+        t.C = makePoint( w, h, 0.1f );
+        break;
+      }
+      // Some triangles lie beyond maxZ.
+      t.z = getUniform( minZ, 0.f );
+      t.color = std::uint8_t( 1 + getIndex( 255 ) );
+      return t;
+    }
+
+    PixelRect makeRect( std::size_t nRows, std::size_t nCols )
+    {
+      const auto left = std::ptrdiff_t( getIndex( nCols+1 ) );
+      const auto top = std::ptrdiff_t( getIndex( nRows+1 ) );
+      return { left, top,
+               left + std::ptrdiff_t( getIndex( nCols - left + 1 ) ),
+               top + std::ptrdiff_t( getIndex( nRows - top + 1 ) ) };
+    }
+
+    /// Compares drawing into tiled, scissored and multisampled buffers with
+    /// drawing into plain matrices.
+    void checkRasterizers()
+    {
+      const auto nRows = 1 + getIndex( 70 );
+      const auto nCols = 1 + getIndex( 70 );
+      std::vector<Triangle> triangles( 1 + getIndex( 4 ) );
+      for ( std::size_t i = 0; i < triangles.size(); ++i )
+      {
+        triangles[i] = makeTriangle( nRows, nCols );
+        // Equal depths test the tie rule of the depth test.
+        if ( i > 0 && getIndex( 3 ) == 0 )
+          triangles[i].z = triangles[i-1].z;
+      }
+      const auto rect = makeRect( nRows, nCols );
+      const auto nSamples = getIndex( 2 ) ? 8 : 4;
+
+      Mat<std::uint8_t> refImg( nRows, nCols, 0 );
+      Mat<float> refDepth( nRows, nCols, minZ );
+      TiledMat<std::uint8_t> tiledImg( nRows, nCols );
+      TiledMat<float> tiledDepth( nRows, nCols );
+      clear( tiledImg, std::uint8_t(0) );
+      clear( tiledDepth, minZ );
+      Mat<std::uint8_t> scissoredImg( nRows, nCols, 0 );
+      Mat<float> scissoredDepth( nRows, nCols, minZ );
+      ScissoredImage<Mat<std::uint8_t>> scissoredImgView( scissoredImg, rect );
+      ScissoredImage<Mat<float>> scissoredDepthView( scissoredDepth, rect );
+      MsaaMat<std::uint8_t> msaaImg( nRows, nCols, nSamples );
+      MsaaMat<float> msaaDepth( nRows, nCols, nSamples );
+      clear( msaaImg, std::uint8_t(0) );
+      clear( msaaDepth, minZ );
+      MsaaMat<std::uint8_t> msaaScissoredImg( nRows, nCols, nSamples );
+      MsaaMat<float> msaaScissoredDepth( nRows, nCols, nSamples );
+      clear( msaaScissoredImg, std::uint8_t(0) );
+      clear( msaaScissoredDepth, minZ );
+      ScissoredImage<MsaaMat<std::uint8_t>> msaaScissoredImgView( msaaScissoredImg, rect );
+      ScissoredImage<MsaaMat<float>> msaaScissoredDepthView( msaaScissoredDepth, rect );
+
+      for ( const auto & t : triangles )
+      {
+        drawTriangle( refImg, t.A, t.B, t.C, t.color, refDepth, maxZ, t.z );
+        drawTriangle( tiledImg, t.A, t.B, t.C, t.color, tiledDepth, maxZ, t.z );
+        drawTriangle( scissoredImgView, t.A, t.B, t.C, t.color, scissoredDepthView, maxZ, t.z );
+        drawTriangle( msaaImg, t.A, t.B, t.C, t.color, msaaDepth, maxZ, t.z );
+        drawTriangle( msaaScissoredImgView, t.A, t.B, t.C, t.color,
+                      msaaScissoredDepthView, maxZ, t.z );
+      }
+      Mat<std::uint8_t> msaaResolved( nRows, nCols, 0 );
+      resolve( msaaImg, msaaResolved, jobSystem_ );
+      Mat<std::uint8_t> msaaScissoredResolved( nRows, nCols, 0 );
+      resolve( msaaScissoredImg, msaaScissoredResolved, jobSystem_ );
+
+      std::ostringstream setup;
+      setup << nRows << "x" << nCols << " image, scissor rect { " << rect.left
+            << ", " << rect.top << ", " << rect.right << ", " << rect.bottom
+            << " }, " << nSamples << " samples, triangles";
+      for ( const auto & t : triangles )
+        setup << ' ' << describe( t );
+
+      // Pixels closer to an edge than the farthest sample of a pixel may be
+      // covered differently by multisampling. Far from the image the
+      // reference loses precision, so the margin grows with the
+      // coordinates.
+      float maxCoord = 0;
+      for ( const auto & t : triangles )
+        for ( const auto & P : { t.A, t.B, t.C } )
+          maxCoord = std::max( { maxCoord, std::abs( P[0] ), std::abs( P[1] ) } );
+      const auto edgeMargin = 0.75 + 1e-6 * maxCoord;
+      const auto isNearEdge = [&]( std::size_t row, std::size_t col )
+      {
+        for ( const auto & t : triangles )
+          if ( getDistanceToSegment( col, row, t.A, t.B ) <= edgeMargin ||
+               getDistanceToSegment( col, row, t.B, t.C ) <= edgeMargin ||
+               getDistanceToSegment( col, row, t.C, t.A ) <= edgeMargin )
+            return true;
+        return false;
+      };
+
+      std::size_t nTiledDiffs = 0, nScissoredDiffs = 0, nMsaaDiffs = 0, nMsaaScissoredDiffs = 0;
+      std::ostringstream firstDiffs;
+      const auto report = [&]( std::size_t & nDiffs, const char * variant,
+                               std::size_t row, std::size_t col, int expected, int actual )
+      {
+        if ( nDiffs++ == 0 )
+          firstDiffs << "\n  " << variant << " differs first at row " << row
+                     << ", col " << col << ": " << actual << " instead of " << expected;
+      };
+      for ( std::size_t row = 0; row < nRows; ++row )
+        for ( std::size_t col = 0; col < nCols; ++col )
+        {
+          const auto ref = refImg[row][col];
+          if ( tiledImg[row][col] != ref || tiledDepth[row][col] != refDepth[row][col] )
+            report( nTiledDiffs, "TiledMat", row, col, ref, tiledImg[row][col] );
+          const bool isInside = std::ptrdiff_t(row) >= rect.top && std::ptrdiff_t(row) < rect.bottom &&
+                                std::ptrdiff_t(col) >= rect.left && std::ptrdiff_t(col) < rect.right;
+          if ( scissoredImg[row][col] != ( isInside ? ref : 0 ) )
+            report( nScissoredDiffs, "ScissoredImage", row, col,
+                    isInside ? ref : 0, scissoredImg[row][col] );
+          if ( msaaResolved[row][col] != ref && !isNearEdge( row, col ) )
+            report( nMsaaDiffs, "MsaaMat", row, col, ref, msaaResolved[row][col] );
+          const auto msaaRef = isInside ? msaaResolved[row][col] : 0;
+          if ( msaaScissoredResolved[row][col] != msaaRef )
+            report( nMsaaScissoredDiffs, "ScissoredImage<MsaaMat>", row, col,
+                    msaaRef, msaaScissoredResolved[row][col] );
+        }
+      if ( nTiledDiffs + nScissoredDiffs + nMsaaDiffs + nMsaaScissoredDiffs != 0 )
+        fail( "rasterizers differ in " + std::to_string( nTiledDiffs ) + " tiled, " +
+              std::to_string( nScissoredDiffs ) + " scissored, " +
+              std::to_string( nMsaaDiffs ) + " multisampled and " +
+              std::to_string( nMsaaScissoredDiffs ) + " scissored multisampled pixels for " +
+              setup.str() + firstDiffs.str() );
+    }
+
+    /// Compares textured triangles with a reference in double precision,
+    /// which interpolates the texture coordinates with barycentric
+    /// coordinates. Float rounding may move a pixel across a texel or mipmap
+    /// boundary, so the result only has to lie within the range of reference
+    /// samples around the exact coordinates and level of detail. The covered
+    /// pixels must be those of a flat colored triangle.
+    void checkTexturedTriangles()
+    {
+      const auto nRows = 1 + getIndex( 40 );
+      const auto nCols = 1 + getIndex( 40 );
+      const auto w = float(nCols);
+      const auto h = float(nRows);
+      const Vec<float,2> A = makePoint( w, h, 0.25f );
+      const Vec<float,2> B = makePoint( w, h, 0.25f );
+      const Vec<float,2> C = makePoint( w, h, 0.25f );
+      const auto makeUv = [this]{ return Vec<float,2>{ getUniform( -2, 3 ), getUniform( -2, 3 ) }; };
+      const Vec<float,2> uvs[] = { makeUv(), makeUv(), makeUv() };
+      const bool isAffine = getIndex( 4 ) == 0;
+      const auto makeW = [&]{ return isAffine ? 1.f : std::pow( 10.f, getUniform( -1, 1 ) ); };
+      const float ws[] = { makeW(), makeW(), makeW() };
+      const TextureFilter filters[] = {
+        TextureFilter::Nearest, TextureFilter::Bilinear, TextureFilter::Trilinear };
+      const auto filter = filters[getIndex( 3 )];
+      Mat<std::uint8_t> texels( 1 + getIndex( 20 ), 1 + getIndex( 20 ) );
+      for ( std::size_t row = 0; row < texels.getNRows(); ++row )
+        for ( std::size_t col = 0; col < texels.getNCols(); ++col )
+          texels[row][col] = std::uint8_t( rng_() );
+      const Texture<std::uint8_t> texture( texels );
+
+      // Triangles with tiny angles make the float interpolation inaccurate,
+      // which is not what this checks.
+      const Vec<double,2> AB{ double(B[0]) - A[0], double(B[1]) - A[1] };
+      const Vec<double,2> AC{ double(C[0]) - A[0], double(C[1]) - A[1] };
+      const auto det = AB[0]*AC[1] - AC[0]*AB[1];
+      if ( !( std::abs( det ) >= 0.05 * l2Norm( AB ) * l2Norm( AC ) ) )
+        return;
+
+      const float z = -1;
+      Mat<std::uint8_t> img( nRows, nCols, 0 );
+      Mat<float> depth( nRows, nCols, minZ );
+      drawTriangle( img, A, B, C, uvs[0], uvs[1], uvs[2], ws[0], ws[1], ws[2],
+                    texture, filter, depth, maxZ, z );
+      TiledMat<std::uint8_t> tiledImg( nRows, nCols );
+      TiledMat<float> tiledDepth( nRows, nCols );
+      clear( tiledImg, std::uint8_t(0) );
+      clear( tiledDepth, minZ );
+      drawTriangle( tiledImg, A, B, C, uvs[0], uvs[1], uvs[2], ws[0], ws[1], ws[2],
+                    texture, filter, tiledDepth, maxZ, z );
+      Mat<std::uint8_t> flatImg( nRows, nCols, 0 );
+      Mat<float> flatDepth( nRows, nCols, minZ );
+      drawTriangle( flatImg, A, B, C, std::uint8_t(1), flatDepth, maxZ, z );
+
+      // The derivatives of the barycentric coordinates of B and C.
+      const double dBdx = AC[1] / det, dCdx = -AB[1] / det;
+      const double dBdy = -AC[0] / det, dCdy = AB[0] / det;
+      // Generous bounds for the rounding of the float interpolation: 0.05
+      // texels and 0.01 mipmap levels.
+      const double du = 0.05 / texture.getNCols();
+      const double dv = 0.05 / texture.getNRows();
+      const double dLod = 0.01;
+      std::size_t nDiffs = 0;
+      std::ostringstream firstDiff;
+      for ( std::size_t row = 0; row < nRows; ++row )
+        for ( std::size_t col = 0; col < nCols; ++col )
+        {
+          const auto actual = img[row][col];
+          if ( tiledImg[row][col] != actual || tiledDepth[row][col] != depth[row][col] ||
+               depth[row][col] != flatDepth[row][col] )
+          {
+            if ( nDiffs++ == 0 )
+              firstDiff << "coverage or TiledMat differs at row " << row << ", col " << col;
+            continue;
+          }
+          if ( flatImg[row][col] == 0 )
+            continue;
+          const auto b = ( col - A[0] ) * dBdx + ( row - A[1] ) * dBdy;
+          const auto c = ( col - A[0] ) * dCdx + ( row - A[1] ) * dCdy;
+          const double weights[] = { 1 - b - c, b, c };
+          const double weightsPerX[] = { -dBdx - dCdx, dBdx, dCdx };
+          const double weightsPerY[] = { -dBdy - dCdy, dBdy, dCdy };
+          // u = sum(weight*u/w) / sum(weight/w) and the same for v.
+          double num[2] = {}, numPerX[2] = {}, numPerY[2] = {};
+          double den = 0, denPerX = 0, denPerY = 0;
+          for ( std::size_t k = 0; k < 3; ++k )
+          {
+            for ( std::size_t dim = 0; dim < 2; ++dim )
+            {
+              num[dim] += weights[k] * uvs[k][dim] / ws[k];
+              numPerX[dim] += weightsPerX[k] * uvs[k][dim] / ws[k];
+              numPerY[dim] += weightsPerY[k] * uvs[k][dim] / ws[k];
+            }
+            den += weights[k] / ws[k];
+            denPerX += weightsPerX[k] / ws[k];
+            denPerY += weightsPerY[k] / ws[k];
+          }
+          const auto u = num[0] / den;
+          const auto v = num[1] / den;
+          const auto lod = texture.computeLod(
+              ( numPerX[0] - u * denPerX ) / den, ( numPerX[1] - v * denPerX ) / den,
+              ( numPerY[0] - u * denPerY ) / den, ( numPerY[1] - v * denPerY ) / den );
+          int minExpected = 255, maxExpected = 0;
+          for ( const auto uOffset : { -du, 0., du } )
+            for ( const auto vOffset : { -dv, 0., dv } )
+              for ( const auto lodOffset : { -dLod, 0., dLod } )
+              {
+                const int expected = texture.sample( u + uOffset, v + vOffset,
+                                                     lod + lodOffset, filter );
+                minExpected = std::min( minExpected, expected );
+                maxExpected = std::max( maxExpected, expected );
+              }
+          if ( actual + 1 < minExpected || actual > maxExpected + 1 )
+            if ( nDiffs++ == 0 )
+              firstDiff << "row " << row << ", col " << col << " is " << int(actual)
+                        << " instead of " << minExpected << " to " << maxExpected
+                        << " at u = " << u << ", v = " << v << ", lod = " << lod;
+        }
+      if ( nDiffs != 0 )
+      {
+        std::ostringstream stream;
+        stream << std::setprecision(9) << "textured triangle differs in " << nDiffs
+               << " pixels for " << nRows << "x" << nCols << " image, "
+               << texels.getNRows() << "x" << texels.getNCols() << " texture, filter "
+               << int(filter) << ", vertices";
+        for ( std::size_t k = 0; k < 3; ++k )
+        {
+          const auto & P = k == 0 ? A : k == 1 ? B : C;
+          stream << " (" << P[0] << ", " << P[1] << ", uv " << uvs[k][0] << ", "
+                 << uvs[k][1] << ", w " << ws[k] << ")";
+        }
+        stream << ": " << firstDiff.str();
+        fail( stream.str() );
+      }
+    }
+
+    /// Executes a command buffer, which draws instances of meshes with the
+    /// batch shaded Lighting, and compares the result with drawing every
+    /// triangle of every instance in command order, shading faces one by one.
+    /// The executor culls, sorts and batches, which must not change any
+    /// pixel, since the depth test keeps the nearest triangle either way.
+    void checkCommandExecutor()
+    {
+      const auto nRows = 1 + getIndex( 60 );
+      const auto nCols = 1 + getIndex( 60 );
+      const auto cube = makeCubeMesh<float>();
+      // Triangles with separate vertices, since coinciding triangles with
+      // the same depth would make the result depend on the drawing order.
+      Mesh<float> random;
+      for ( std::size_t i = 0; i < 3 * ( 1 + getIndex( 8 ) ); ++i )
+      {
+        random.positions.push_back( makeVec3( 1 ) );
+        random.indices.push_back( std::uint32_t( i ) );
+      }
+      const std::vector<MeshView<float>> meshes = {
+        MeshView<float>( cube ), MeshView<float>( random ) };
+
+      std::vector<DirectionalLight> directionalLights( 1 + getIndex( 2 ) );
+      for ( auto & light : directionalLights )
+        light = { makeVec3( 1 ), { getUniform( 0, 1 ), getUniform( 0, 1 ), getUniform( 0, 1 ) } };
+      Material material;
+      material.ambient = getUniform( 0, 0.5f );
+      material.diffuse = getUniform( 0, 1 );
+      material.specular = getUniform( 0, 1 );
+      material.shininess = getUniform( 1, 64 );
+      material.isTwoSided = getIndex( 2 );
+      const Lighting lighting( directionalLights, {}, material );
+
+      const Projection<float> projection{
+        getUniform( 0.5f, 2.f ) * float( std::min( nRows, nCols ) ),
+        float(nCols), float(nRows), maxZ };
+      struct Draw
+      {
+        Mat<float,4,4> transform;
+        std::uint8_t color;
+        std::uint32_t meshId;
+      };
+      std::vector<Draw> draws( 1 + getIndex( 6 ) );
+      CommandBuffer commands;
+      commands.clear( 0, minZ );
+      commands.setProjection( projection );
+      for ( auto & draw : draws )
+      {
+        // Some instances lie partly or completely behind the camera or
+        // beside the view.
+        draw.transform = makeExtendedMat( makeAffineMat( TrsTransform<float>{
+            makeVec3( 4 ) + Vec<float,3>{ 0, 0, getUniform( -12, 1 ) },
+            makeRotationQuaternion( makeRotationVec() ), getUniform( 0.2f, 2 ) } ) );
+        draw.color = std::uint8_t( 1 + getIndex( 255 ) );
+        draw.meshId = std::uint32_t( getIndex( meshes.size() ) );
+        commands.setTransform( draw.transform );
+        commands.setColor( draw.color );
+        commands.drawMesh( draw.meshId );
+      }
+      Mat<std::uint8_t> img( nRows, nCols, 7 );
+      Mat<float> depth( nRows, nCols );
+      CommandExecutor executor( jobSystem_, meshes );
+      executor.execute( &commands, 1, img, depth, lighting );
+
+      Mat<std::uint8_t> refImg( nRows, nCols, 0 );
+      Mat<float> refDepth( nRows, nCols, minZ );
+      Vec3Array normal, position;
+      normal.resize( 1 );
+      position.resize( 1 );
+      for ( const auto & draw : draws )
+      {
+        const auto & mesh = meshes[draw.meshId];
+        std::vector<Vec<float,3>> points3d( mesh.nVertices );
+        for ( std::size_t i = 0; i < mesh.nVertices; ++i )
+          points3d[i] = detail::transformPoint( draw.transform, mesh.positions[i] );
+        for ( std::size_t i = 0; i + 2 < mesh.nIndices; i += 3 )
+        {
+          const auto & P = points3d[mesh.indices[i  ]];
+          const auto & Q = points3d[mesh.indices[i+1]];
+          const auto & R = points3d[mesh.indices[i+2]];
+          if ( std::max( { P[2], Q[2], R[2] } ) >= maxZ )
+            continue;
+          normal.set( 0, normalVector( P, Q, R ) );
+          position.set( 0, ( P + Q + R ) / 3.f );
+          std::uint8_t color;
+          lighting.shadeGray( normal, position, &draw.color, &color, 0, 1 );
+          drawTriangle( refImg, projection.project( P ), projection.project( Q ),
+                        projection.project( R ), color, refDepth, maxZ,
+                        ( P[2] + Q[2] + R[2] ) / 3 );
+        }
+      }
+
+      std::size_t nDiffs = 0;
+      std::ostringstream firstDiff;
+      for ( std::size_t row = 0; row < nRows; ++row )
+        for ( std::size_t col = 0; col < nCols; ++col )
+          if ( std::abs( img[row][col] - refImg[row][col] ) > 1 ||
+               depth[row][col] != refDepth[row][col] )
+            if ( nDiffs++ == 0 )
+              firstDiff << "row " << row << ", col " << col << " is " << int( img[row][col] )
+                        << " at depth " << depth[row][col] << " instead of "
+                        << int( refImg[row][col] ) << " at depth " << refDepth[row][col];
+      if ( nDiffs != 0 )
+        fail( "CommandExecutor differs in " + std::to_string( nDiffs ) + " pixels of a " +
+              std::to_string( nRows ) + "x" + std::to_string( nCols ) + " image with " +
+              std::to_string( draws.size() ) + " draws: " + firstDiff.str() );
+    }
+
+    Vec<float,3> makeRotationVec()
+    {
+      switch ( getIndex( 4 ) )
+      {
+      case 0:
+        return {};
+      case 1:
+        return normalize( Vec<float,3>{ getUniform( -1, 1 ), getUniform( -1, 1 ), 1 } ) *
+               std::pow( 10.f, getUniform( -7.f, -2.f ) );
+      default:
+        return { getUniform( -4, 4 ), getUniform( -4, 4 ), getUniform( -4, 4 ) };
+      }
+    }
+
+    Vec<float,3> makeVec3( float range )
+    {
+      return { getUniform( -range, range ), getUniform( -range, range ),
+               getUniform( -range, range ) };
+    }
+
+    void checkClose( const char * what, double difference, double tolerance )
+    {
+      if ( !( difference <= tolerance ) )
+      {
+        std::ostringstream stream;
+        stream << what << " differs by " << difference << ", more than " << tolerance;
+        fail( stream.str() );
+      }
+    }
+
+    /// Compares quaternions, TRS transforms and transformPoint() with the
+    /// generic matrix operations in double precision.
+    void checkTransforms()
+    {
+      const auto v1 = makeRotationVec();
+      const auto v2 = makeRotationVec();
+      const auto toDoubleVec = []( const Vec<float,3> & v )
+      { return Vec<double,3>{ v[0], v[1], v[2] }; };
+      const auto refRot1 = makeRotationMat( toDoubleVec( v1 ) );
+      const auto refRot2 = makeRotationMat( toDoubleVec( v2 ) );
+      const auto q1 = makeRotationQuaternion( v1 );
+      const auto q2 = makeRotationQuaternion( v2 );
+      checkClose( "makeRotationMat( Vec )",
+                  getMaxDifference( makeRotationMat( v1 ), refRot1 ), 2e-6 );
+      checkClose( "makeRotationMat( Quaternion )",
+                  getMaxDifference( makeRotationMat( q1 ), refRot1 ), 2e-6 );
+      checkClose( "Quaternion product",
+                  getMaxDifference( makeRotationMat( q1*q2 ), refRot1*refRot2 ), 4e-6 );
+      const auto p = makeVec3( 10 );
+      checkClose( "rotate()",
+                  getMaxDifference( Mat<float,1,3>{ rotate( q1, p ) },
+                                    Mat<double,1,3>{ refRot1 * toDoubleVec( p ) } ),
+                  4e-6 * ( 1 + l2Norm( p ) ) );
+
+      // The angle to the start grows linearly with t.
+      const auto t = getUniform( 0, 1 );
+      const auto a = normalize( q1 );
+      const auto b = normalize( q2 );
+      const auto s = slerp( a, b, t );
+      const auto getAngle = []( const Quaternion<float> & lhs, const Quaternion<float> & rhs )
+      { return std::acos( std::min( 1., std::abs( double( dot( lhs, rhs ) ) ) ) ); };
+      checkClose( "slerp()", std::abs( getAngle( a, s ) - t * getAngle( a, b ) ), 2e-3 );
+      checkClose( "slerp() norm", std::abs( dot( s, s ) - 1 ), 1e-5 );
+
+      const TrsTransform<float> trs1{ makeVec3( 100 ), q1, getUniform( 0.1f, 10 ) };
+      const TrsTransform<float> trs2{ makeVec3( 100 ), q2, getUniform( 0.1f, 10 ) };
+      const auto refMat1 = toDouble( makeExtendedMat( makeAffineMat( trs1 ) ) );
+      const auto refMat2 = toDouble( makeExtendedMat( makeAffineMat( trs2 ) ) );
+      const auto refProduct = refMat1 * refMat2;
+      double scale = 0;
+      for ( std::size_t row = 0; row < 4; ++row )
+        for ( std::size_t col = 0; col < 4; ++col )
+          scale = std::max( scale, std::abs( refProduct[row][col] ) );
+      checkClose( "TrsTransform product",
+                  getMaxDifference( makeExtendedMat( makeAffineMat( trs1*trs2 ) ), refProduct ),
+                  4e-6 * scale );
+
+      // detail::transformPoint() must agree with the generic Mat * Vec up to
+      // rounding.
+      Mat<float,4,4> m;
+      for ( std::size_t row = 0; row < 3; ++row )
+        m[row] = { getUniform( -10, 10 ), getUniform( -10, 10 ),
+                   getUniform( -10, 10 ), getUniform( -100, 100 ) };
+      m[3][3] = 1;
+      const auto q = makeVec3( 100 );
+      const auto fast = detail::transformPoint( m, q );
+      const auto generic = m * Vec<float,4>{ q[0], q[1], q[2], 1 };
+      for ( std::size_t row = 0; row < 3; ++row )
+      {
+        double magnitude = std::abs( m[row][3] );
+        for ( std::size_t col = 0; col < 3; ++col )
+          magnitude += std::abs( m[row][col] * q[col] );
+        checkClose( "detail::transformPoint()", std::abs( fast[row] - generic[row] ),
+                    4 * std::numeric_limits<float>::epsilon() * magnitude );
+      }
+    }
+
+    /// Compares sinCos() with std::sin() and std::cos() in double
+    /// precision. Away from the zeros the error must be at most 2 ulp.
+    void checkSinCos()
+    {
+      constexpr float pi = 3.14159265358979f;
+      std::vector<float> angles( 1 + getIndex( 100 ) );
+      for ( auto & angle : angles )
+        switch ( getIndex( 6 ) )
+        {
+        case 0: angle = getUniform( -pi, pi ); break;
+        case 1: angle = getUniform( -8192, 8192 ); break;
+        case 2: angle = float( getIndex( 10000 ) ) * pi/2 + getUniform( -1e-3f, 1e-3f ); break;
+        case 3: angle = std::pow( 10.f, getUniform( 4, 30 ) ) * ( getIndex( 2 ) ? 1 : -1 ); break;
+        case 4: angle = std::pow( 10.f, getUniform( -40, -3 ) ); break;
+        default:
+        {
+          const float special[] = { 0.f, -0.f, 8192.f, -8192.f, 8192.001f,
+                                    std::numeric_limits<float>::infinity(),
+                                    -std::numeric_limits<float>::infinity(),
+                                    std::numeric_limits<float>::quiet_NaN() };
+          angle = special[getIndex( std::size( special ) )];
+        }
+        }
+      std::vector<float> sines( angles.size() ), cosines( angles.size() );
+      sinCos( angles.data(), sines.data(), cosines.data(), angles.size() );
+      for ( std::size_t i = 0; i < angles.size(); ++i )
+      {
+        const auto check = [&]( const char * what, float actual, double expected )
+        {
+          const bool isOk = std::isnan( expected )
+              ? std::isnan( actual )
+              : getUlpDistance( actual, float( expected ) ) <= 2 ||
+                std::abs( actual - expected ) <= 1e-7;
+          if ( !isOk )
+          {
+            std::ostringstream stream;
+            stream << std::setprecision(9) << what << "( " << angles[i] << " ) is "
+                   << actual << " instead of " << expected;
+            fail( stream.str() );
+          }
+        };
+        check( "sin", sines[i], std::sin( double( angles[i] ) ) );
+        check( "cos", cosines[i], std::cos( double( angles[i] ) ) );
+      }
+    }
+
+    /// Compares Lighting with a straightforward implementation in double
+    /// precision. The results may differ by one for rounding. Points where
+    /// the side or the highlight flips are skipped.
+    void checkLighting()
+    {
+      std::vector<DirectionalLight> directionalLights( getIndex( 3 ) );
+      for ( auto & light : directionalLights )
+        light = { makeVec3( 1 ), { getUniform( 0, 1 ), getUniform( 0, 1 ), getUniform( 0, 1 ) } };
+      std::vector<PointLight> pointLights( getIndex( 3 ) );
+      for ( auto & light : pointLights )
+        light = { makeVec3( 5 ), { getUniform( 0, 1 ), getUniform( 0, 1 ), getUniform( 0, 1 ) },
+                  getUniform( 0, 0.5f ) };
+      Material material;
+      material.ambient = getUniform( 0, 0.5f );
+      material.diffuse = getUniform( 0, 1 );
+      material.specular = getUniform( 0, 1 );
+      material.shininess = getUniform( 1, 64 );
+      material.isTwoSided = getIndex( 2 );
+      const Lighting lighting( directionalLights, pointLights, material );
+
+      const auto n = 1 + getIndex( 40 );
+      Vec3Array normals, positions;
+      normals.resize( n );
+      positions.resize( n );
+      std::vector<std::uint32_t> colors( n ), shaded( n );
+      for ( std::size_t i = 0; i < n; ++i )
+      {
+        normals.set( i, normalize( makeVec3( 1 ) + Vec<float,3>{ 0, 0, 1e-3f } ) );
+        positions.set( i, makeVec3( 5 ) - Vec<float,3>{ 0, 0, 10 } );
+        colors[i] = std::uint32_t( rng_() );
+      }
+      std::vector<std::uint8_t> grays( n ), shadedGrays( n );
+      for ( std::size_t i = 0; i < n; ++i )
+        grays[i] = std::uint8_t( colors[i] );
+      lighting.shadeArgb( normals, positions, colors.data(), shaded.data(), 0, n );
+      lighting.shadeGray( normals, positions, grays.data(), shadedGrays.data(), 0, n );
+
+      for ( std::size_t i = 0; i < n; ++i )
+      {
+        Vec<double,3> normal{ normals.x[i], normals.y[i], normals.z[i] };
+        const Vec<double,3> position{ positions.x[i], positions.y[i], positions.z[i] };
+        const auto view = normalize( -1. * position );
+        const auto cosView = normal * view;
+        if ( std::abs( cosView ) < 1e-4 )
+          continue;
+        if ( material.isTwoSided && cosView < 0 )
+          normal = -1. * normal;
+        std::array<double,3> intensity = { material.ambient, material.ambient, material.ambient };
+        double grayIntensity = material.ambient;
+        bool isAmbiguous = false;
+        const auto addLight = [&]( const Vec<double,3> & toLight, double falloff,
+                                   const Vec<float,3> & color )
+        {
+          const auto cosLight = normal * toLight;
+          isAmbiguous |= std::abs( cosLight ) < 1e-4;
+          const auto cosHalf = std::max( 0., normal * normalize( toLight + view ) );
+          const auto s = double( material.shininess );
+          const auto diffuse = falloff * std::max( 0., cosLight );
+          const auto specular = cosLight > 0 ? falloff * cosHalf / ( s - s*cosHalf + cosHalf ) : 0;
+          for ( std::size_t channel = 0; channel < 3; ++channel )
+            intensity[channel] += color[channel] *
+                ( material.diffuse * diffuse + material.specular * specular );
+          grayIntensity += ( double( color[0] ) + color[1] + color[2] ) / 3 *
+                           ( material.diffuse * diffuse + material.specular * specular );
+        };
+        for ( const auto & light : directionalLights )
+          addLight( normalize( Vec<double,3>{ light.direction[0], light.direction[1],
+                                              light.direction[2] } ), 1, light.color );
+        for ( const auto & light : pointLights )
+        {
+          const auto toLight = Vec<double,3>{ light.position[0], light.position[1],
+                                              light.position[2] } - position;
+          addLight( normalize( toLight ), 1 / ( 1 + light.attenuation * sqrNorm( toLight ) ),
+                    light.color );
+        }
+        if ( isAmbiguous )
+          continue;
+
+        const auto shade = []( double intensity, std::uint32_t base )
+        { return std::min( 255., intensity * base ); };
+        bool isOk = std::abs( shadedGrays[i] - shade( grayIntensity, grays[i] ) ) <= 1 &&
+                    ( shaded[i] >> 24 ) == ( colors[i] >> 24 );
+        for ( std::size_t channel = 0; channel < 3; ++channel )
+        {
+          const auto shift = 16 - 8*channel;
+          isOk &= std::abs( double( ( shaded[i] >> shift ) & 0xFF ) -
+                            shade( intensity[channel], ( colors[i] >> shift ) & 0xFF ) ) <= 1;
+        }
+        if ( !isOk )
+        {
+          std::ostringstream stream;
+          stream << std::hex << "Lighting gives " << shaded[i] << " for " << colors[i]
+                 << std::dec << " and " << int( shadedGrays[i] ) << " for "
+                 << int( grays[i] ) << " at point " << i;
+          fail( stream.str() );
+        }
+      }
+    }
+
+    std::uint64_t seed_;
+    std::mt19937_64 rng_;
+    std::ostream & out_;
+    JobSystem & jobSystem_;
+    bool isOk_ = true;
+  };
+
+} // namespace
+
+
+std::size_t runDifferentialFuzz( std::uint64_t seed,
+                                 std::size_t nCases,
+                                 std::ostream & out )
+{
+  JobSystem jobSystem( 1 );
+  std::size_t nFailures = 0;
+  for ( std::size_t i = 0; i < nCases; ++i )
+    if ( !FuzzCase( seed + i, out, jobSystem ).run() )
+      ++nFailures;
+  out << nCases << " cases, " << nFailures << " failed" << std::endl;
+  return nFailures;
+}
+
+} // namespace cu
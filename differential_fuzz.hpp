@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+
+namespace cu
+{
+
+/// Runs nCases random test cases, which compare optimized kernels against
+/// their reference implementations:
+///
+///   - drawTriangle() into TiledMat and ScissoredImage buffers against
+///     drawTriangle() into Mat. These must match exactly.
+///   - Multisampled drawTriangle() against drawTriangle() into Mat. Pixels
+///     may only differ close to the edges of the triangles.
+///   - Perspective correct textured drawTriangle() against an interpolation
+///     in double precision, allowing for rounding at texel and mipmap
+///     boundaries.
+///   - CommandExecutor, which culls, sorts and shades in batches, against
+///     drawing every triangle in command order with Lighting shading one
+///     face at a time. Colors may differ by one.
+///   - Quaternions and TrsTransform against the matrices of trafo_mats.hpp,
+///     detail::transformPoint() against the generic Mat * Vec, sinCos()
+///     against std::sin() and std::cos() and Lighting against a scalar
+///     implementation in double precision.
+///
+/// The triangles include degenerate, sliver, off-screen and huge ones. The
+/// random numbers of case i are seeded with seed + i, so a failing case can
+/// be rerun on its own. Every difference is reported to out. Returns the
+/// number of failed cases.
+std::size_t runDifferentialFuzz( std::uint64_t seed,
+                                 std::size_t nCases,
+                                 std::ostream & out );
+
+} // namespace cu
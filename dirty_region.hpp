@@ -0,0 +1,211 @@
+#pragma once
+
+#include "drawing.hpp"
+#include "instancing.hpp"
+#include "mat.hpp"
+#include "mesh.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+
+namespace cu
+{
+
+/// Returns a rectangle containing all pixels the box can cover after
+/// transforming it into view space. If the box reaches behind the near plane,
+/// the whole screen is returned. If it lies completely behind the near plane,
+/// the result is empty.
+template <typename Coord>
+PixelRect getScreenBounds( const Box<Coord> & box,
+                           const Mat<Coord,4,4> & transform,
+                           const Projection<Coord> & projection )
+{
+  const PixelRect screen{ 0, 0, std::ptrdiff_t( std::ceil( projection.width ) ),
+                                std::ptrdiff_t( std::ceil( projection.height ) ) };
+  auto minX = std::numeric_limits<Coord>::max();
+  auto minY = minX;
+  auto maxX = std::numeric_limits<Coord>::lowest();
+  auto maxY = maxX;
+  std::size_t nClipped = 0;
+  for ( std::size_t i = 0; i != 8; ++i )
+  {
+    const Vec<Coord,3> corner{ i & 4 ? box.max[0] : box.min[0],
+                               i & 2 ? box.max[1] : box.min[1],
+                               i & 1 ? box.max[2] : box.min[2] };
+    const auto p = detail::transformPoint( transform, corner );
+    if ( p[2] >= projection.maxZ )
+    {
+      ++nClipped;
+      continue;
+    }
+    const auto q = projection.project( p );
+    minX = std::min( minX, q[0] );
+    minY = std::min( minY, q[1] );
+    maxX = std::max( maxX, q[0] );
+    maxY = std::max( maxY, q[1] );
+  }
+  if ( nClipped == 8 )
+    return {};
+  if ( nClipped != 0 )
+    return screen;
+  // Clamp before converting, so far away objects cannot overflow.
+  const auto toPixel = [&]( Coord v, Coord limit )
+  {
+    return std::ptrdiff_t( std::min( std::max( v, Coord(-1) ), limit + 1 ) );
+  };
+  return intersect( screen,
+      { toPixel( std::floor( minX ), projection.width ),
+        toPixel( std::floor( minY ), projection.height ),
+        toPixel( std::ceil( maxX ), projection.width ) + 1,
+        toPixel( std::ceil( maxY ), projection.height ) + 1 } );
+}
+
+
+/// Keeps track of the parts of the screen which must be redrawn, because
+/// objects have moved or changed since the previous frame. The screen is
+/// divided into tiles of tileSize x tileSize pixels. A tile is dirty, if an
+/// object has changed which covered it in the previous frame or covers it
+/// in the current one.
+///
+/// Every frame, call setObjectBounds() for every object, redraw the
+/// rectangles returned by getDirtyRects() and call markClean().
+class DirtyTracker
+{
+public:
+  static constexpr std::size_t tileSize = 32;
+
+  /// Sets the screen size and marks everything dirty.
+  void resize( std::size_t nRows, std::size_t nCols )
+  {
+    nRows_ = nRows;
+    nCols_ = nCols;
+    nTileRows_ = ( nRows + tileSize - 1 ) / tileSize;
+    nTileCols_ = ( nCols + tileSize - 1 ) / tileSize;
+    dirtyTiles_.assign( nTileRows_ * nTileCols_, char(true) );
+  }
+
+  std::size_t getNRows() const { return nRows_; }
+  std::size_t getNCols() const { return nCols_; }
+
+  /// Marks all tiles dirty, which the rectangle touches.
+  void markDirty( const PixelRect & rect )
+  {
+    const auto clipped = intersect( rect, { 0, 0, std::ptrdiff_t(nCols_),
+                                                  std::ptrdiff_t(nRows_) } );
+    if ( clipped.isEmpty() )
+      return;
+    const auto tileRight = ( std::size_t(clipped.right) + tileSize - 1 ) / tileSize;
+    const auto tileBottom = ( std::size_t(clipped.bottom) + tileSize - 1 ) / tileSize;
+    for ( auto tr = std::size_t(clipped.top) / tileSize; tr < tileBottom; ++tr )
+      for ( auto tc = std::size_t(clipped.left) / tileSize; tc < tileRight; ++tc )
+        dirtyTiles_[tr*nTileCols_+tc] = true;
+  }
+
+  /// Sets the screen bounds of an object in the current frame. Objects are
+  /// identified by consecutive ids starting at 0. If the object has changed
+  /// or moved, both its old and new bounds become dirty. New objects are
+  /// assumed to have had empty bounds before.
+  void setObjectBounds( std::size_t objectId,
+                        const PixelRect & bounds,
+                        bool hasChanged )
+  {
+    if ( objectId >= objectBounds_.size() )
+      objectBounds_.resize( objectId+1 );
+    auto & oldBounds = objectBounds_[objectId];
+    if ( !hasChanged && bounds == oldBounds )
+      return;
+    markDirty( oldBounds );
+    markDirty( bounds );
+    oldBounds = bounds;
+  }
+
+  /// Marks the old bounds of the object dirty and forgets them.
+  void removeObject( std::size_t objectId )
+  {
+    if ( objectId < objectBounds_.size() )
+      setObjectBounds( objectId, {}, true );
+  }
+
+  /// Returns disjoint rectangles covering exactly the dirty tiles. Runs of
+  /// dirty tiles within a tile row are merged and so are equal runs in
+  /// consecutive tile rows. The rectangles are clipped to the screen.
+  std::vector<PixelRect> getDirtyRects() const
+  {
+    std::vector<PixelRect> rects;
+    // rects ending at the top of the current tile row
+    std::vector<std::size_t> openRects;
+    std::vector<std::size_t> nextOpenRects;
+    const auto clip = []( std::size_t v, std::size_t limit )
+    {
+      return std::ptrdiff_t( std::min( v*tileSize, limit ) );
+    };
+    for ( std::size_t tr = 0; tr < nTileRows_; ++tr )
+    {
+      nextOpenRects.clear();
+      const auto dirty = &dirtyTiles_[tr*nTileCols_];
+      for ( std::size_t tc = 0; tc < nTileCols_; )
+      {
+        if ( !dirty[tc] )
+        {
+          ++tc;
+          continue;
+        }
+        const auto begin = tc;
+        while ( tc < nTileCols_ && dirty[tc] )
+          ++tc;
+        const auto left = clip( begin, nCols_ );
+        const auto right = clip( tc, nCols_ );
+        const auto bottom = clip( tr+1, nRows_ );
+        const auto it = std::find_if( openRects.begin(), openRects.end(),
+            [&]( std::size_t i )
+            { return rects[i].left == left && rects[i].right == right; } );
+        if ( it != openRects.end() )
+        {
+          rects[*it].bottom = bottom;
+          nextOpenRects.push_back( *it );
+        }
+        else
+        {
+          nextOpenRects.push_back( rects.size() );
+          rects.push_back( { left, clip( tr, nRows_ ), right, bottom } );
+        }
+      }
+      openRects.swap( nextOpenRects );
+    }
+    return rects;
+  }
+
+  /// Returns the bounding rectangle of all dirty tiles.
+  PixelRect getDirtyBounds() const
+  {
+    PixelRect result;
+    for ( const auto & rect : getDirtyRects() )
+      result = unite( result, rect );
+    return result;
+  }
+
+  bool isClean() const
+  {
+    return std::find( dirtyTiles_.begin(), dirtyTiles_.end(), char(true) ) ==
+           dirtyTiles_.end();
+  }
+
+  void markClean()
+  {
+    std::fill( dirtyTiles_.begin(), dirtyTiles_.end(), char(false) );
+  }
+
+private:
+  std::size_t nRows_{};
+  std::size_t nCols_{};
+  std::size_t nTileRows_{};
+  std::size_t nTileCols_{};
+  std::vector<char> dirtyTiles_;
+  std::vector<PixelRect> objectBounds_;
+};
+
+} // namespace cu
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+
+namespace cu
+{
+
+enum class DrawLayer : std::uint64_t
+{
+  Opaque = 0,
+  Translucent = 1
+};
+
+
+/// Sort keys for draws. From the most to the least significant bit a key
+/// consists of
+///   -  1 bit  layer (opaque draws come first)
+///   - 23 bits depth bucket
+///   - 16 bits material
+///   - 24 bits mesh.
+/// Opaque draws are ordered front to back, so the z-buffer rejects as many
+/// hidden pixels as possible. Translucent draws are ordered back to front,
+/// as blending requires.
+struct DrawKey
+{
+  static constexpr unsigned depthBits    = 23;
+  static constexpr unsigned materialBits = 16;
+  static constexpr unsigned meshBits     = 24;
+  static constexpr std::uint32_t maxDepthBucket = (1u << depthBits) - 1;
+
+  /// Maps the distance from the camera in [nearDist,farDist] to a depth
+  /// bucket. Distances outside of the range are clamped.
+  template <typename Coord>
+  static std::uint32_t makeDepthBucket( Coord dist, Coord nearDist, Coord farDist )
+  {
+    assert( nearDist < farDist );
+    const auto t = ( dist - nearDist ) / ( farDist - nearDist );
+    if ( !( t > 0 ) )
+      return 0;
+    if ( t >= 1 )
+      return maxDepthBucket;
+    return std::uint32_t( t * Coord(maxDepthBucket) );
+  }
+
+  static std::uint64_t make( DrawLayer layer,
+                             std::uint32_t depthBucket,
+                             std::uint32_t material,
+                             std::uint32_t mesh )
+  {
+    assert( depthBucket <= maxDepthBucket );
+    assert( material < (1u << materialBits) );
+    assert( mesh < (1u << meshBits) );
+    if ( layer == DrawLayer::Translucent )
+      depthBucket = maxDepthBucket - depthBucket;
+    return ( std::uint64_t(layer) << (depthBits + materialBits + meshBits) ) |
+           ( std::uint64_t(depthBucket) << (materialBits + meshBits) ) |
+           ( std::uint64_t(material) << meshBits ) |
+             std::uint64_t(mesh);
+  }
+};
+
+
+/// Collects draws with 64 bit sort keys and sorts them with an LSD radix
+/// sort in linear time. The payload of a draw is an index into an array of
+/// draw descriptions kept by the caller.
+class DrawQueue
+{
+public:
+  struct Item
+  {
+    std::uint64_t key;
+    std::uint32_t index;
+  };
+
+  void clear() { items_.clear(); }
+  void reserve( std::size_t n ) { items_.reserve( n ); }
+  void push( std::uint64_t key, std::uint32_t index ) { items_.push_back( { key, index } ); }
+  std::size_t size() const { return items_.size(); }
+  bool empty() const { return items_.empty(); }
+  const std::vector<Item> & getItems() const { return items_; }
+
+  /// Sorts the items stably by their keys. Radix passes over bytes which
+  /// are equal in all keys are skipped, so keys with few distinct bits
+  /// are sorted in fewer passes. Short queues, e.g. the triangles of small
+  /// meshes, are insertion sorted, which is cheaper than clearing the
+  /// histograms.
+  void sort()
+  {
+    if ( items_.size() <= maxInsertionSortSize )
+    {
+      for ( std::size_t i = 1; i < items_.size(); ++i )
+      {
+        const auto item = items_[i];
+        auto j = i;
+        for ( ; j > 0 && items_[j-1].key > item.key; --j )
+          items_[j] = items_[j-1];
+        items_[j] = item;
+      }
+      return;
+    }
+    constexpr std::size_t nPasses = sizeof(std::uint64_t);
+    std::array<std::array<std::size_t,256>,nPasses> histograms{};
+    for ( const auto & item : items_ )
+      for ( std::size_t pass = 0; pass < nPasses; ++pass )
+        ++histograms[pass][ (item.key >> (8*pass)) & 0xFF ];
+
+    buffer_.resize( items_.size() );
+    for ( std::size_t pass = 0; pass < nPasses; ++pass )
+    {
+      auto & histogram = histograms[pass];
+      const auto shift = 8*pass;
+      if ( histogram[ items_.empty() ? 0 : (items_.front().key >> shift) & 0xFF ]
+           == items_.size() )
+        continue;
+      std::size_t offset = 0;
+      for ( auto & count : histogram )
+      {
+        const auto tmp = count;
+        count = offset;
+        offset += tmp;
+      }
+      for ( const auto & item : items_ )
+        buffer_[ histogram[ (item.key >> shift) & 0xFF ]++ ] = item;
+      items_.swap( buffer_ );
+    }
+  }
+
+private:
+  static constexpr std::size_t maxInsertionSortSize = 64;
+
+  std::vector<Item> items_;
+  std::vector<Item> buffer_;
+};
+
+} // namespace cu
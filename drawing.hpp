@@ -4,14 +4,107 @@
 #include "vec.hpp"
 
 #include <algorithm>
+#include <cassert>
 
 
 namespace cu
 {
 
+/// The pixels [left,right) x [top,bottom) of an image.
+struct PixelRect
+{
+  std::ptrdiff_t left{};
+  std::ptrdiff_t top{};
+  std::ptrdiff_t right{};
+  std::ptrdiff_t bottom{};
+
+  bool isEmpty() const { return left >= right || top >= bottom; }
+};
+
+
+inline bool operator==( const PixelRect & lhs, const PixelRect & rhs )
+{
+  return lhs.left == rhs.left && lhs.top == rhs.top &&
+         lhs.right == rhs.right && lhs.bottom == rhs.bottom;
+}
+
+
+inline bool operator!=( const PixelRect & lhs, const PixelRect & rhs )
+{
+  return !( lhs == rhs );
+}
+
+
+/// Returns the smallest rectangle containing both rectangles.
+inline PixelRect unite( const PixelRect & lhs, const PixelRect & rhs )
+{
+  if ( lhs.isEmpty() )
+    return rhs;
+  if ( rhs.isEmpty() )
+    return lhs;
+  return { std::min( lhs.left, rhs.left ), std::min( lhs.top, rhs.top ),
+           std::max( lhs.right, rhs.right ), std::max( lhs.bottom, rhs.bottom ) };
+}
+
+
+inline PixelRect intersect( const PixelRect & lhs, const PixelRect & rhs )
+{
+  return { std::max( lhs.left, rhs.left ), std::max( lhs.top, rhs.top ),
+           std::min( lhs.right, rhs.right ), std::min( lhs.bottom, rhs.bottom ) };
+}
+
+
+/// Restricts drawing into an image to a rectangle, e.g. to redraw only the
+/// parts of a frame which have changed. Pixels keep the coordinates of the
+/// underlying image. The rasterizer clips against the rectangle, so only
+/// pixels inside it are ever accessed.
+template <typename Image>
+class ScissoredImage
+{
+public:
+  ScissoredImage( Image & img, const PixelRect & rect )
+    : img_(img)
+    , rect_( intersect( rect, { 0, 0, std::ptrdiff_t(img.getNCols()),
+                                      std::ptrdiff_t(img.getNRows()) } ) )
+  {
+    if ( rect_.isEmpty() )
+      rect_ = {};
+  }
+
+  decltype(auto) operator[]( std::size_t row ) const
+  {
+    assert( std::ptrdiff_t(row) >= rect_.top && std::ptrdiff_t(row) < rect_.bottom );
+    return img_[row];
+  }
+
+  /// The rasterizer only draws rows and columns below these.
+  std::size_t getNRows() const { return rect_.bottom; }
+  std::size_t getNCols() const { return rect_.right; }
+
+  const PixelRect & getRect() const { return rect_; }
+  Image & getImage() const { return img_; }
+
+private:
+  Image & img_;
+  PixelRect rect_;
+};
+
+
 namespace detail
 {
 
+  template <typename Image>
+  std::ptrdiff_t getFirstRow( const Image & ) { return 0; }
+
+  template <typename Image>
+  std::ptrdiff_t getFirstRow( const ScissoredImage<Image> & img ) { return img.getRect().top; }
+
+  template <typename Image>
+  std::ptrdiff_t getFirstCol( const Image & ) { return 0; }
+
+  template <typename Image>
+  std::ptrdiff_t getFirstCol( const ScissoredImage<Image> & img ) { return img.getRect().left; }
+
   template <typename Coord>
   std::array<Vec<Coord,2>,3> getPointsSortedByYValue(
       const Vec<Coord,2> & A,
@@ -33,22 +126,24 @@ namespace detail
   {
     Color color{};
 
-    void setPixel( Mat<Color> & img, std::size_t x, std::size_t y )
+    template <typename Image>
+    void setPixel( Image & img, std::size_t x, std::size_t y )
     {
       img[y][x] = color;
     }
   };
 
 
-  template <typename Color, typename Coord>
+  template <typename Color, typename Coord, typename ZBuffer = Mat<Coord>>
   struct ColorAndZBufferInfoStruct
   {
     Color color{};
-    Mat<Coord> & zBuffer;
+    ZBuffer & zBuffer;
     Coord maxZ;
     Coord z;
 
-    void setPixel( Mat<Color> & img, std::size_t x, std::size_t y )
+    template <typename Image>
+    void setPixel( Image & img, std::size_t x, std::size_t y )
     {
       auto & currentZ = zBuffer[y][x];
       if ( z >= maxZ || z <= currentZ )
@@ -59,8 +154,8 @@ namespace detail
   };
 
 
-  template <typename T, typename InfoStruct>
-  void drawHorizontalLine( Mat<T> & img,
+  template <typename Image, typename InfoStruct>
+  void drawHorizontalLine( Image & img,
                            std::size_t y,
                            std::ptrdiff_t left,
                            std::ptrdiff_t right,
@@ -68,13 +163,13 @@ namespace detail
   {
     assert( left <= right );
     right = std::min( std::ptrdiff_t(img.getNCols()), right );
-    for ( left  = std::max( 0*left, left ); left < right; ++left )
+    for ( left = std::max( getFirstCol( img ), left ); left < right; ++left )
       infoStruct.setPixel( img, left, y );
   }
 
 
-  template <typename T, typename Coord, typename InfoStruct>
-  void drawHorizontalBaseTriangleImpl( Mat<T> & img,
+  template <typename Image, typename Coord, typename InfoStruct>
+  void drawHorizontalBaseTriangleImpl( Image & img,
                                        Vec<Coord,2> P,
                                        std::ptrdiff_t minY,
                                        std::ptrdiff_t maxY,
@@ -82,16 +177,23 @@ namespace detail
                                        Coord rXStep,
                                        InfoStruct & infoStruct )
   {
-    Coord l = P[0] + lXStep * (minY - P[1]);
-    Coord r = P[0] + rXStep * (minY - P[1]);
-    for ( ; minY < maxY; ++minY, l+=lXStep, r+=rXStep )
+    // clip vertically, so triangles may reach beyond the image
+    minY = std::max( getFirstRow( img ), minY );
+    maxY = std::min( std::ptrdiff_t(img.getNRows()), maxY );
+    // The ends are computed for every row instead of accumulating steps, so
+    // rows come out the same, no matter where clipping starts.
+    for ( ; minY < maxY; ++minY )
+    {
+      const Coord l = P[0] + lXStep * (minY - P[1]);
+      const Coord r = P[0] + rXStep * (minY - P[1]);
       drawHorizontalLine( img, minY, (std::ptrdiff_t)ceil(l),
                                      (std::ptrdiff_t)ceil(r), infoStruct );
+    }
   }
 
 
-  template <typename T, typename Coord, typename InfoStruct>
-  void drawHorizontalBaseTriangle( Mat<T> & img,
+  template <typename Image, typename Coord, typename InfoStruct>
+  void drawHorizontalBaseTriangle( Image & img,
                                    Vec<Coord,2> A,
                                    Coord lXStep,
                                    Coord rXStep,
@@ -109,8 +211,8 @@ namespace detail
   }
 
 
-  template <typename T, typename Coord, typename InfoStruct>
-  void drawHorizontalBaseTriangle( Mat<T> & img,
+  template <typename Image, typename Coord, typename InfoStruct>
+  void drawHorizontalBaseTriangle( Image & img,
                                    Coord top,
                                    Coord lXStep,
                                    Coord rXStep,
@@ -128,8 +230,8 @@ namespace detail
   }
 
 
-  template <typename T, typename Coord, typename InfoStruct>
-  void drawTriangle( Mat<T> & img,
+  template <typename Image, typename Coord, typename InfoStruct>
+  void drawTriangle( Image & img,
                      Vec<Coord,2> A,
                      Vec<Coord,2> B,
                      Vec<Coord,2> C,
@@ -171,8 +273,10 @@ namespace detail
 } // namespace detail
 
 
-template <typename T, typename Coord>
-void drawTriangle( Mat<T> & img,
+/// Draws a triangle with a flat color. The image can be any type with the
+/// interface of Mat<T>, e.g. a TiledMat<T>.
+template <typename Image, typename Coord, typename T>
+void drawTriangle( Image & img,
                    Vec<Coord,2> A,
                    Vec<Coord,2> B,
                    Vec<Coord,2> C,
@@ -182,18 +286,22 @@ void drawTriangle( Mat<T> & img,
 }
 
 
-template <typename T, typename Coord>
-void drawTriangle( Mat<T> & img,
+/// Draws a triangle with a flat color and depth z. Pixels are only set where
+/// z is smaller than maxZ and greater than the value in the zBuffer.
+/// Image and zBuffer can be Mat or TiledMat objects of the same size.
+template <typename Image, typename Coord, typename T, typename ZBuffer>
+void drawTriangle( Image & img,
                    Vec<Coord,2> A,
                    Vec<Coord,2> B,
                    Vec<Coord,2> C,
                    T color,
-                   Mat<Coord> & zBuffer,
+                   ZBuffer & zBuffer,
                    Coord maxZ,
                    Coord z )
 {
   detail::drawTriangle( img, A, B, C,
-      detail::ColorAndZBufferInfoStruct<T,Coord>{ color, zBuffer, maxZ, z } );
+      detail::ColorAndZBufferInfoStruct<T,Coord,ZBuffer>{
+        color, zBuffer, maxZ, z } );
 }
 
 
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+
+namespace cu
+{
+
+namespace detail
+{
+
+  /// Beyond this the reduction by multiples of pi/2 in float loses too much
+  /// precision and std::sin() and std::cos() take over.
+  constexpr float maxFastTrigArg = 8192.f;
+
+  inline std::uint32_t getBits( float x )
+  {
+    std::uint32_t bits;
+    std::memcpy( &bits, &x, sizeof(bits) );
+    return bits;
+  }
+
+
+  inline float getFloat( std::uint32_t bits )
+  {
+    float x;
+    std::memcpy( &x, &bits, sizeof(x) );
+    return x;
+  }
+
+
+  /// Computes the sine and cosine of x for |x| <= maxFastTrigArg. The error
+  /// is at most 2 ulp, near the zeros at most 1e-7. This has no branches and
+  /// no floating point comparisons, so loops calling it are vectorized by the
+  /// compiler.
+  ///
+  /// The angle is reduced to r in [-pi/4,pi/4] by subtracting the nearest
+  /// multiple j of pi/2. The multiple is subtracted in three parts, whose
+  /// products with j are exact. Sine and cosine of r are minimax polynomials
+  /// from the Cephes library. The quadrant j mod 4 selects and negates them
+  /// by manipulating bits, which is exact.
+  inline void fastSinCos( float x, float & sinX, float & cosX )
+  {
+    // Adding and subtracting 1.5*2^23 rounds to the nearest integer.
+    const float roundingConstant = 12582912.f;
+    const float j = ( x * 0.636619772367581f + roundingConstant ) - roundingConstant;
+    const float r = ( ( x - j * 1.5703125f )
+                        - j * 4.837512969970703125e-4f )
+                        - j * 7.549789948768648e-8f;
+    const float z = r*r;
+    const float s = r + r*z*( -1.6666654611e-1f + z*(  8.3321608736e-3f
+                                                + z*( -1.9515295891e-4f ) ) );
+    const float c = 1.f - 0.5f*z + z*z*(  4.166664568298827e-2f
+                                  + z*( -1.388731625493765e-3f
+                                  + z*(  2.443315711809948e-5f ) ) );
+    const auto quadrant = std::uint32_t( std::int32_t(j) );
+    const auto swapMask = 0u - ( quadrant & 1 );
+    const auto sBits = getBits( s );
+    const auto cBits = getBits( c );
+    sinX = getFloat( ( ( sBits & ~swapMask ) | ( cBits & swapMask ) )
+                     ^ ( ( quadrant & 2 ) << 30 ) );
+    cosX = getFloat( ( ( cBits & ~swapMask ) | ( sBits & swapMask ) )
+                     ^ ( ( ( quadrant + 1 ) & 2 ) << 30 ) );
+  }
+
+
+  /// Returns x, if |x| <= maxFastTrigArg, and 0 otherwise, in particular for
+  /// infinities and NaN. isHuge is set in the second case. This compares
+  /// bits, because floating point comparisons keep compilers from
+  /// vectorizing, as they may raise exceptions.
+  inline float getFastTrigArg( float x, std::uint32_t & isHuge )
+  {
+    const auto bits = getBits( x );
+    isHuge = ( bits & 0x7FFFFFFFu ) > getBits( maxFastTrigArg );
+    return getFloat( bits & ( isHuge - 1 ) );
+  }
+
+} // namespace detail
+
+
+/// Computes sines and cosines of n angles in radians. Angles of moderate
+/// size are handled by a vectorized polynomial approximation, which is
+/// accurate to 2 ulp. Huge, infinite and NaN angles fall back to
+/// std::sin() and std::cos().
+inline void sinCos( const float * angles, float * sines, float * cosines, std::size_t n )
+{
+  std::uint32_t hasHugeAngles = 0;
+  for ( std::size_t i = 0; i < n; ++i )
+  {
+    std::uint32_t isHuge;
+    const auto x = detail::getFastTrigArg( angles[i], isHuge );
+    hasHugeAngles |= isHuge;
+    detail::fastSinCos( x, sines[i], cosines[i] );
+  }
+  if ( !hasHugeAngles )
+    return;
+  for ( std::size_t i = 0; i < n; ++i )
+  {
+    if ( std::abs( angles[i] ) <= detail::maxFastTrigArg )
+      continue;
+    sines[i] = std::sin( angles[i] );
+    cosines[i] = std::cos( angles[i] );
+  }
+}
+
+
+/// Computes the sine and cosine of a single angle in radians like the
+/// batched version.
+inline void sinCos( float angle, float & sine, float & cosine )
+{
+  if ( std::abs( angle ) <= detail::maxFastTrigArg )
+    return detail::fastSinCos( angle, sine, cosine );
+  sine = std::sin( angle );
+  cosine = std::cos( angle );
+}
+
+} // namespace cu
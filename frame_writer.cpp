@@ -0,0 +1,524 @@
+#include "frame_writer.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace cu
+{
+
+namespace
+{
+
+  constexpr std::size_t streamBufferSize = std::size_t(4) << 20;
+
+
+  std::runtime_error makeSystemError( const std::string & what,
+                                      const std::string & path )
+  {
+    return std::runtime_error( what + " '" + path + "': " + std::strerror(errno) );
+  }
+
+
+  bool endsWith( const std::string & s, const std::string & suffix )
+  {
+    return s.size() >= suffix.size() &&
+           s.compare( s.size() - suffix.size(), suffix.size(), suffix ) == 0;
+  }
+
+
+  void writeAll( int fd, const std::uint8_t * data, std::size_t size,
+                 const std::string & path )
+  {
+    while ( size > 0 )
+    {
+      const auto nWritten = ::write( fd, data, size );
+      if ( nWritten < 0 )
+      {
+        if ( errno == EINTR )
+          continue;
+        throw makeSystemError( "Could not write", path );
+      }
+      data += nWritten;
+      size -= std::size_t(nWritten);
+    }
+  }
+
+
+  void appendString( std::vector<std::uint8_t> & out, const std::string & s )
+  {
+    out.insert( out.end(), s.begin(), s.end() );
+  }
+
+
+  // PNG encoding
+
+  const std::array<std::uint32_t,256> & getCrcTable()
+  {
+    static const auto table = []
+    {
+      std::array<std::uint32_t,256> result;
+      for ( std::uint32_t n = 0; n < 256; ++n )
+      {
+        auto c = n;
+        for ( int k = 0; k < 8; ++k )
+          c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        result[n] = c;
+      }
+      return result;
+    }();
+    return table;
+  }
+
+
+  std::uint32_t crc32( const std::uint8_t * data, std::size_t size )
+  {
+    const auto & table = getCrcTable();
+    std::uint32_t c = 0xFFFFFFFFu;
+    for ( std::size_t i = 0; i < size; ++i )
+      c = table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+  }
+
+
+  void appendBigEndian( std::vector<std::uint8_t> & out, std::uint32_t v )
+  {
+    out.insert( out.end(), { std::uint8_t(v >> 24), std::uint8_t(v >> 16),
+                             std::uint8_t(v >> 8), std::uint8_t(v) } );
+  }
+
+
+  /// Appends a chunk, whose data the callback appends to out.
+  template <typename AppendData>
+  void appendPngChunk( std::vector<std::uint8_t> & out,
+                       const char * type,
+                       AppendData && appendData )
+  {
+    const auto lengthPos = out.size();
+    appendBigEndian( out, 0 );
+    const auto typePos = out.size();
+    out.insert( out.end(), type, type+4 );
+    appendData();
+    const auto length = std::uint32_t( out.size() - typePos - 4 );
+    for ( int i = 0; i < 4; ++i )
+      out[lengthPos+i] = std::uint8_t( length >> (24 - 8*i) );
+    appendBigEndian( out, crc32( &out[typePos], out.size() - typePos ) );
+  }
+
+} // namespace
+
+
+FrameFormat getFrameFormat( const std::string & path )
+{
+  if ( path == "-" || endsWith( path, ".y4m" ) )
+    return FrameFormat::Y4mStream;
+  if ( endsWith( path, ".pgm" ) )
+    return FrameFormat::PgmSequence;
+  if ( endsWith( path, ".ppm" ) )
+    return FrameFormat::PpmSequence;
+  if ( endsWith( path, ".png" ) )
+    return FrameFormat::PngSequence;
+  throw std::runtime_error( "Unknown frame format: '" + path + "'." );
+}
+
+
+void encodePng( const std::uint8_t * pixels,
+                std::size_t width,
+                std::size_t height,
+                std::vector<std::uint8_t> & out )
+{
+  static const std::uint8_t signature[] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+  out.insert( out.end(), std::begin(signature), std::end(signature) );
+  appendPngChunk( out, "IHDR", [&]
+  {
+    appendBigEndian( out, std::uint32_t(width) );
+    appendBigEndian( out, std::uint32_t(height) );
+    // 8 bit gray, deflate, adaptive filtering, no interlacing
+    out.insert( out.end(), { 8, 0, 0, 0, 0 } );
+  } );
+  appendPngChunk( out, "IDAT", [&]
+  {
+    // A zlib stream of stored deflate blocks. Every row starts with the
+    // filter type 0, i.e. no filter.
+    constexpr std::size_t maxBlockSize = 65535;
+    const auto rawSize = height * (width+1);
+    out.reserve( out.size() + rawSize + rawSize / maxBlockSize * 5 + 64 );
+    out.insert( out.end(), { 0x78, 0x01 } );
+    std::uint32_t a = 1, b = 0;
+    std::size_t nRemaining = rawSize;
+    std::size_t nRemainingInBlock = 0;
+    const auto append = [&]( const std::uint8_t * data, std::size_t size )
+    {
+      while ( size > 0 )
+      {
+        if ( nRemainingInBlock == 0 )
+        {
+          nRemainingInBlock = std::min( nRemaining, maxBlockSize );
+          const auto len = std::uint16_t( nRemainingInBlock );
+          out.insert( out.end(), { std::uint8_t( nRemaining == nRemainingInBlock ),
+                                   std::uint8_t( len ), std::uint8_t( len >> 8 ),
+                                   std::uint8_t( ~len ), std::uint8_t( ~len >> 8 ) } );
+        }
+        const auto n = std::min( size, nRemainingInBlock );
+        out.insert( out.end(), data, data + n );
+        // Adler-32. 5552 bytes are the most which cannot overflow b.
+        for ( std::size_t begin = 0; begin < n; begin += 5552 )
+        {
+          const auto end = std::min( n, begin + 5552 );
+          for ( auto i = begin; i < end; ++i )
+          {
+            a += data[i];
+            b += a;
+          }
+          a %= 65521;
+          b %= 65521;
+        }
+        data += n;
+        size -= n;
+        nRemaining -= n;
+        nRemainingInBlock -= n;
+      }
+    };
+    const std::uint8_t filterType = 0;
+    for ( std::size_t row = 0; row < height; ++row )
+    {
+      append( &filterType, 1 );
+      append( pixels + row*width, width );
+    }
+    appendBigEndian( out, (b << 16) | a );
+  } );
+  appendPngChunk( out, "IEND", []{} );
+}
+
+
+FrameWriter::FrameWriter( const std::string & path,
+                          FrameFormat format,
+                          std::size_t width,
+                          std::size_t height,
+                          std::size_t queueCapacity,
+                          std::size_t nThreads,
+                          unsigned framesPerSecond )
+  : path_( path )
+  , format_( format )
+  , fileNamePattern_( format == FrameFormat::Y4mStream
+                      ? FileNamePattern{}
+                      : parseFileNamePattern( path ) )
+  , width_( width )
+  , height_( height )
+  , framesPerSecond_( framesPerSecond )
+  , queue_( queueCapacity )
+  , freeBuffers_( queueCapacity + nThreads + 2 )
+{
+  if ( format == FrameFormat::Y4mStream )
+  {
+    streamFd_ = path == "-"
+        ? ::dup( STDOUT_FILENO )
+        : ::open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+    if ( streamFd_ < 0 )
+      throw makeSystemError( "Could not open", path );
+    streamBuffer_.reserve( streamBufferSize );
+    appendString( streamBuffer_,
+                  "YUV4MPEG2 W" + std::to_string( width ) +
+                  " H" + std::to_string( height ) +
+                  " F" + std::to_string( framesPerSecond_ ) + ":1 Ip A1:1 Cmono\n" );
+    // The frames of a stream must stay in order.
+    nThreads = 1;
+  }
+  for ( std::size_t i = 0; i < std::max<std::size_t>( nThreads, 1 ); ++i )
+    workers_.emplace_back( [this]{ runWorker(); } );
+}
+
+
+FrameWriter::~FrameWriter()
+{
+  try
+  {
+    finish();
+  }
+  catch ( ... )
+  {
+  }
+}
+
+
+Mat<std::uint8_t> FrameWriter::acquireBuffer()
+{
+  Mat<std::uint8_t> buffer;
+  if ( freeBuffers_.tryPop( buffer ) )
+    return buffer;
+  ++nBuffersAllocated_;
+  return Mat<std::uint8_t>( height_, width_ );
+}
+
+
+bool FrameWriter::trySubmit( Mat<std::uint8_t> & frame )
+{
+  if ( tryEnqueue( frame ) )
+    return true;
+  ++nRejected_;
+  return false;
+}
+
+
+bool FrameWriter::tryEnqueue( Mat<std::uint8_t> & frame )
+{
+  if ( frame.getNRows() != height_ || frame.getNCols() != width_ )
+    throw std::runtime_error( "Frame has the wrong size." );
+  Job job{ nextFrameIndex_, std::move( frame ) };
+  if ( !queue_.tryPush( job ) )
+  {
+    frame = std::move( job.frame );
+    return false;
+  }
+  ++nextFrameIndex_;
+  ++nSubmitted_;
+  maxQueueSize_.store( std::max<std::uint64_t>( maxQueueSize_.load(), queue_.getSize() ) );
+  // Pairs with the fence in runWorker(). Either the worker sees the frame or
+  // we see the worker idle.
+  std::atomic_thread_fence( std::memory_order_seq_cst );
+  if ( nIdleWorkers_.load() > 0 )
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    frameQueued_.notify_one();
+  }
+  return true;
+}
+
+
+void FrameWriter::submit( Mat<std::uint8_t> frame )
+{
+  if ( tryEnqueue( frame ) )
+    return;
+  ++nStalls_;
+  const auto start = std::chrono::steady_clock::now();
+  isWaitingForSpace_ = true;
+  while ( !tryEnqueue( frame ) )
+  {
+    std::unique_lock<std::mutex> lock( mutex_ );
+    // The timeout covers a frame taken between the attempt and the wait.
+    frameTaken_.wait_for( lock, std::chrono::milliseconds( 1 ) );
+  }
+  isWaitingForSpace_ = false;
+  stallTime_ += std::uint64_t( std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start ).count() );
+}
+
+
+void FrameWriter::finish()
+{
+  if ( workers_.empty() )
+    return;
+  {
+    std::lock_guard<std::mutex> lock( mutex_ );
+    stop_ = true;
+  }
+  frameQueued_.notify_all();
+  for ( auto & worker : workers_ )
+    worker.join();
+  workers_.clear();
+  if ( streamFd_ >= 0 )
+  {
+    try
+    {
+      flushStream();
+    }
+    catch ( ... )
+    {
+      if ( !error_ )
+        error_ = std::current_exception();
+    }
+    ::close( streamFd_ );
+    streamFd_ = -1;
+  }
+  if ( error_ )
+    std::rethrow_exception( error_ );
+}
+
+
+FrameWriter::Stats FrameWriter::getStats() const
+{
+  Stats stats;
+  stats.nSubmitted = nSubmitted_;
+  stats.nWritten = nWritten_;
+  stats.nRejected = nRejected_;
+  stats.nStalls = nStalls_;
+  stats.stallTime = stallTime_;
+  stats.maxQueueSize = maxQueueSize_;
+  stats.nBuffersAllocated = nBuffersAllocated_;
+  stats.nBytesWritten = nBytesWritten_;
+  return stats;
+}
+
+
+void FrameWriter::runWorker()
+{
+  std::vector<std::uint8_t> encoded;
+  Job job;
+  for (;;)
+  {
+    if ( queue_.tryPop( job ) )
+    {
+      if ( isWaitingForSpace_ )
+      {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        frameTaken_.notify_all();
+      }
+      try
+      {
+        writeFrame( job, encoded );
+        ++nWritten_;
+      }
+      catch ( ... )
+      {
+        std::lock_guard<std::mutex> lock( mutex_ );
+        if ( !error_ )
+          error_ = std::current_exception();
+      }
+      // If the free list is full, the buffer is released.
+      freeBuffers_.tryPush( job.frame );
+      job.frame = {};
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock( mutex_ );
+    ++nIdleWorkers_;
+    std::atomic_thread_fence( std::memory_order_seq_cst );
+    frameQueued_.wait( lock, [this]{ return stop_ || queue_.getSize() > 0; } );
+    --nIdleWorkers_;
+    if ( stop_ && queue_.getSize() == 0 )
+      return;
+  }
+}
+
+
+FrameWriter::FileNamePattern FrameWriter::parseFileNamePattern( const std::string & path )
+{
+  FileNamePattern result;
+  bool hasFrameNumber = false;
+  for ( std::size_t i = 0; i < path.size(); ++i )
+  {
+    auto & part = hasFrameNumber ? result.suffix : result.prefix;
+    if ( path[i] != '%' )
+    {
+      part += path[i];
+      continue;
+    }
+    if ( i+1 < path.size() && path[i+1] == '%' )
+    {
+      part += '%';
+      ++i;
+      continue;
+    }
+    // Only %d and %0<width>d are allowed, as a width without zero padding
+    // would put blanks into file names.
+    auto end = i+1;
+    if ( end < path.size() && path[end] == '0' )
+      while ( end < path.size() && std::isdigit( static_cast<unsigned char>(path[end]) ) )
+        ++end;
+    if ( hasFrameNumber || end == path.size() || path[end] != 'd' || end - i > 4 )
+      throw std::runtime_error( "The path '" + path + "' must contain exactly "
+                                "one %d or %0<width>d for the frame number." );
+    if ( end > i+1 )
+      result.nDigits = std::stoul( path.substr( i+1, end-i-1 ) );
+    hasFrameNumber = true;
+    i = end;
+  }
+  if ( !hasFrameNumber )
+    throw std::runtime_error( "The path '" + path + "' must contain exactly "
+                              "one %d or %0<width>d for the frame number." );
+  return result;
+}
+
+
+std::string FrameWriter::getFileName( std::uint64_t frameIndex ) const
+{
+  auto number = std::to_string( frameIndex );
+  if ( number.size() < fileNamePattern_.nDigits )
+    number.insert( 0, fileNamePattern_.nDigits - number.size(), '0' );
+  return fileNamePattern_.prefix + number + fileNamePattern_.suffix;
+}
+
+
+void FrameWriter::writeFrame( const Job & job, std::vector<std::uint8_t> & encoded )
+{
+  const auto pixels = job.frame.data();
+  const auto nPixels = width_ * height_;
+  if ( format_ == FrameFormat::Y4mStream )
+  {
+    static const std::uint8_t frameHeader[] = { 'F','R','A','M','E','\n' };
+    writeToStream( frameHeader, sizeof(frameHeader) );
+    writeToStream( pixels, nPixels );
+    return;
+  }
+
+  // Every file is encoded into memory and written with a single call.
+  encoded.clear();
+  const auto size = std::to_string( width_ ) + " " + std::to_string( height_ );
+  switch ( format_ )
+  {
+  case FrameFormat::PgmSequence:
+    appendString( encoded, "P5\n" + size + "\n255\n" );
+    encoded.insert( encoded.end(), pixels, pixels + nPixels );
+    break;
+  case FrameFormat::PpmSequence:
+    appendString( encoded, "P6\n" + size + "\n255\n" );
+    encoded.resize( encoded.size() + 3*nPixels );
+    for ( std::size_t i = 0, offset = encoded.size() - 3*nPixels; i < nPixels; ++i )
+      std::fill_n( &encoded[offset + 3*i], 3, pixels[i] );
+    break;
+  case FrameFormat::PngSequence:
+    encodePng( pixels, width_, height_, encoded );
+    break;
+  case FrameFormat::Y4mStream:
+    assert( false );
+  }
+
+  const auto filePath = getFileName( job.frameIndex );
+  const auto fd = ::open( filePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+  if ( fd < 0 )
+    throw makeSystemError( "Could not open", filePath );
+  try
+  {
+    writeAll( fd, encoded.data(), encoded.size(), filePath );
+  }
+  catch ( ... )
+  {
+    ::close( fd );
+    throw;
+  }
+  ::close( fd );
+  nBytesWritten_ += encoded.size();
+}
+
+
+void FrameWriter::writeToStream( const std::uint8_t * data, std::size_t size )
+{
+  if ( streamBuffer_.size() + size > streamBufferSize )
+    flushStream();
+  if ( size >= streamBufferSize )
+  {
+    writeAll( streamFd_, data, size, path_ );
+    nBytesWritten_ += size;
+    return;
+  }
+  streamBuffer_.insert( streamBuffer_.end(), data, data + size );
+}
+
+
+void FrameWriter::flushStream()
+{
+  writeAll( streamFd_, streamBuffer_.data(), streamBuffer_.size(), path_ );
+  nBytesWritten_ += streamBuffer_.size();
+  streamBuffer_.clear();
+}
+
+} // namespace cu
@@ -0,0 +1,169 @@
+#pragma once
+
+#include "bounded_queue.hpp"
+#include "mat.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace cu
+{
+
+enum class FrameFormat
+{
+  /// one binary PGM file per frame
+  PgmSequence,
+  /// one binary PPM file per frame with equal red, green and blue
+  PpmSequence,
+  /// one PNG file per frame, compressed with stored deflate blocks only
+  PngSequence,
+  /// a YUV4MPEG2 stream of gray frames, e.g. for piping into a video encoder
+  Y4mStream,
+};
+
+/// Returns the format for the extension of the path. "-" means a Y4M
+/// stream on the standard output. Throws std::runtime_error for unknown
+/// extensions.
+FrameFormat getFrameFormat( const std::string & path );
+
+
+/// Writes rendered 8 bit gray frames to disk in background threads, so
+/// rendering never waits for file I/O. Frames are handed over through a
+/// bounded lock-free queue. Their buffers are recycled: get them from
+/// acquireBuffer() and they return to a free list after they have been
+/// written.
+///
+/// Image sequences are encoded by several threads in parallel. For them the
+/// path is a pattern with exactly one conversion %d or %0<width>d for the
+/// frame number, e.g. "out/frame%05d.png". %% stands for a percent sign.
+/// Streams are written by a single thread in large
+/// sequential chunks. Frames must be submitted from a single thread.
+class FrameWriter
+{
+public:
+  struct Stats
+  {
+    std::uint64_t nSubmitted = 0;
+    std::uint64_t nWritten = 0;
+    /// frames trySubmit() refused, because the queue was full
+    std::uint64_t nRejected = 0;
+    /// how often submit() found the queue full and had to wait
+    std::uint64_t nStalls = 0;
+    /// the total time submit() has waited in nanoseconds
+    std::uint64_t stallTime = 0;
+    /// the largest number of queued frames seen by the producer
+    std::uint64_t maxQueueSize = 0;
+    std::uint64_t nBuffersAllocated = 0;
+    std::uint64_t nBytesWritten = 0;
+  };
+
+  /// Throws std::runtime_error, if a stream cannot be opened or the pattern
+  /// of an image sequence is invalid.
+  FrameWriter( const std::string & path,
+               FrameFormat format,
+               std::size_t width,
+               std::size_t height,
+               std::size_t queueCapacity = 16,
+               std::size_t nThreads = 2,
+               unsigned framesPerSecond = 60 );
+
+  /// Calls finish(), but swallows its errors.
+  ~FrameWriter();
+
+  FrameWriter( const FrameWriter & ) = delete;
+  FrameWriter & operator=( const FrameWriter & ) = delete;
+
+  /// Returns a recycled buffer of height x width pixels, if available, or a
+  /// new one. Its contents are undefined.
+  Mat<std::uint8_t> acquireBuffer();
+
+  /// Queues the frame, unless the queue is full. Never blocks. On success
+  /// the frame is moved from and true is returned.
+  bool trySubmit( Mat<std::uint8_t> & frame );
+
+  /// Queues the frame. If the queue is full, this waits for the writer
+  /// threads and records the stall in the statistics.
+  void submit( Mat<std::uint8_t> frame );
+
+  /// Waits until all queued frames have been written and stops the threads.
+  /// Rethrows the first error of a writer thread. Nothing can be submitted
+  /// afterwards.
+  void finish();
+
+  Stats getStats() const;
+
+private:
+  struct Job
+  {
+    std::uint64_t frameIndex = 0;
+    Mat<std::uint8_t> frame;
+  };
+
+  /// The parts of the path of an image sequence around the frame number.
+  struct FileNamePattern
+  {
+    std::string prefix;
+    std::string suffix;
+    std::size_t nDigits = 0;
+  };
+
+  static FileNamePattern parseFileNamePattern( const std::string & path );
+  std::string getFileName( std::uint64_t frameIndex ) const;
+
+  bool tryEnqueue( Mat<std::uint8_t> & frame );
+  void runWorker();
+  void writeFrame( const Job & job, std::vector<std::uint8_t> & encoded );
+  void writeToStream( const std::uint8_t * data, std::size_t size );
+  void flushStream();
+
+  const std::string path_;
+  const FrameFormat format_;
+  const FileNamePattern fileNamePattern_;
+  const std::size_t width_;
+  const std::size_t height_;
+  const unsigned framesPerSecond_;
+  int streamFd_ = -1;
+  std::vector<std::uint8_t> streamBuffer_;
+
+  BoundedQueue<Job> queue_;
+  BoundedQueue<Mat<std::uint8_t>> freeBuffers_;
+  std::uint64_t nextFrameIndex_ = 0;
+  std::vector<std::thread> workers_;
+
+  // Idle threads sleep on these. The lock is only taken around waiting and
+  // waking, never while a queue is accessed.
+  std::mutex mutex_;
+  std::condition_variable frameQueued_;
+  std::condition_variable frameTaken_;
+  std::atomic<std::size_t> nIdleWorkers_{0};
+  std::atomic<bool> isWaitingForSpace_{false};
+  bool stop_ = false;
+  std::exception_ptr error_;
+
+  std::atomic<std::uint64_t> nSubmitted_{0};
+  std::atomic<std::uint64_t> nWritten_{0};
+  std::atomic<std::uint64_t> nRejected_{0};
+  std::atomic<std::uint64_t> nStalls_{0};
+  std::atomic<std::uint64_t> stallTime_{0};
+  std::atomic<std::uint64_t> maxQueueSize_{0};
+  std::atomic<std::uint64_t> nBuffersAllocated_{0};
+  std::atomic<std::uint64_t> nBytesWritten_{0};
+};
+
+
+/// Encodes a gray image as PNG with stored deflate blocks. This skips
+/// compression, which would cost far more than writing the bytes, and still
+/// yields files every viewer can read.
+void encodePng( const std::uint8_t * pixels,
+                std::size_t width,
+                std::size_t height,
+                std::vector<std::uint8_t> & out );
+
+} // namespace cu
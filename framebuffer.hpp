@@ -0,0 +1,266 @@
+#pragma once
+
+#include "drawing.hpp"
+#include "job_system.hpp"
+#include "mat.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+
+
+namespace cu
+{
+
+/// A framebuffer which stores its pixels in square tiles of
+/// tileSize x tileSize pixels. The tiles are stored one after another
+/// row by row and so are the pixels within a tile. Hence a triangle covering
+/// a small area of the screen only touches a few cache lines, no matter how
+/// wide the image is.
+///
+/// Rows are accessed through light-weight views, so the rasterizer policies
+/// in drawing.hpp can address a TiledMat exactly like a Mat<T>. Use
+/// resolve() to convert the contents to the linear layout of a Mat<T>.
+template <typename T, std::size_t tileSizeLog2 = 3>
+class TiledMat
+{
+public:
+  static constexpr std::size_t tileSize = std::size_t(1) << tileSizeLog2;
+  static constexpr std::size_t tileArea = tileSize * tileSize;
+
+private:
+  template <typename U>
+  class RowViewImpl
+  {
+  public:
+    /// The pointer points to the first pixel of the row in the leftmost tile.
+    RowViewImpl( U rowData[], std::size_t size )
+      : data_(rowData)
+      , size_(size)
+    {}
+
+    U & operator[]( std::size_t col ) const
+    {
+      assert( col < size_ );
+      return data_[ (col >> tileSizeLog2) * tileArea + (col & (tileSize-1)) ];
+    }
+
+    std::size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+  private:
+    U * data_;
+    std::size_t size_;
+  };
+
+public:
+  using RowView = RowViewImpl<T>;
+  using ConstRowView = RowViewImpl<const T>;
+
+  TiledMat() = default;
+  TiledMat( std::size_t nRows,
+            std::size_t nCols )
+    : nTileRows_( (nRows + tileSize - 1) >> tileSizeLog2 )
+    , nTileCols_( (nCols + tileSize - 1) >> tileSizeLog2 )
+    , data_( new T[nTileRows_*nTileCols_*tileArea] )
+    , nRows_(nRows)
+    , nCols_(nCols)
+  {}
+
+  TiledMat( std::size_t nRows,
+            std::size_t nCols,
+            const T & value )
+    : TiledMat( nRows, nCols )
+  {
+    fill( value );
+  }
+
+  std::size_t getNRows() const { return nRows_; }
+  std::size_t getNCols() const { return nCols_; }
+  std::size_t getNTileRows() const { return nTileRows_; }
+  std::size_t getNTileCols() const { return nTileCols_; }
+
+  RowView operator[]( std::size_t row )
+  {
+    assert( row < nRows_ );
+    return { getRowData( row ), nCols_ };
+  }
+
+  ConstRowView operator[]( std::size_t row ) const
+  {
+    assert( row < nRows_ );
+    return { getRowData( row ), nCols_ };
+  }
+
+  /// Returns the first pixel of the given row within the leftmost tile.
+  /// The row continues at offsets which are multiples of tileArea.
+  T * getRowData( std::size_t row )
+  {
+    return data_.get() +
+        ( (row >> tileSizeLog2) * nTileCols_ * tileArea +
+          (row & (tileSize-1)) * tileSize );
+  }
+
+  const T * getRowData( std::size_t row ) const
+  {
+    return const_cast<TiledMat&>(*this).getRowData( row );
+  }
+
+  /// Returns the pixels of the tile in the given tile row and column.
+  /// They are stored contiguously row by row.
+  T * getTileData( std::size_t tileRow, std::size_t tileCol )
+  {
+    assert( tileRow < nTileRows_ );
+    assert( tileCol < nTileCols_ );
+    return data_.get() + (tileRow * nTileCols_ + tileCol) * tileArea;
+  }
+
+  const T * getTileData( std::size_t tileRow, std::size_t tileCol ) const
+  {
+    return const_cast<TiledMat&>(*this).getTileData( tileRow, tileCol );
+  }
+
+  /// Sets all pixels including the padding of the border tiles.
+  void fill( const T & value )
+  {
+    std::fill_n( data_.get(), nTileRows_*nTileCols_*tileArea, value );
+  }
+
+private:
+  std::size_t nTileRows_{};
+  std::size_t nTileCols_{};
+  std::unique_ptr<T[]> data_;
+  std::size_t nRows_{};
+  std::size_t nCols_{};
+};
+
+
+template <typename T>
+void clear( Mat<T> & img, const T & value )
+{
+  std::fill_n( img.data(), img.getNRows()*img.getNCols(), value );
+}
+
+
+template <typename T, std::size_t tileSizeLog2>
+void clear( TiledMat<T,tileSizeLog2> & img, const T & value )
+{
+  img.fill( value );
+}
+
+
+template <typename T>
+void clear( Mat<T> & img, const T & value, JobSystem & jobSystem )
+{
+  const auto nCols = img.getNCols();
+  jobSystem.parallelFor( "clear", img.getNRows(), 32,
+                         [&]( std::size_t begin, std::size_t end )
+  {
+    std::fill( img.data() + begin*nCols, img.data() + end*nCols, value );
+  } );
+}
+
+
+/// Clears the tiles in parallel. Every job clears whole rows of tiles.
+template <typename T, std::size_t tileSizeLog2>
+void clear( TiledMat<T,tileSizeLog2> & img, const T & value, JobSystem & jobSystem )
+{
+  const auto nTileCols = img.getNTileCols();
+  jobSystem.parallelFor( "clear", img.getNTileRows(), 4,
+                         [&]( std::size_t begin, std::size_t end )
+  {
+    if ( begin == end || nTileCols == 0 )
+      return;
+    std::fill( img.getTileData( begin, 0 ),
+               img.getTileData( end-1, nTileCols-1 ) + img.tileArea,
+               value );
+  } );
+}
+
+
+/// Clears only the pixels inside the rectangle of the scissored image.
+template <typename Image, typename T>
+void clear( ScissoredImage<Image> & img, const T & value )
+{
+  const auto & rect = img.getRect();
+  for ( auto row = rect.top; row < rect.bottom; ++row )
+  {
+    auto rowView = img[row];
+    for ( auto col = rect.left; col < rect.right; ++col )
+      rowView[col] = value;
+  }
+}
+
+
+template <typename Image, typename T>
+void clear( ScissoredImage<Image> & img, const T & value, JobSystem & jobSystem )
+{
+  const auto & rect = img.getRect();
+  jobSystem.parallelFor( "clear", std::size_t(rect.bottom - rect.top), 32,
+                         [&]( std::size_t begin, std::size_t end )
+  {
+    for ( auto row = rect.top + std::ptrdiff_t(begin);
+          row < rect.top + std::ptrdiff_t(end); ++row )
+    {
+      auto rowView = img[row];
+      for ( auto col = rect.left; col < rect.right; ++col )
+        rowView[col] = value;
+    }
+  } );
+}
+
+
+namespace detail
+{
+
+  template <typename T, std::size_t tileSizeLog2>
+  void resolveRow( const TiledMat<T,tileSizeLog2> & src,
+                   T * dst,
+                   std::size_t row )
+  {
+    constexpr auto tileSize = TiledMat<T,tileSizeLog2>::tileSize;
+    constexpr auto tileArea = TiledMat<T,tileSizeLog2>::tileArea;
+    const auto nCols = src.getNCols();
+    const T * tileRow = src.getRowData( row );
+    std::size_t col = 0;
+    // Copying a compile time constant number of elements lets the compiler
+    // emit a few vector moves instead of a loop.
+    for ( ; col + tileSize <= nCols; col += tileSize, tileRow += tileArea )
+      std::copy_n( tileRow, tileSize, dst + col );
+    std::copy_n( tileRow, nCols - col, dst + col );
+  }
+
+} // namespace detail
+
+
+/// Converts a tiled framebuffer into the linear layout of a Mat<T>, e.g.
+/// for presenting or saving it. Both images must have the same dimensions.
+template <typename T, std::size_t tileSizeLog2>
+void resolve( const TiledMat<T,tileSizeLog2> & src, Mat<T> & dst )
+{
+  assert( src.getNRows() == dst.getNRows() );
+  assert( src.getNCols() == dst.getNCols() );
+  for ( std::size_t row = 0; row < src.getNRows(); ++row )
+    detail::resolveRow( src, dst.data() + row*dst.getNCols(), row );
+}
+
+
+/// Resolves in parallel. Every job converts whole rows of tiles.
+template <typename T, std::size_t tileSizeLog2>
+void resolve( const TiledMat<T,tileSizeLog2> & src,
+              Mat<T> & dst,
+              JobSystem & jobSystem )
+{
+  assert( src.getNRows() == dst.getNRows() );
+  assert( src.getNCols() == dst.getNCols() );
+  constexpr auto tileSize = TiledMat<T,tileSizeLog2>::tileSize;
+  jobSystem.parallelFor( "resolve", src.getNTileRows(), 4,
+                         [&]( std::size_t begin, std::size_t end )
+  {
+    const auto endRow = std::min( end*tileSize, src.getNRows() );
+    for ( auto row = begin*tileSize; row < endRow; ++row )
+      detail::resolveRow( src, dst.data() + row*dst.getNCols(), row );
+  } );
+}
+
+} // namespace cu
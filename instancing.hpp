@@ -0,0 +1,330 @@
+#pragma once
+
+#include "draw_queue.hpp"
+#include "drawing.hpp"
+#include "job_system.hpp"
+#include "mat.hpp"
+#include "mesh.hpp"
+#include "shading.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+
+namespace cu
+{
+
+/// Perspective projection of view space onto the screen. The camera looks
+/// along the negative z-axis and everything with z >= maxZ is clipped away.
+template <typename Coord>
+struct Projection
+{
+  Coord focalLength{};
+  Coord width{};
+  Coord height{};
+  Coord maxZ{};
+
+  Vec<Coord,2> project( const Vec<Coord,3> & p ) const
+  {
+    return { focalLength * p[0] / -p[2] + Coord(0.5)*width,
+             focalLength * p[1] / -p[2] + Coord(0.5)*height };
+  }
+
+  /// Returns false, if the sphere lies completely outside the view frustum.
+  bool isVisible( const Sphere<Coord> & sphere ) const
+  {
+    const auto & c = sphere.center;
+    const auto r = sphere.radius;
+    if ( c[2] - r >= maxZ )
+      return false;
+    // The side planes of the frustum pass through the origin.
+    const auto halfW = Coord(0.5)*width;
+    const auto halfH = Coord(0.5)*height;
+    const auto xNorm = std::sqrt( focalLength*focalLength + halfW*halfW );
+    const auto yNorm = std::sqrt( focalLength*focalLength + halfH*halfH );
+    const auto xDist = halfW * -c[2] - focalLength * std::abs(c[0]);
+    const auto yDist = halfH * -c[2] - focalLength * std::abs(c[1]);
+    return xDist > -r * xNorm && yDist > -r * yNorm;
+  }
+};
+
+
+namespace detail
+{
+
+  /// Returns the factor by which the transformation scales lengths at most.
+  template <typename Coord>
+  Coord getMaxScale( const Mat<Coord,4,4> & m )
+  {
+    Coord maxSqrNorm = 0;
+    for ( std::size_t col = 0; col < 3; ++col )
+      maxSqrNorm = std::max( maxSqrNorm,
+          m[0][col]*m[0][col] + m[1][col]*m[1][col] + m[2][col]*m[2][col] );
+    return std::sqrt( maxSqrNorm );
+  }
+
+
+  template <typename Coord>
+  Vec<Coord,3> transformPoint( const Mat<Coord,4,4> & m, const Vec<Coord,3> & p )
+  {
+    return { m[0][0]*p[0] + m[0][1]*p[1] + m[0][2]*p[2] + m[0][3],
+             m[1][0]*p[0] + m[1][1]*p[1] + m[1][2]*p[2] + m[1][3],
+             m[2][0]*p[0] + m[2][1]*p[1] + m[2][2]*p[2] + m[2][3] };
+  }
+
+} // namespace detail
+
+
+/// Draws many copies of a mesh, each with its own transformation into view
+/// space and its own color.
+///
+/// Culling and vertex transformation of the instances run as jobs.
+/// Visible instances are drawn front to back, and so are the triangles
+/// within each instance, so the z-buffer rejects hidden pixels early. The
+/// buffers for the transformed vertices are kept between calls, so after
+/// warming up drawing does not allocate memory.
+template <typename Coord>
+class InstancedRenderer
+{
+public:
+  explicit InstancedRenderer( JobSystem & jobSystem )
+    : jobSystem_( jobSystem )
+  {}
+
+  /// Every triangle is drawn with the color shadeFace( normal, color ), where
+  /// normal is the unit normal of the triangle in view space and color is
+  /// the instance color. Triangles reaching beyond maxZ are skipped.
+  ///
+  /// Each triangle has a single depth for the z-buffer test, the z
+  /// coordinate of its centroid. Meshes have no notion of faces, so the two
+  /// triangles of a quad may get different depths.
+  ///
+  /// Batch shaders like Lighting are not called per triangle. Instead the
+  /// normals and centers of all faces of the visible instances are gathered
+  /// into arrays and shaded with shadeGray() in parallel jobs. This needs
+  /// Coord = float and 8 bit colors.
+  template <typename Image, typename ZBuffer, typename Color, typename ShadeFace>
+  void draw( Image & img,
+             ZBuffer & zBuffer,
+             const MeshView<Coord> & mesh,
+             const Mat<Coord,4,4> * transforms,
+             const Color * colors,
+             std::size_t nInstances,
+             const Projection<Coord> & projection,
+             ShadeFace && shadeFace )
+  {
+    cull( mesh, transforms, nInstances, projection );
+    sortFrontToBack();
+    transform( mesh, transforms, projection );
+    constexpr bool isBatchShader = detail::IsBatchShader<ShadeFace>::value;
+    if constexpr ( isBatchShader )
+      shadeFaces( mesh, colors, shadeFace );
+
+    const auto nVertices = mesh.nVertices;
+    const auto nFaces = mesh.nIndices / 3;
+    const auto indices = mesh.indices;
+    for ( std::size_t v = 0; v < visibleInstances_.size(); ++v )
+    {
+      const auto instance = visibleInstances_[v];
+      const auto points3d = &points3d_[v*nVertices];
+      const auto points2d = &points2d_[v*nVertices];
+      sortTrianglesFrontToBack( points3d, indices, nFaces, projection.maxZ );
+      for ( const auto & item : triangleQueue_.getItems() )
+      {
+        const auto f = std::size_t( item.index );
+        const auto i = 3*f;
+        const auto faceColor = [&]
+        {
+          if constexpr ( isBatchShader )
+            return faceColors_[v*nFaces + f];
+          else
+            return shadeFace( normalVector( points3d[indices[i  ]],
+                                            points3d[indices[i+1]],
+                                            points3d[indices[i+2]] ),
+                              colors[instance] );
+        }();
+        drawTriangle( img,
+                      points2d[indices[i  ]],
+                      points2d[indices[i+1]],
+                      points2d[indices[i+2]],
+                      faceColor,
+                      zBuffer, projection.maxZ, triangleDepths_[f] );
+      }
+    }
+  }
+
+private:
+  void cull( const MeshView<Coord> & mesh,
+             const Mat<Coord,4,4> * transforms,
+             std::size_t nInstances,
+             const Projection<Coord> & projection )
+  {
+    const auto & bounds = mesh.boundingSphere;
+    isVisible_.resize( nInstances );
+    distances_.resize( nInstances );
+    jobSystem_.parallelFor( "cull instances", nInstances, 1024,
+                            [&]( std::size_t begin, std::size_t end )
+    {
+      for ( auto i = begin; i < end; ++i )
+      {
+        const auto & m = transforms[i];
+        const Sphere<Coord> sphere{
+          detail::transformPoint( m, bounds.center ),
+          bounds.radius * detail::getMaxScale( m ) };
+        isVisible_[i] = projection.isVisible( sphere );
+        distances_[i] = -sphere.center[2];
+      }
+    } );
+    visibleInstances_.clear();
+    for ( std::size_t i = 0; i < nInstances; ++i )
+      if ( isVisible_[i] )
+        visibleInstances_.push_back( std::uint32_t(i) );
+  }
+
+  void sortFrontToBack()
+  {
+    if ( visibleInstances_.size() < 2 )
+      return;
+    auto nearDist = distances_[visibleInstances_.front()];
+    auto farDist = nearDist;
+    for ( const auto instance : visibleInstances_ )
+    {
+      nearDist = std::min( nearDist, distances_[instance] );
+      farDist  = std::max( farDist , distances_[instance] );
+    }
+    if ( nearDist == farDist )
+      return;
+    drawQueue_.clear();
+    for ( const auto instance : visibleInstances_ )
+      drawQueue_.push( DrawKey::make( DrawLayer::Opaque,
+          DrawKey::makeDepthBucket( distances_[instance], nearDist, farDist ),
+          0, 0 ), instance );
+    drawQueue_.sort();
+    const auto & items = drawQueue_.getItems();
+    for ( std::size_t i = 0; i < items.size(); ++i )
+      visibleInstances_[i] = items[i].index;
+  }
+
+  /// Puts the triangles of an instance, which lie in front of maxZ, into
+  /// triangleQueue_ ordered front to back by their depths. The depths are
+  /// stored in triangleDepths_. Within an instance this lets the z-buffer
+  /// reject the hidden faces, e.g. the back faces of a cube, early.
+  void sortTrianglesFrontToBack( const Vec<Coord,3> * points3d,
+                                 const std::uint32_t * indices,
+                                 std::size_t nFaces,
+                                 Coord maxZ )
+  {
+    // Skipped triangles are marked with z = -infinity.
+    constexpr auto skipped = std::numeric_limits<Coord>::infinity();
+    triangleDepths_.resize( nFaces );
+    auto nearDist = skipped;
+    auto farDist = -skipped;
+    for ( std::size_t f = 0; f < nFaces; ++f )
+    {
+      const auto & P = points3d[indices[3*f  ]];
+      const auto & Q = points3d[indices[3*f+1]];
+      const auto & R = points3d[indices[3*f+2]];
+      const auto z = ( P[2] + Q[2] + R[2] ) / 3;
+      const bool isSkipped = std::max( { P[2], Q[2], R[2] } ) >= maxZ;
+      triangleDepths_[f] = isSkipped ? -skipped : z;
+      if ( isSkipped )
+        continue;
+      nearDist = std::min( nearDist, -z );
+      farDist  = std::max( farDist , -z );
+    }
+    triangleQueue_.clear();
+    const bool isSorted = nearDist < farDist;
+    for ( std::size_t f = 0; f < nFaces; ++f )
+    {
+      if ( triangleDepths_[f] == -skipped )
+        continue;
+      const auto depthBucket = isSorted
+          ? DrawKey::makeDepthBucket( -triangleDepths_[f], nearDist, farDist )
+          : 0;
+      triangleQueue_.push( DrawKey::make( DrawLayer::Opaque, depthBucket, 0, 0 ),
+                           std::uint32_t(f) );
+    }
+    if ( isSorted )
+      triangleQueue_.sort();
+  }
+
+  void transform( const MeshView<Coord> & mesh,
+                  const Mat<Coord,4,4> * transforms,
+                  const Projection<Coord> & projection )
+  {
+    const auto nVertices = mesh.nVertices;
+    points3d_.resize( visibleInstances_.size() * nVertices );
+    points2d_.resize( visibleInstances_.size() * nVertices );
+    jobSystem_.parallelFor( "transform instances", visibleInstances_.size(),
+        4096 / std::max<std::size_t>( nVertices, 1 ),
+        [&]( std::size_t begin, std::size_t end )
+    {
+      for ( auto v = begin; v < end; ++v )
+      {
+        const auto & m = transforms[visibleInstances_[v]];
+        for ( std::size_t i = 0; i < nVertices; ++i )
+        {
+          const auto p = detail::transformPoint( m, mesh.positions[i] );
+          points3d_[v*nVertices+i] = p;
+          points2d_[v*nVertices+i] = projection.project( p );
+        }
+      }
+    } );
+  }
+
+  template <typename BatchShader>
+  void shadeFaces( const MeshView<Coord> & mesh,
+                   const std::uint8_t * colors,
+                   const BatchShader & shader )
+  {
+    const auto nVertices = mesh.nVertices;
+    const auto nFaces = mesh.nIndices / 3;
+    const auto indices = mesh.indices;
+    const auto n = visibleInstances_.size() * nFaces;
+    faceNormals_.resize( n );
+    facePositions_.resize( n );
+    faceBaseColors_.resize( n );
+    faceColors_.resize( n );
+    jobSystem_.parallelFor( "shade faces", visibleInstances_.size(),
+        std::max<std::size_t>( 4096 / std::max<std::size_t>( nFaces, 1 ), 1 ),
+        [&]( std::size_t begin, std::size_t end )
+    {
+      for ( auto v = begin; v < end; ++v )
+      {
+        const auto points3d = &points3d_[v*nVertices];
+        const auto color = colors[visibleInstances_[v]];
+        for ( std::size_t f = 0; f < nFaces; ++f )
+        {
+          const auto & P = points3d[indices[3*f  ]];
+          const auto & Q = points3d[indices[3*f+1]];
+          const auto & R = points3d[indices[3*f+2]];
+          faceNormals_.set( v*nFaces + f, normalVector( P, Q, R ) );
+          facePositions_.set( v*nFaces + f, ( P + Q + R ) / Coord(3) );
+          faceBaseColors_[v*nFaces + f] = color;
+        }
+      }
+      shader.shadeGray( faceNormals_, facePositions_, faceBaseColors_.data(),
+                        faceColors_.data(), begin*nFaces, end*nFaces );
+    } );
+  }
+
+  JobSystem & jobSystem_;
+  std::vector<char> isVisible_;
+  std::vector<Coord> distances_;
+  DrawQueue drawQueue_;
+  DrawQueue triangleQueue_;
+  std::vector<Coord> triangleDepths_;
+  std::vector<std::uint32_t> visibleInstances_;
+  std::vector<Vec<Coord,3>> points3d_;
+  std::vector<Vec<Coord,2>> points2d_;
+  Vec3Array faceNormals_;
+  Vec3Array facePositions_;
+  std::vector<std::uint8_t> faceBaseColors_;
+  std::vector<std::uint8_t> faceColors_;
+};
+
+} // namespace cu
@@ -0,0 +1,399 @@
+#include "job_system.hpp"
+
+#include <cstdint>
+
+
+namespace cu
+{
+
+namespace detail
+{
+
+  struct Job
+  {
+    const char * name;
+    std::function<void()> f;
+    /// The number of unfinished dependencies plus one while the job is being
+    /// submitted. The job is scheduled when this drops to zero.
+    std::atomic<std::size_t> nPending{1};
+    std::mutex mutex;
+    bool done = false;
+    /// The exception thrown by f or by a dependency.
+    std::exception_ptr error;
+    std::vector<std::shared_ptr<Job>> dependents;
+    /// Keeps the job alive while it is queued, since the queues hold plain
+    /// pointers.
+    std::shared_ptr<Job> self;
+  };
+
+
+  /// A Chase-Lev work-stealing deque in the formulation for the C11 memory
+  /// model by Le, Pop, Cohen and Zappa Nardelli. Only the owner pushes and
+  /// pops at the bottom, other threads steal from the top. When the ring
+  /// buffer grows, the old one is kept, because thieves may still read it.
+  class WorkStealingDeque
+  {
+  public:
+    WorkStealingDeque()
+    {
+      buffers_.push_back( std::make_unique<Buffer>( 64 ) );
+      buffer_ = buffers_.back().get();
+    }
+
+    void push( Job * job )
+    {
+      const auto bottom = bottom_.load( std::memory_order_relaxed );
+      const auto top = top_.load( std::memory_order_acquire );
+      auto buffer = buffer_.load( std::memory_order_relaxed );
+      if ( bottom - top >= std::int64_t(buffer->size) )
+        buffer = grow( top, bottom );
+      buffer->at( bottom ).store( job, std::memory_order_relaxed );
+      bottom_.store( bottom + 1, std::memory_order_release );
+    }
+
+    Job * pop()
+    {
+      const auto bottom = bottom_.load( std::memory_order_relaxed ) - 1;
+      const auto buffer = buffer_.load( std::memory_order_relaxed );
+      bottom_.store( bottom, std::memory_order_relaxed );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      auto top = top_.load( std::memory_order_relaxed );
+      if ( top > bottom )
+      {
+        bottom_.store( bottom + 1, std::memory_order_relaxed );
+        return nullptr;
+      }
+      auto job = buffer->at( bottom ).load( std::memory_order_relaxed );
+      if ( top == bottom )
+      {
+        // The last job. A thief may take it at the same time.
+        if ( !top_.compare_exchange_strong( top, top + 1, std::memory_order_seq_cst,
+                                            std::memory_order_relaxed ) )
+          job = nullptr;
+        bottom_.store( bottom + 1, std::memory_order_relaxed );
+      }
+      return job;
+    }
+
+    /// Returns nullptr, if the deque is empty or another thread took the job.
+    Job * steal()
+    {
+      auto top = top_.load( std::memory_order_acquire );
+      std::atomic_thread_fence( std::memory_order_seq_cst );
+      const auto bottom = bottom_.load( std::memory_order_acquire );
+      if ( top >= bottom )
+        return nullptr;
+      const auto job = buffer_.load( std::memory_order_acquire )->at( top )
+                         .load( std::memory_order_relaxed );
+      if ( !top_.compare_exchange_strong( top, top + 1, std::memory_order_seq_cst,
+                                          std::memory_order_relaxed ) )
+        return nullptr;
+      return job;
+    }
+
+  private:
+    struct Buffer
+    {
+      explicit Buffer( std::size_t size_ )
+        : size( size_ )
+        , slots( new std::atomic<Job*>[size_]() )
+      {}
+
+      std::atomic<Job*> & at( std::int64_t i )
+      {
+        return slots[ std::size_t(i) & (size - 1) ];
+      }
+
+      std::size_t size;
+      std::unique_ptr<std::atomic<Job*>[]> slots;
+    };
+
+    Buffer * grow( std::int64_t top, std::int64_t bottom )
+    {
+      const auto old = buffer_.load( std::memory_order_relaxed );
+      buffers_.push_back( std::make_unique<Buffer>( 2 * old->size ) );
+      const auto buffer = buffers_.back().get();
+      for ( auto i = top; i < bottom; ++i )
+        buffer->at( i ).store( old->at( i ).load( std::memory_order_relaxed ),
+                               std::memory_order_relaxed );
+      buffer_.store( buffer, std::memory_order_release );
+      return buffer;
+    }
+
+    // Top and bottom are on separate cache lines, since thieves write the
+    // first and the owner the second.
+    alignas(64) std::atomic<std::int64_t> top_{0};
+    alignas(64) std::atomic<std::int64_t> bottom_{0};
+    std::atomic<Buffer*> buffer_{nullptr};
+    std::vector<std::unique_ptr<Buffer>> buffers_;
+  };
+
+  /// The job system and worker index of the current thread, if it is a
+  /// worker thread.
+  thread_local const JobSystem * currentJobSystem = nullptr;
+  thread_local std::size_t currentWorker = 0;
+
+} // namespace detail
+
+
+struct JobSystem::Worker
+{
+  detail::WorkStealingDeque jobs;
+};
+
+
+bool JobHandle::isDone() const
+{
+  if ( !job_ )
+    return true;
+  std::lock_guard<std::mutex> lock( job_->mutex );
+  return job_->done;
+}
+
+
+JobSystem::JobSystem( std::size_t nWorkers )
+{
+  for ( std::size_t i = 0; i < nWorkers; ++i )
+    workers_.push_back( std::make_unique<Worker>() );
+  for ( std::size_t i = 0; i < nWorkers; ++i )
+    threads_.emplace_back( [this,i]{ workerLoop( i ); } );
+}
+
+
+JobSystem::~JobSystem()
+{
+  {
+    std::lock_guard<std::mutex> lock( sleepMutex_ );
+    stop_ = true;
+  }
+  jobQueued_.notify_all();
+  for ( auto & thread : threads_ )
+    thread.join();
+  // Jobs still queued refer to themselves.
+  while ( auto job = findJob( workers_.size() ) )
+    job->f = nullptr;
+}
+
+
+void JobSystem::setProfilingHooks( JobProfilingHooks hooks )
+{
+  hooks_ = std::move(hooks);
+}
+
+
+JobHandle JobSystem::run( const char * name,
+                          std::function<void()> f,
+                          std::initializer_list<JobHandle> dependencies )
+{
+  auto job = std::make_shared<detail::Job>();
+  job->name = name;
+  job->f = std::move(f);
+  for ( const auto & dependency : dependencies )
+  {
+    if ( !dependency.job_ )
+      continue;
+    std::lock_guard<std::mutex> lock( dependency.job_->mutex );
+    if ( dependency.job_->done )
+    {
+      if ( dependency.job_->error && !job->error )
+        job->error = dependency.job_->error;
+      continue;
+    }
+    ++job->nPending;
+    dependency.job_->dependents.push_back( job );
+  }
+  if ( --job->nPending == 0 )
+    schedule( job );
+  return JobHandle( std::move(job) );
+}
+
+
+void JobSystem::wait( const JobHandle & handle )
+{
+  const auto worker = getCurrentWorker();
+  while ( !handle.isDone() )
+  {
+    if ( auto job = findJob( worker ) )
+    {
+      execute( job );
+      continue;
+    }
+    // Nothing to help with. The job runs on another thread or waits for
+    // dependencies which do, so sleep until some job finishes or another
+    // one becomes ready.
+    std::unique_lock<std::mutex> lock( sleepMutex_ );
+    ++nWaiting_;
+    if ( nQueuedJobs_ == 0 && !handle.isDone() )
+      jobFinishedOrQueued_.wait( lock );
+    --nWaiting_;
+  }
+  if ( !handle.job_ )
+    return;
+  std::lock_guard<std::mutex> lock( handle.job_->mutex );
+  if ( handle.job_->error )
+    std::rethrow_exception( handle.job_->error );
+}
+
+
+void JobSystem::schedule( std::shared_ptr<detail::Job> job )
+{
+  if ( workers_.empty() )
+  {
+    // Without workers the job runs right away on the thread which made it
+    // ready.
+    execute( job );
+    return;
+  }
+  // Counting the job before it is visible keeps findJob() from taking it
+  // while the count is still zero.
+  ++nQueuedJobs_;
+  const auto raw = job.get();
+  raw->self = std::move(job);
+  const auto worker = getCurrentWorker();
+  if ( worker < workers_.size() )
+    workers_[worker]->jobs.push( raw );
+  else
+  {
+    std::lock_guard<std::mutex> lock( sharedMutex_ );
+    sharedJobs_.push_back( raw );
+  }
+  if ( nSleeping_ == 0 && nWaiting_ == 0 )
+    return;
+  {
+    // Taking the lock avoids missing a thread which is about to sleep.
+    std::lock_guard<std::mutex> lock( sleepMutex_ );
+  }
+  jobQueued_.notify_one();
+  if ( nWaiting_ > 0 )
+    jobFinishedOrQueued_.notify_all();
+}
+
+
+std::shared_ptr<detail::Job> JobSystem::findJob( std::size_t worker )
+{
+  if ( nQueuedJobs_ == 0 )
+    return nullptr;
+  const auto take = [this]( detail::Job * job )
+  {
+    --nQueuedJobs_;
+    return std::move( job->self );
+  };
+  const auto nWorkers = workers_.size();
+  if ( worker < nWorkers )
+    if ( const auto job = workers_[worker]->jobs.pop() )
+      return take( job );
+  {
+    std::lock_guard<std::mutex> lock( sharedMutex_ );
+    if ( !sharedJobs_.empty() )
+    {
+      const auto job = sharedJobs_.front();
+      sharedJobs_.pop_front();
+      return take( job );
+    }
+  }
+  for ( std::size_t i = 1; i <= nWorkers; ++i )
+    if ( const auto job = workers_[(worker + i) % nWorkers]->jobs.steal() )
+      return take( job );
+  return nullptr;
+}
+
+
+void JobSystem::execute( const std::shared_ptr<detail::Job> & job )
+{
+  // The error of a failed dependency is only written before the job is
+  // scheduled, so reading it needs no lock.
+  std::exception_ptr error = job->error;
+  if ( !error )
+  {
+    try
+    {
+      runInline( job->name, job->f );
+    }
+    catch ( ... )
+    {
+      error = std::current_exception();
+    }
+  }
+  job->f = nullptr;
+  std::vector<std::shared_ptr<detail::Job>> dependents;
+  {
+    std::lock_guard<std::mutex> lock( job->mutex );
+    job->error = error;
+    job->done = true;
+    dependents.swap( job->dependents );
+  }
+  for ( auto & dependent : dependents )
+  {
+    if ( error )
+    {
+      std::lock_guard<std::mutex> lock( dependent->mutex );
+      if ( !dependent->error )
+        dependent->error = error;
+    }
+    if ( --dependent->nPending == 0 )
+      schedule( std::move(dependent) );
+  }
+  if ( nWaiting_ == 0 )
+    return;
+  {
+    std::lock_guard<std::mutex> lock( sleepMutex_ );
+  }
+  jobFinishedOrQueued_.notify_all();
+}
+
+
+void JobSystem::runInline( const char * name, const std::function<void()> & f )
+{
+  if ( !hooks_.onJobBegin && !hooks_.onJobEnd )
+  {
+    f();
+    return;
+  }
+  const auto worker = getCurrentWorker();
+  if ( hooks_.onJobBegin )
+    hooks_.onJobBegin( name, worker );
+  try
+  {
+    f();
+  }
+  catch ( ... )
+  {
+    if ( hooks_.onJobEnd )
+      hooks_.onJobEnd( name, worker );
+    throw;
+  }
+  if ( hooks_.onJobEnd )
+    hooks_.onJobEnd( name, worker );
+}
+
+
+void JobSystem::workerLoop( std::size_t worker )
+{
+  detail::currentJobSystem = this;
+  detail::currentWorker = worker;
+  for (;;)
+  {
+    if ( auto job = findJob( worker ) )
+    {
+      execute( job );
+      continue;
+    }
+    std::unique_lock<std::mutex> lock( sleepMutex_ );
+    if ( stop_ )
+      return;
+    ++nSleeping_;
+    if ( nQueuedJobs_ == 0 )
+      jobQueued_.wait( lock );
+    --nSleeping_;
+  }
+}
+
+
+std::size_t JobSystem::getCurrentWorker() const
+{
+  return detail::currentJobSystem == this
+      ? detail::currentWorker
+      : workers_.size();
+}
+
+} // namespace cu
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace cu
+{
+
+namespace detail
+{
+  struct Job;
+}
+
+
+/// Refers to a job submitted to a JobSystem. Other jobs can depend on it
+/// and threads can wait for it.
+class JobHandle
+{
+public:
+  JobHandle() = default;
+
+  /// Returns true, if the job has finished or if the handle is empty.
+  bool isDone() const;
+
+private:
+  friend class JobSystem;
+  explicit JobHandle( std::shared_ptr<detail::Job> job )
+    : job_( std::move(job) )
+  {}
+
+  std::shared_ptr<detail::Job> job_;
+};
+
+
+/// Functions called around every job, e.g. for recording a timeline.
+/// They are called on the thread executing the job with the name of the
+/// job and the index of the worker, where the index of threads which are
+/// not workers of the job system is getNWorkers().
+struct JobProfilingHooks
+{
+  std::function<void(const char * name, std::size_t worker)> onJobBegin;
+  std::function<void(const char * name, std::size_t worker)> onJobEnd;
+};
+
+
+/// A work-stealing task scheduler.
+///
+/// Every worker thread owns a lock-free deque of jobs. Jobs submitted from a
+/// worker go into its own deque, which it processes in LIFO order for good
+/// cache locality. Idle workers steal the oldest jobs from the deques of
+/// other workers. Jobs submitted from other threads go into a shared queue.
+/// Threads waiting for a job help executing jobs in the meantime, so jobs
+/// may wait for other jobs without deadlocking.
+class JobSystem
+{
+public:
+  /// Starts the given number of worker threads. With zero workers all jobs
+  /// are executed by the threads waiting for them.
+  explicit JobSystem( std::size_t nWorkers = std::thread::hardware_concurrency() );
+  ~JobSystem();
+
+  JobSystem( const JobSystem & ) = delete;
+  JobSystem & operator=( const JobSystem & ) = delete;
+
+  std::size_t getNWorkers() const { return workers_.size(); }
+
+  /// Must not be called while jobs are running.
+  void setProfilingHooks( JobProfilingHooks hooks );
+
+  /// Schedules f to be executed once all dependencies have finished.
+  /// The name must outlive the job; string literals are fine. If f or a
+  /// dependency throws, the exception is stored in the job and f is not
+  /// executed for jobs depending on it.
+  JobHandle run( const char * name,
+                 std::function<void()> f,
+                 std::initializer_list<JobHandle> dependencies = {} );
+
+  /// Blocks until the job has finished and executes other jobs meanwhile.
+  /// Rethrows the exception of the job, if it failed.
+  void wait( const JobHandle & handle );
+
+  /// Calls f(begin,end) for disjoint subranges of [0,n) whose sizes are at
+  /// most grainSize and returns when all calls have finished. The calling
+  /// thread takes part in the work. If a call throws, no further chunks are
+  /// started and the first exception is rethrown after all running calls
+  /// have finished, because they refer to f.
+  template <typename F>
+  void parallelFor( const char * name,
+                    std::size_t n,
+                    std::size_t grainSize,
+                    F && f )
+  {
+    if ( n == 0 )
+      return;
+    grainSize = std::max<std::size_t>( grainSize, 1 );
+    const auto nChunks = (n + grainSize - 1) / grainSize;
+    if ( nChunks == 1 || workers_.empty() )
+    {
+      f( std::size_t(0), n );
+      return;
+    }
+    // A few jobs pull chunks from a shared counter. This balances the load
+    // without creating a job for every chunk.
+    std::atomic<std::size_t> nextChunk{0};
+    const auto work = [&]
+    {
+      try
+      {
+        for ( auto chunk = nextChunk++; chunk < nChunks; chunk = nextChunk++ )
+          f( chunk*grainSize, std::min( n, (chunk+1)*grainSize ) );
+      }
+      catch ( ... )
+      {
+        nextChunk = nChunks;
+        throw;
+      }
+    };
+    const auto nJobs = std::min( nChunks - 1, workers_.size() );
+    std::vector<JobHandle> handles;
+    handles.reserve( nJobs );
+    for ( std::size_t i = 0; i < nJobs; ++i )
+      handles.push_back( run( name, work ) );
+    std::exception_ptr error;
+    try
+    {
+      runInline( name, work );
+    }
+    catch ( ... )
+    {
+      error = std::current_exception();
+    }
+    for ( const auto & handle : handles )
+    {
+      try
+      {
+        wait( handle );
+      }
+      catch ( ... )
+      {
+        if ( !error )
+          error = std::current_exception();
+      }
+    }
+    if ( error )
+      std::rethrow_exception( error );
+  }
+
+private:
+  struct Worker;
+
+  void schedule( std::shared_ptr<detail::Job> job );
+  std::shared_ptr<detail::Job> findJob( std::size_t worker );
+  void execute( const std::shared_ptr<detail::Job> & job );
+  void runInline( const char * name, const std::function<void()> & f );
+  void workerLoop( std::size_t worker );
+  std::size_t getCurrentWorker() const;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<std::thread> threads_;
+  /// Jobs submitted by threads which are not workers.
+  std::mutex sharedMutex_;
+  std::deque<detail::Job *> sharedJobs_;
+  /// The number of jobs in all queues. It is incremented before a job is
+  /// queued, so it may briefly count a job which cannot be found yet.
+  std::atomic<std::size_t> nQueuedJobs_{0};
+  /// Sleeping workers and waiting threads count themselves here before
+  /// checking nQueuedJobs_, so schedule() and execute() only take
+  /// sleepMutex_ to wake them, if there are any.
+  std::atomic<std::size_t> nSleeping_{0};
+  std::atomic<std::size_t> nWaiting_{0};
+  std::mutex sleepMutex_;
+  std::condition_variable jobQueued_;
+  std::condition_variable jobFinishedOrQueued_;
+  bool stop_{false};
+  JobProfilingHooks hooks_;
+};
+
+} // namespace cu
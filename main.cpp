@@ -1,10 +1,59 @@
+#include "bounded_queue.hpp"
+#include "command_buffer.hpp"
+#include "cube_scene.hpp"
+#include "differential_fuzz.hpp"
+#include "dirty_region.hpp"
+#include "draw_queue.hpp"
+#include "drawing.hpp"
+#include "fast_trig.hpp"
+#include "frame_writer.hpp"
+#include "framebuffer.hpp"
+#include "instancing.hpp"
+#include "job_system.hpp"
 #include "main_window.hpp"
 #include "mat.hpp"
+#include "mesh.hpp"
+#include "mesh_io.hpp"
+#include "mesh_optimizer.hpp"
+#include "meshlets.hpp"
+#include "msaa.hpp"
+#include "quaternion.hpp"
+#include "resolution_scaling.hpp"
+#include "shading.hpp"
+#include "texture.hpp"
+#include "trafo_mats.hpp"
 #include "vec.hpp"
 
+#ifdef __linux__
+#include "render_server.hpp"
+#endif
+
+#include <stdlib.h>
+#include <unistd.h>
+
 #include <QApplication>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 
 static void testVec()
@@ -35,13 +84,1351 @@ static void testMat()
 }
 
 
+static void testTiledMat()
+{
+    using cu::Mat;
+    using cu::TiledMat;
+    using cu::makeVec;
+
+    const auto A = makeVec( -3.5f, 2.f );
+    const auto B = makeVec( 30.25f, 11.5f );
+    const auto C = makeVec( 7.f, 40.f );
+    Mat<unsigned char> img( 21, 27, 0 );
+    TiledMat<unsigned char> tiledImg( 21, 27, 0 );
+    drawTriangle( img, A, B, C, (unsigned char)1 );
+    drawTriangle( tiledImg, A, B, C, (unsigned char)1 );
+    Mat<unsigned char> resolvedImg( 21, 27 );
+    resolve( tiledImg, resolvedImg );
+    assert( std::equal( img.data(), img.data() + 21*27, resolvedImg.data() ) );
+
+    cu::JobSystem jobSystem( 3 );
+    clear( resolvedImg, (unsigned char)0 );
+    resolve( tiledImg, resolvedImg, jobSystem );
+    assert( std::equal( img.data(), img.data() + 21*27, resolvedImg.data() ) );
+    clear( tiledImg, (unsigned char)5, jobSystem );
+    assert( tiledImg[20][26] == 5 );
+}
+
+
+static void testTexture()
+{
+    using cu::Mat;
+    using cu::Texture;
+    using cu::TextureFilter;
+
+    Mat<unsigned char> image( 6, 5 );
+    for ( std::size_t row = 0; row < 6; ++row )
+        for ( std::size_t col = 0; col < 5; ++col )
+            image[row][col] = 40 * ((row+col)%2) + 100;
+    const Texture<unsigned char> texture( image );
+    assert( texture.getNLevels() == 3 );
+    assert( texture.getLevel(2).getNRows() == 1 );
+    assert( texture.getLevel(2).getNCols() == 1 );
+    assert( texture.sample( 0.3f, 0.1f, 0.f, TextureFilter::Nearest ) == 140 );
+    assert( texture.sample( 0.3f, 0.1f, 5.f, TextureFilter::Nearest ) == 120 );
+    assert( texture.sample( 0.5f, 0.5f, 0.f, TextureFilter::Bilinear ) == 120 );
+    assert( texture.sample( 0.9f, 0.2f, 1.5f, TextureFilter::Trilinear ) == 120 );
+
+    // Coordinates which are not finite or too large for an integer still
+    // give texels.
+    const auto nan = std::numeric_limits<float>::quiet_NaN();
+    assert( texture.sample( nan, 0.f, nan, TextureFilter::Nearest ) == 100 );
+    const auto far = texture.sample( 1e30f, -1e30f, 0.f, TextureFilter::Bilinear );
+    assert( far == 100 || far == 140 );
+    assert( texture.sample( -INFINITY, 0.5f/6, 0.f, TextureFilter::Trilinear ) == 100 );
+
+    // Texels are mapped onto the pixels of a triangle in the screen plane.
+    Mat<unsigned char> numbered( 8, 8 );
+    for ( std::size_t row = 0; row < 8; ++row )
+        for ( std::size_t col = 0; col < 8; ++col )
+            numbered[row][col] = (unsigned char)( 10*row + col );
+    const Texture<unsigned char> numberedTexture( numbered );
+    const auto A = cu::makeVec( 0.f, 0.f );
+    const auto B = cu::makeVec( 32.f, 0.f );
+    const auto C = cu::makeVec( 0.f, 32.f );
+    const auto uvA = cu::makeVec( 0.f, 0.f );
+    const auto uvB = cu::makeVec( 1.f, 0.f );
+    const auto uvC = cu::makeVec( 0.f, 1.f );
+    Mat<unsigned char> img( 32, 32, 255 );
+    drawTriangle( img, A, B, C, uvA, uvB, uvC, numberedTexture, TextureFilter::Nearest );
+    assert( img[4][16] == 14 && img[20][4] == 51 && img[31][31] == 255 );
+
+    // Vertices farther away get compressed. Halfway to B, which is three
+    // times as far as A and C, lies only a quarter of the texture.
+    drawTriangle( img, A, B, C, uvA, uvB, uvC, 1.f, 3.f, 1.f,
+                  numberedTexture, TextureFilter::Nearest );
+    assert( img[4][16] == 12 );
+
+    // The mipmap level is chosen per pixel. Level 0 of a checkerboard has
+    // the texels 0 and 200, all coarser levels have 100.
+    Mat<unsigned char> checker( 8, 8 );
+    for ( std::size_t row = 0; row < 8; ++row )
+        for ( std::size_t col = 0; col < 8; ++col )
+            checker[row][col] = (unsigned char)( 200 * ((row+col)%2) );
+    const Texture<unsigned char> checkerTexture( checker );
+    Mat<float> zBuffer( 32, 32, -100.f );
+    drawTriangle( img, A, B, C, uvA, uvB, uvC, 1.f, 64.f, 1.f,
+                  checkerTexture, TextureFilter::Nearest, zBuffer, -0.1f, -1.f );
+    assert( img[1][1] == 0 && img[0][31] == 100 );
+    assert( zBuffer[1][1] == -1.f );
+}
+
+
+static void testJobSystem()
+{
+    for ( std::size_t nWorkers : { 0, 1, 4 } )
+    {
+        cu::JobSystem jobSystem( nWorkers );
+        std::atomic<int> counter{0};
+        std::vector<int> order;
+        const auto a = jobSystem.run( "a", [&]{ ++counter; order.push_back(1); } );
+        const auto b = jobSystem.run( "b", [&]{ ++counter; order.push_back(2); }, { a } );
+        const auto c = jobSystem.run( "c", [&]{ order.push_back(counter); }, { a, b } );
+        jobSystem.wait( c );
+        assert( order == (std::vector<int>{ 1, 2, 2 }) );
+
+        std::vector<int> values( 10000 );
+        jobSystem.parallelFor( "iota", values.size(), 100,
+                               [&]( std::size_t begin, std::size_t end )
+        {
+            for ( auto i = begin; i < end; ++i )
+                values[i] = int(i);
+        } );
+        for ( std::size_t i = 0; i < values.size(); ++i )
+            assert( values[i] == int(i) );
+
+        // Exceptions reach the waiting thread and skip dependent jobs.
+        bool isDependentRun = false;
+        const auto failing = jobSystem.run( "fail", []{ throw std::runtime_error( "job" ); } );
+        const auto dependent = jobSystem.run( "dependent", [&]{ isDependentRun = true; }, { failing } );
+        bool hasThrown = false;
+        try { jobSystem.wait( dependent ); } catch ( const std::runtime_error & ) { hasThrown = true; }
+        assert( hasThrown && !isDependentRun );
+        hasThrown = false;
+        try { jobSystem.wait( failing ); } catch ( const std::runtime_error & ) { hasThrown = true; }
+        assert( hasThrown );
+        jobSystem.wait( cu::JobHandle() );
+
+        std::atomic<std::size_t> nCalls{0};
+        hasThrown = false;
+        try
+        {
+            jobSystem.parallelFor( "fail", 1000, 1, [&]( std::size_t begin, std::size_t end )
+            {
+                ++nCalls;
+                if ( begin <= 500 && 500 < end )
+                    throw std::runtime_error( "chunk" );
+            } );
+        }
+        catch ( const std::runtime_error & )
+        {
+            hasThrown = true;
+        }
+        assert( hasThrown && nCalls < 1000 );
+
+        // Jobs spawned by jobs go into the deque of their worker, which
+        // grows beyond its initial size here, and get stolen by the others.
+        std::atomic<int> nSpawned{0};
+        const auto spawner = jobSystem.run( "spawn", [&]
+        {
+            std::vector<cu::JobHandle> handles;
+            for ( int i = 0; i < 500; ++i )
+                handles.push_back( jobSystem.run( "spawned", [&]{ ++nSpawned; } ) );
+            for ( const auto & handle : handles )
+                jobSystem.wait( handle );
+        } );
+        jobSystem.wait( spawner );
+        assert( nSpawned == 500 );
+
+        // The hooks see every job begin and end on the same thread.
+        std::mutex eventsMutex;
+        std::vector<std::tuple<bool,std::string,std::size_t>> events;
+        const auto record = [&]( bool isBegin )
+        {
+            return [&,isBegin]( const char * name, std::size_t worker )
+            {
+                std::lock_guard<std::mutex> lock( eventsMutex );
+                events.emplace_back( isBegin, name, worker );
+            };
+        };
+        jobSystem.setProfilingHooks( { record( true ), record( false ) } );
+        jobSystem.wait( jobSystem.run( "single", []{} ) );
+        jobSystem.parallelFor( "loop", 100, 1, []( std::size_t, std::size_t ) {} );
+        jobSystem.setProfilingHooks( {} );
+        std::map<std::size_t,std::vector<std::string>> openJobs;
+        std::size_t nSingle = 0, nLoopOnCaller = 0;
+        for ( const auto & event : events )
+        {
+            const auto & name = std::get<1>( event );
+            const auto worker = std::get<2>( event );
+            assert( worker <= nWorkers );
+            auto & open = openJobs[worker];
+            if ( std::get<0>( event ) )
+            {
+                open.push_back( name );
+                nSingle += name == "single";
+                nLoopOnCaller += name == "loop" && worker == nWorkers;
+                continue;
+            }
+            assert( !open.empty() && open.back() == name );
+            open.pop_back();
+        }
+        for ( const auto & open : openJobs )
+            assert( open.second.empty() );
+        assert( nSingle == 1 );
+        // Without workers parallelFor() calls the function directly.
+        assert( nWorkers == 0 || nLoopOnCaller >= 1 );
+    }
+}
+
+
+static void testDrawQueue()
+{
+    using cu::DrawKey;
+    using cu::DrawLayer;
+
+    cu::DrawQueue queue;
+    queue.push( DrawKey::make( DrawLayer::Translucent, 10, 0, 0 ), 0 );
+    queue.push( DrawKey::make( DrawLayer::Opaque     , 20, 3, 1 ), 1 );
+    queue.push( DrawKey::make( DrawLayer::Translucent, 20, 0, 0 ), 2 );
+    queue.push( DrawKey::make( DrawLayer::Opaque     , 20, 1, 7 ), 3 );
+    queue.push( DrawKey::make( DrawLayer::Opaque     ,  5, 9, 2 ), 4 );
+    queue.push( DrawKey::make( DrawLayer::Opaque     , 20, 1, 7 ), 5 );
+    queue.sort();
+    std::vector<std::uint32_t> order;
+    for ( const auto & item : queue.getItems() )
+        order.push_back( item.index );
+    assert( order == (std::vector<std::uint32_t>{ 4, 3, 5, 1, 2, 0 }) );
+
+    // Short queues are insertion sorted, longer ones radix sorted. Both
+    // are stable.
+    for ( const std::uint32_t n : { 50, 1000 } )
+    {
+        queue.clear();
+        std::vector<std::pair<std::uint64_t,std::uint32_t>> expected;
+        std::uint64_t key = 12345;
+        for ( std::uint32_t i = 0; i < n; ++i )
+        {
+            key = key * 6364136223846793005u + 1442695040888963407u;
+            queue.push( key >> 57 << 40, i );
+            expected.emplace_back( key >> 57 << 40, i );
+        }
+        queue.sort();
+        std::stable_sort( expected.begin(), expected.end(),
+                          []( const auto & a, const auto & b ) { return a.first < b.first; } );
+        for ( std::size_t i = 0; i < n; ++i )
+            assert( queue.getItems()[i].index == expected[i].second );
+    }
+    assert( DrawKey::makeDepthBucket( 0.5f, 1.f, 2.f ) == 0 );
+    assert( DrawKey::makeDepthBucket( 3.f, 1.f, 2.f ) == DrawKey::maxDepthBucket );
+}
+
+
+static void testInstancing()
+{
+    using cu::Mat;
+    using cu::makeVec;
+
+    const auto cube = cu::makeCubeMesh<float>();
+    const cu::Projection<float> projection{ 20, 40, 30, -0.1f };
+    assert( !projection.isVisible( { makeVec( 0.f, 0.f, 1.f ), 1.f } ) );
+    assert( !projection.isVisible( { makeVec( 100.f, 0.f, -5.f ), 1.f } ) );
+    assert( projection.isVisible( { makeVec( 5.f, 0.f, -5.f ), 1.f } ) );
+
+    const Mat<float,4,4> transforms[] = {
+        cu::makeTranslationMat( makeVec( 0.f, 0.f, -5.f ) ),
+        cu::makeTranslationMat( makeVec( -100.f, 0.f, -5.f ) ) };
+    const unsigned char colors[] = { 1, 2 };
+    Mat<unsigned char> img( 30, 40, 0 );
+    Mat<float> zBuffer( 30, 40, -100.f );
+    cu::JobSystem jobSystem( 2 );
+    cu::InstancedRenderer<float> renderer( jobSystem );
+    renderer.draw( img, zBuffer, cube, transforms, colors, 2, projection,
+                   []( const cu::Vec<float,3> &, unsigned char color ) { return color; } );
+    assert( img[15][20] == 1 );
+    assert( img[0][0] == 0 );
+    assert( std::count( img.data(), img.data() + 30*40, 2 ) == 0 );
+
+    // The triangles of an instance are drawn front to back, so the front
+    // face of the cube comes first and the back face last.
+    std::vector<float> normalZs;
+    renderer.draw( img, zBuffer, cube, transforms, colors, 1, projection,
+                   [&normalZs]( const cu::Vec<float,3> & normal, unsigned char color )
+                   { normalZs.push_back( normal[2] ); return color; } );
+    assert( normalZs.size() == 12 );
+    assert( std::is_sorted( normalZs.rbegin(), normalZs.rend() ) );
+    assert( normalZs.front() > 0.999f && normalZs.back() < -0.999f );
+
+    // The bounding sphere for culling is computed once per view.
+    const cu::MeshView<float> cubeView( cube );
+    assert( cubeView.boundingSphere.center == makeVec( 0.f, 0.f, 0.f ) );
+    assert( std::abs( cubeView.boundingSphere.radius - std::sqrt( 3.f ) ) < 1e-6f );
+
+    // Each triangle is tested with the depth of its centroid. The tilted
+    // triangle is nearer at row 10, but its centroid is farther.
+    cu::Mesh<float> pair;
+    pair.positions = { { -4, -4, -4 }, { 4, -4, -4 }, { 0, 4, -4 },
+                       { -3, -1, -2 }, { 3, -1, -2 }, { 0, 1, -12 } };
+    pair.indices = { 0, 1, 2, 3, 4, 5 };
+    const Mat<float,4,4> identity[] = { cu::makeTranslationMat( makeVec( 0.f, 0.f, 0.f ) ) };
+    cu::clear( img, (unsigned char)0 );
+    cu::clear( zBuffer, -100.f );
+    renderer.draw( img, zBuffer, cu::MeshView<float>( pair ), identity, colors, 1, projection,
+                   []( const cu::Vec<float,3> & normal, unsigned char )
+                   { return (unsigned char)( std::abs( normal[2] ) > 0.999f ? 1 : 2 ); } );
+    assert( img[10][20] == 1 );
+    assert( img[6][2] == 2 );
+}
+
+
+static void testMeshlets()
+{
+    using cu::Mat;
+    using cu::makeVec;
+
+    auto optimizedCube = cu::makeCubeMesh<float>();
+    cu::optimizeVertexCache( optimizedCube.indices, optimizedCube.positions.size() );
+    cu::optimizeVertexFetch( optimizedCube );
+    assert( optimizedCube.positions.size() == 8 );
+    assert( optimizedCube.indices.size() == 36 );
+    assert( optimizedCube.indices[0] == 0 );
+
+    // Every face of the cube becomes a meshlet.
+    const auto cube = cu::makeCubeMesh<float>();
+    const auto meshlets = buildMeshlets( cu::MeshView<float>( cube ), 4, 2 );
+    assert( meshlets.meshlets.size() == 6 );
+    const auto & bounds = meshlets.bounds.front();
+    assert( bounds.coneCutoff == 0 );
+
+    // Looking at the cube from the front only the front face is visible.
+    // The side faces are seen edge-on.
+    const cu::Projection<float> projection{ 20, 40, 30, -0.1f };
+    const auto transform = cu::makeTranslationMat( makeVec( 0.f, 0.f, -5.f ) );
+    std::size_t nVisible = 0;
+    for ( const auto & b : meshlets.bounds )
+        nVisible += isMeshletVisible( b, transform, projection );
+    assert( nVisible == 1 );
+
+    Mat<unsigned char> img( 30, 40, 0 );
+    Mat<float> zBuffer( 30, 40, -100.f );
+    drawMeshlets( img, zBuffer, cu::MeshView<float>( cube ), meshlets, transform,
+                  (unsigned char)9, projection,
+                  []( const cu::Vec<float,3> &, unsigned char color ) { return color; } );
+    assert( img[15][20] == 9 );
+}
+
+
+static void testCommandBuffer()
+{
+    using cu::Mat;
+    using cu::makeVec;
+
+    const auto cube = cu::makeCubeMesh<float>();
+    const cu::Projection<float> projection{ 20, 40, 30, -0.1f };
+    std::vector<cu::CommandBuffer> buffers( 2 );
+    buffers[0].clear( 3, -100.f );
+    buffers[0].setProjection( projection );
+    buffers[1].setProjection( projection );
+    buffers[1].setColor( 7 );
+    buffers[1].setTransform( cu::makeTranslationMat( makeVec( 0.f, 0.f, -5.f ) ) );
+    buffers[1].drawMesh( 0 );
+
+    std::stringstream stream;
+    writeCommandBuffers( stream, buffers );
+    const auto replayed = cu::readCommandBuffers( stream );
+    assert( replayed.size() == 2 );
+    assert( replayed[1].getData() == buffers[1].getData() );
+
+    Mat<unsigned char> img( 30, 40, 0 );
+    Mat<float> zBuffer( 30, 40 );
+    cu::JobSystem jobSystem( 2 );
+    cu::CommandExecutor executor( jobSystem, { cube } );
+    executor.execute( replayed.data(), replayed.size(), img, zBuffer,
+                      []( const cu::Vec<float,3> &, std::uint8_t color ) { return color; } );
+    assert( img[15][20] == 7 );
+    assert( img[0][0] == 3 );
+
+    // Buffers recorded by several threads at once give the same commands
+    // and the same image as buffers recorded one after another.
+    const auto record = [&]( cu::CommandBuffer & buffer, std::size_t i )
+    {
+        if ( i == 0 )
+            buffer.clear( 1, -100.f );
+        buffer.setProjection( projection );
+        for ( std::size_t k = 0; k < 20; ++k )
+        {
+            buffer.setTransform( cu::makeTranslationMat(
+                makeVec( 0.2f * i - 1.5f, 0.1f * k - 1.f, -5.f - 0.3f * k ) ) );
+            buffer.setColor( std::uint8_t( 10 + i ) );
+            buffer.drawMesh( 0 );
+        }
+    };
+    std::vector<cu::CommandBuffer> serial( 16 ), parallel( 16 );
+    for ( std::size_t i = 0; i < serial.size(); ++i )
+        record( serial[i], i );
+    jobSystem.parallelFor( "record", parallel.size(), 1,
+                           [&]( std::size_t begin, std::size_t end )
+    {
+        for ( auto i = begin; i < end; ++i )
+            record( parallel[i], i );
+    } );
+    Mat<unsigned char> serialImg( 30, 40 ), parallelImg( 30, 40 );
+    executor.execute( serial.data(), serial.size(), serialImg, zBuffer,
+                      []( const cu::Vec<float,3> &, std::uint8_t color ) { return color; } );
+    executor.execute( parallel.data(), parallel.size(), parallelImg, zBuffer,
+                      []( const cu::Vec<float,3> &, std::uint8_t color ) { return color; } );
+    for ( std::size_t i = 0; i < serial.size(); ++i )
+        assert( parallel[i].getData() == serial[i].getData() );
+    assert( serialImg[15][20] >= 10 );
+    for ( std::size_t row = 0; row < 30; ++row )
+        for ( std::size_t col = 0; col < 40; ++col )
+            assert( parallelImg[row][col] == serialImg[row][col] );
+}
+
+
+/// Converts an OBJ or PLY file into the binary mesh format.
+static int convertMesh( const char * inPath, const char * outPath )
+{
+    try
+    {
+        cu::JobSystem jobSystem;
+        cu::convertToMeshFile( inPath, outPath, jobSystem );
+        return 0;
+    }
+    catch ( std::exception & e )
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+
+/// Renders frames of the cube scene offline and writes them with a
+/// FrameWriter.
+static int renderFrames( const char * path,
+                         const char * nFramesArg,
+                         const char * widthArg,
+                         const char * heightArg )
+{
+    try
+    {
+        const auto nFrames = std::stoul( nFramesArg );
+        const auto width = std::stoul( widthArg );
+        const auto height = std::stoul( heightArg );
+        cu::JobSystem jobSystem;
+        const auto cube = cu::makeCubeMesh<float>();
+        cu::CommandExecutor executor( jobSystem, { cube } );
+        cu::TiledMat<unsigned char> colorBuffer( height, width );
+        cu::TiledMat<float> zBuffer( height, width );
+        cu::FrameWriter writer( path, cu::getFrameFormat( path ), width, height );
+        cu::CubeScene scene;
+        cu::CommandBuffer commands;
+        for ( std::size_t i = 0; i < nFrames; ++i )
+        {
+            scene.angle = 0.01f * i;
+            commands.reset();
+            scene.record( commands, width, height );
+            executor.execute( &commands, 1, colorBuffer, zBuffer, cu::CubeScene::getLighting() );
+            auto frame = writer.acquireBuffer();
+            cu::resolve( colorBuffer, frame, jobSystem );
+            writer.submit( std::move( frame ) );
+        }
+        writer.finish();
+        const auto stats = writer.getStats();
+        std::cerr << stats.nWritten << " frames, " << stats.nBytesWritten
+                  << " bytes written, " << stats.nStalls << " stalls for "
+                  << stats.stallTime / 1000000 << " ms, "
+                  << stats.nBuffersAllocated << " buffers allocated" << std::endl;
+        return 0;
+    }
+    catch ( std::exception & e )
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+
+/// Executes a captured frame repeatedly for reproducible performance
+/// measurements and writes the last result with a FrameWriter. The mesh ids
+/// of the file refer to the meshes of the application, i.e. the cube.
+static int replayFrame( const char * capturePath,
+                        const char * nRepeatsArg,
+                        const char * widthArg,
+                        const char * heightArg,
+                        const char * outPath )
+{
+    try
+    {
+        const auto nRepeats = std::max<std::size_t>( std::stoul( nRepeatsArg ), 1 );
+        const auto width = std::stoul( widthArg );
+        const auto height = std::stoul( heightArg );
+        std::ifstream file( capturePath, std::ios::binary );
+        if ( !file )
+            throw std::runtime_error( "Could not open '" + std::string( capturePath ) + "'." );
+        const auto buffers = cu::readCommandBuffers( file );
+        cu::JobSystem jobSystem;
+        const auto cube = cu::makeCubeMesh<float>();
+        cu::CommandExecutor executor( jobSystem, { cube } );
+        cu::TiledMat<unsigned char> colorBuffer( height, width );
+        cu::TiledMat<float> zBuffer( height, width );
+        std::vector<double> times;
+        for ( std::size_t i = 0; i < nRepeats; ++i )
+        {
+            const auto start = std::chrono::steady_clock::now();
+            executor.execute( buffers.data(), buffers.size(), colorBuffer, zBuffer,
+                              cu::CubeScene::getLighting() );
+            times.push_back( std::chrono::duration<double,std::milli>(
+                                 std::chrono::steady_clock::now() - start ).count() );
+        }
+        cu::FrameWriter writer( outPath, cu::getFrameFormat( outPath ), width, height );
+        auto frame = writer.acquireBuffer();
+        cu::resolve( colorBuffer, frame, jobSystem );
+        writer.submit( std::move( frame ) );
+        writer.finish();
+        std::sort( times.begin(), times.end() );
+        std::cerr << nRepeats << " runs, min " << times.front() << " ms, median "
+                  << times[times.size()/2] << " ms, max " << times.back() << " ms"
+                  << std::endl;
+        return 0;
+    }
+    catch ( std::exception & e )
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+
+/// Compares the optimized kernels against their references in random
+/// cases. Returns 1, if any case fails.
+static int runFuzz( const char * nCasesArg, const char * seedArg )
+{
+    try
+    {
+        const auto nFailures = cu::runDifferentialFuzz(
+            std::stoull( seedArg ), std::stoull( nCasesArg ), std::cerr );
+        return nFailures == 0 ? 0 : 1;
+    }
+    catch ( std::exception & e )
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+
+#ifdef __linux__
+static int runRenderServer( const char * socketPath,
+                            const char * frameRingName,
+                            const char * width,
+                            const char * height )
+{
+    try
+    {
+        cu::JobSystem jobSystem;
+        cu::RenderServer server( socketPath, frameRingName,
+                                 std::stoul( width ), std::stoul( height ),
+                                 jobSystem );
+        server.run();
+        return 0;
+    }
+    catch ( std::exception & e )
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+
+static int runLatencyClient( const char * socketPath,
+                             const char * frameRingName,
+                             const char * nFrames )
+{
+    try
+    {
+        return cu::runLatencyClient( socketPath, frameRingName,
+                                     std::stoul( nFrames ), std::cout );
+    }
+    catch ( std::exception & e )
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+#endif
+
+
+static void testDirtyRegion()
+{
+    using cu::makeVec;
+
+    // Drawing through a scissor leaves everything outside unchanged.
+    cu::TiledMat<unsigned char> img( 40, 50, 0 );
+    cu::ScissoredImage<cu::TiledMat<unsigned char>> scissored( img, { 10, 5, 20, 15 } );
+    drawTriangle( scissored, makeVec( -10.f, -10.f ), makeVec( 100.f, -10.f ),
+                  makeVec( -10.f, 100.f ), (unsigned char)1 );
+    std::size_t nSet = 0;
+    for ( std::size_t row = 0; row < img.getNRows(); ++row )
+        for ( std::size_t col = 0; col < img.getNCols(); ++col )
+            nSet += img[row][col];
+    assert( nSet == 100 );
+    assert( img[5][10] == 1 && img[14][19] == 1 && img[4][10] == 0 && img[5][20] == 0 );
+
+    // Rows below the top of a scissor are the same as without it.
+    {
+        const auto A = makeVec( 19.25f, 59.75f );
+        const auto B = makeVec( 40.5f, 55.25f );
+        const auto C = makeVec( -10.f, -1.f );
+        cu::Mat<unsigned char> full( 50, 50, 0 );
+        cu::Mat<unsigned char> clipped( 50, 50, 0 );
+        drawTriangle( full, A, B, C, (unsigned char)1 );
+        cu::ScissoredImage<cu::Mat<unsigned char>> lowerHalf( clipped, { 0, 25, 50, 50 } );
+        drawTriangle( lowerHalf, A, B, C, (unsigned char)1 );
+        for ( std::size_t row = 25; row < 50; ++row )
+            for ( std::size_t col = 0; col < 50; ++col )
+                assert( full[row][col] == clipped[row][col] );
+    }
+
+    cu::DirtyTracker tracker;
+    tracker.resize( 100, 70 );
+    assert( tracker.getDirtyRects().size() == 1 );
+    assert( tracker.getDirtyBounds() == ( cu::PixelRect{ 0, 0, 70, 100 } ) );
+    tracker.markClean();
+    assert( tracker.isClean() );
+
+    // An unchanged object does not dirty anything. A moving object dirties
+    // its old and new tiles.
+    tracker.setObjectBounds( 0, { 0, 0, 10, 10 }, false );
+    tracker.markClean();
+    tracker.setObjectBounds( 0, { 0, 0, 10, 10 }, false );
+    assert( tracker.isClean() );
+    tracker.setObjectBounds( 0, { 0, 70, 10, 80 }, false );
+    auto rects = tracker.getDirtyRects();
+    assert( rects.size() == 2 );
+    assert( rects[0] == ( cu::PixelRect{ 0, 0, 32, 32 } ) );
+    assert( rects[1] == ( cu::PixelRect{ 0, 64, 32, 96 } ) );
+    tracker.markClean();
+
+    // Runs of equal width are merged vertically and clipped to the screen.
+    tracker.markDirty( { 40, 10, 70, 90 } );
+    rects = tracker.getDirtyRects();
+    assert( rects.size() == 1 );
+    assert( rects[0] == ( cu::PixelRect{ 32, 0, 70, 96 } ) );
+    tracker.markClean();
+
+    const auto cube = cu::makeCubeMesh<float>();
+    const auto box = cu::makeBoundingBox( cu::MeshView<float>( cube ) );
+    const cu::Projection<float> projection{ 20, 40, 30, -0.1f };
+    const auto bounds = cu::getScreenBounds(
+        box, cu::makeTranslationMat( makeVec( 0.f, 0.f, -5.f ) ), projection );
+    assert( bounds.left <= 15 && bounds.right >= 25 );
+    assert( bounds.top <= 10 && bounds.bottom >= 20 );
+    assert( bounds.left >= 13 && bounds.right <= 28 );
+    assert( cu::getScreenBounds(
+        box, cu::makeTranslationMat( makeVec( 0.f, 0.f, 5.f ) ), projection ).isEmpty() );
+
+    // Redrawing the bounds of the dirty rectangles in one go, like the
+    // window does, gives the same image as redrawing everything, although
+    // the bounds contain clean tiles.
+    cu::JobSystem jobSystem( 2 );
+    cu::CommandExecutor executor( jobSystem, { cube } );
+    const auto shadeFace = cu::CubeScene::getLighting();
+    cu::CubeScene scene;
+    cu::CommandBuffer commands;
+    cu::TiledMat<unsigned char> frameImg( 96, 256 ), fullImg( 96, 256 );
+    cu::TiledMat<float> zBuffer( 96, 256 ), fullZBuffer( 96, 256 );
+    tracker.resize( 96, 256 );
+    for ( int frame = 0; frame < 3; ++frame )
+    {
+        scene.angle = 0.3f * frame;
+        commands.reset();
+        scene.record( commands, 256, 96 );
+        tracker.setObjectBounds( 0, cu::getScreenBounds( box, scene.getTransform(),
+                                    cu::CubeScene::getProjection( 256, 96 ) ), true );
+        tracker.markDirty( { 0, 0, 1, 1 } );
+        const auto dirtyBounds = tracker.getDirtyBounds();
+        assert( frame == 0 || tracker.getDirtyRects().size() > 1 );
+        cu::ScissoredImage<cu::TiledMat<unsigned char>> color( frameImg, dirtyBounds );
+        cu::ScissoredImage<cu::TiledMat<float>> depth( zBuffer, dirtyBounds );
+        executor.execute( &commands, 1, color, depth, shadeFace );
+        tracker.markClean();
+        executor.execute( &commands, 1, fullImg, fullZBuffer, shadeFace );
+        for ( std::size_t row = 0; row < 96; ++row )
+            for ( std::size_t col = 0; col < 256; ++col )
+                assert( frameImg[row][col] == fullImg[row][col] );
+    }
+}
+
+
+static void testResolutionScaling()
+{
+    using cu::Mat;
+
+    // Upscaling reproduces constant images and interpolates between pixels.
+    Mat<std::uint8_t> src( 2, 2 );
+    src[0][0] = 0; src[0][1] = 200; src[1][0] = 0; src[1][1] = 200;
+    Mat<std::uint8_t> dst( 4, 4, 7 );
+    cu::upscaleBilinear( src, dst );
+    for ( std::size_t row = 0; row < 4; ++row )
+    {
+        assert( dst[row][0] == 0 && dst[row][3] == 200 );
+        assert( dst[row][1] == 50 && dst[row][2] == 150 );
+    }
+    Mat<std::uint8_t> partial( 4, 4, 7 );
+    cu::upscaleBilinear( src, partial, { 1, 1, 3, 2 } );
+    assert( partial[1][1] == 50 && partial[1][2] == 150 );
+    assert( partial[0][1] == 7 && partial[1][0] == 7 && partial[1][3] == 7 );
+    assert( cu::getUpscaledRect( { 0, 0, 1, 1 }, 2, 2, 4, 4 ) ==
+            ( cu::PixelRect{ 0, 0, 4, 4 } ) );
+
+    // An upscaler keeps its taps only while the sizes stay the same.
+    cu::BilinearUpscaler upscaler;
+    Mat<std::uint8_t> reused( 4, 4, 7 );
+    upscaler.upscale( src, reused, { 0, 0, 4, 4 } );
+    assert( std::equal( reused.data(), reused.data() + 16, dst.data() ) );
+    Mat<std::uint8_t> wide( 3, 8 ), expected( 3, 8 );
+    cu::JobSystem jobSystem( 2 );
+    upscaler.upscale( src, wide, { 0, 0, 8, 3 }, jobSystem );
+    cu::upscaleBilinear( src, expected );
+    assert( std::equal( wide.data(), wide.data() + 24, expected.data() ) );
+
+    // Slow frames lower the scale until the budget is met, then it stays.
+    cu::ResolutionController controller( 0.010, 0.25, 1 );
+    double scale = 1;
+    for ( int i = 0; i < 50; ++i )
+        scale = controller.update( 0.040 * scale * scale );
+    assert( scale >= 0.25 && scale <= 0.5 );
+    assert( controller.update( 0.040 * scale * scale ) == scale );
+    // Fast frames raise it again.
+    for ( int i = 0; i < 50; ++i )
+        scale = controller.update( 0.002 * scale * scale );
+    assert( scale == 1 );
+}
+
+
+static void testMsaa()
+{
+    using cu::makeVec;
+
+    // Only 4 and 8 samples have sample patterns.
+    for ( const std::size_t nSamples : { 0, 1, 2, 3, 5, 16 } )
+    {
+        bool hasThrown = false;
+        try { cu::MsaaMat<unsigned char>( 4, 4, nSamples ); }
+        catch ( const std::runtime_error & ) { hasThrown = true; }
+        assert( hasThrown );
+    }
+
+    cu::JobSystem jobSystem( 2 );
+    for ( const std::size_t nSamples : { 4, 8 } )
+    {
+        cu::MsaaMat<unsigned char> img( 20, 20, nSamples );
+        cu::MsaaMat<float> zBuffer( 20, 20, nSamples );
+        clear( img, (unsigned char)0 );
+        clear( zBuffer, -100.f );
+
+        // The vertical edge at x = 10 splits the samples of column 10 in
+        // halves. The pixels left of it are fully covered.
+        drawTriangle( img, makeVec( -5.f, -5.f ), makeVec( 10.f, -5.f ),
+                      makeVec( 10.f, 40.f ), 200, zBuffer, -0.1f, -1.f );
+        drawTriangle( img, makeVec( -5.f, -5.f ), makeVec( 10.f, 40.f ),
+                      makeVec( -5.f, 40.f ), 200, zBuffer, -0.1f, -1.f );
+        assert( img.isCompressed( img.getTileIndex( 0, 0 ) ) );
+        assert( !img.isCompressed( img.getTileIndex( 0, 10 ) ) );
+        assert( img.isCompressed( img.getTileIndex( 0, 16 ) ) );
+
+        cu::TiledMat<unsigned char> resolved( 20, 20 );
+        resolve( img, resolved, jobSystem );
+        for ( std::size_t row = 0; row < 20; ++row )
+        {
+            assert( resolved[row][9] == 200 );
+            assert( resolved[row][10] == 100 );
+            assert( resolved[row][11] == 0 );
+        }
+
+        // Occluded samples keep their color.
+        drawTriangle( img, makeVec( 0.f, 0.f ), makeVec( 20.f, 0.f ),
+                      makeVec( 0.f, 20.f ), 50, zBuffer, -0.1f, -2.f );
+        assert( img.getSample( 1, 1, 0 ) == 200 );
+        assert( img.getSample( 1, 15, 0 ) == 50 );
+
+        // Clearing a rectangle compresses the tiles inside it.
+        cu::ScissoredImage<cu::MsaaMat<unsigned char>> scissored( img, { 8, 0, 16, 12 } );
+        clear( scissored, (unsigned char)7, jobSystem );
+        assert( img.isCompressed( img.getTileIndex( 0, 10 ) ) );
+        assert( !img.isCompressed( img.getTileIndex( 8, 10 ) ) );
+        assert( img.getSample( 11, 10, nSamples-1 ) == 7 );
+        assert( img.getSample( 12, 10, 0 ) != 7 );
+    }
+}
+
+
+#ifdef __linux__
+static void testRenderServer()
+{
+    const auto suffix = std::to_string( ::getpid() );
+    const auto socketPath = "/tmp/render3d_test_" + suffix + ".sock";
+    const auto frameRingName = "/render3d_test_" + suffix;
+    cu::JobSystem jobSystem( 2 );
+    cu::RenderServer server( socketPath, frameRingName, 64, 48, jobSystem );
+    std::thread serverThread( [&server] { server.run(); } );
+
+    std::ostringstream out;
+    const auto clientResult = cu::runLatencyClient( socketPath, frameRingName, 10, out );
+    assert( clientResult == 0 );
+    assert( out.str().find( "10 frames of 64x48 pixels" ) == 0 );
+
+    // The latest frame shows the cube in the center.
+    cu::FrameRingReader frameRing( frameRingName );
+    cu::FrameRingReader::Frame frame;
+    const bool hasFrame = frameRing.acquireLatest( frame );
+    assert( hasFrame );
+    assert( frame.updateId == 10 );
+    assert( frame.pixels[24*64+32] != 0 && frame.pixels[0] == 0 );
+    assert( frameRing.isValid( frame ) );
+
+    cu::RenderClient( socketPath ).send(
+        { cu::SceneUpdateMessage::Shutdown, 0, 0, 0, 0, 0, 0 } );
+    serverThread.join();
+    (void)clientResult;
+    (void)hasFrame;
+}
+#endif
+
+
+/// A new temporary directory, which is removed with the files created by
+/// getPath() at the end of a test.
+class TestDirectory
+{
+public:
+    TestDirectory()
+    {
+        const char * tmp = std::getenv( "TMPDIR" );
+        auto pattern = std::string( tmp && *tmp ? tmp : "/tmp" ) + "/render3d_test_XXXXXX";
+        if ( !::mkdtemp( pattern.data() ) )
+            throw std::runtime_error( "Could not create a temporary directory." );
+        path_ = pattern;
+    }
+
+    ~TestDirectory()
+    {
+        for ( const auto & file : files_ )
+            std::remove( file.c_str() );
+        ::rmdir( path_.c_str() );
+    }
+
+    TestDirectory( const TestDirectory & ) = delete;
+    TestDirectory & operator=( const TestDirectory & ) = delete;
+
+    std::string getPath( const std::string & fileName )
+    {
+        files_.push_back( path_ + "/" + fileName );
+        return files_.back();
+    }
+
+private:
+    std::string path_;
+    std::vector<std::string> files_;
+};
+
+
+static void testFrameWriter()
+{
+    cu::BoundedQueue<int> queue( 5 );
+    assert( queue.getCapacity() == 8 );
+    for ( int i = 0; i < 8; ++i )
+        assert( queue.tryPush( i ) );
+    assert( !queue.tryPush( 8 ) );
+    int value = -1;
+    assert( queue.tryPop( value ) && value == 0 );
+
+    // Many producers and consumers see every element exactly once.
+    cu::BoundedQueue<int> mpmc( 64 );
+    std::atomic<long> sum{0};
+    std::atomic<int> nPopped{0};
+    std::vector<std::thread> threads;
+    for ( int t = 0; t < 2; ++t )
+        threads.emplace_back( [&mpmc, t]
+        {
+            for ( int i = 1; i <= 1000; ++i )
+                while ( !mpmc.tryPush( t*1000 + i ) )
+                    std::this_thread::yield();
+        } );
+    for ( int t = 0; t < 2; ++t )
+        threads.emplace_back( [&]
+        {
+            int v;
+            while ( nPopped < 2000 )
+                if ( mpmc.tryPop( v ) )
+                {
+                    sum += v;
+                    ++nPopped;
+                }
+        } );
+    for ( auto & thread : threads )
+        thread.join();
+    assert( sum == 2000L*2001/2 );
+
+    // The last chunk of every PNG file is the same.
+    std::vector<std::uint8_t> png;
+    const std::uint8_t pixels[] = { 1, 2, 3, 4, 5, 6 };
+    cu::encodePng( pixels, 3, 2, png );
+    const std::uint8_t iend[] = { 0,0,0,0, 'I','E','N','D', 0xAE,0x42,0x60,0x82 };
+    assert( png.size() > sizeof(iend) );
+    assert( std::equal( std::begin(iend), std::end(iend), png.end() - sizeof(iend) ) );
+
+    // Frame numbers only replace a single %d or %0<width>d.
+    for ( const auto pattern : { "out%s.pgm", "out.png", "%d_%d.ppm", "100%/f%d.png", "f%5d.pgm" } )
+    {
+        bool hasThrown = false;
+        try { cu::FrameWriter( pattern, cu::getFrameFormat( pattern ), 2, 2 ); }
+        catch ( const std::runtime_error & ) { hasThrown = true; }
+        assert( hasThrown );
+    }
+
+    TestDirectory dir;
+    {
+        for ( int i = 0; i < 5; ++i )
+            dir.getPath( "100%_00" + std::to_string( i ) + ".pgm" );
+        cu::FrameWriter writer( dir.getPath( "100%%_%03d.pgm" ),
+                                cu::FrameFormat::PgmSequence, 3, 2, 2, 2 );
+        for ( int i = 0; i < 5; ++i )
+        {
+            auto frame = writer.acquireBuffer();
+            std::fill_n( frame.data(), 6, std::uint8_t(i) );
+            writer.submit( std::move( frame ) );
+        }
+        writer.finish();
+        const auto stats = writer.getStats();
+        assert( stats.nSubmitted == 5 && stats.nWritten == 5 );
+        assert( stats.nBuffersAllocated <= 5 );
+    }
+    std::ifstream pgm( dir.getPath( "100%_004.pgm" ), std::ios::binary );
+    const std::string content( ( std::istreambuf_iterator<char>( pgm ) ),
+                               std::istreambuf_iterator<char>() );
+    assert( content == std::string( "P5\n3 2\n255\n" ) + std::string( 6, '\4' ) );
+
+    const auto y4mPath = dir.getPath( "test.y4m" );
+    {
+        cu::FrameWriter writer( y4mPath, cu::getFrameFormat( y4mPath ), 4, 2 );
+        for ( int i = 0; i < 3; ++i )
+            writer.submit( writer.acquireBuffer() );
+        writer.finish();
+    }
+    std::ifstream y4m( y4mPath, std::ios::binary | std::ios::ate );
+    const std::string y4mHeader = "YUV4MPEG2 W4 H2 F60:1 Ip A1:1 Cmono\n";
+    assert( std::size_t( y4m.tellg() ) == y4mHeader.size() + 3*(6+8) );
+}
+
+
+/// Captures a frame of the cube scene like the window and replays it.
+static void testReplay()
+{
+    TestDirectory dir;
+    const auto capturePath = dir.getPath( "frame.r3dcmds" );
+    {
+        cu::CubeScene scene;
+        cu::CommandBuffer commands;
+        scene.record( commands, 64, 48 );
+        std::ofstream file( capturePath, std::ios::binary );
+        cu::writeCommandBuffers( file, { commands } );
+    }
+    const auto y4mPath = dir.getPath( "replay.y4m" );
+    const auto result = replayFrame( capturePath.c_str(), "3", "64", "48", y4mPath.c_str() );
+    assert( result == 0 );
+    std::ifstream y4m( y4mPath, std::ios::binary );
+    const std::string content( ( std::istreambuf_iterator<char>( y4m ) ),
+                               std::istreambuf_iterator<char>() );
+    const std::string header = "YUV4MPEG2 W64 H48 F60:1 Ip A1:1 Cmono\nFRAME\n";
+    assert( content.size() == header.size() + 64*48 );
+    assert( content[header.size() + 24*64+32] != 0 && content[header.size()] == 0 );
+    assert( replayFrame( y4mPath.c_str(), "1", "64", "48", y4mPath.c_str() ) == 1 );
+    (void)result;
+}
+
+
+static void testMeshIo()
+{
+    using cu::makeVec;
+
+    TestDirectory dir;
+    const auto writeFile = [&dir]( const std::string & name, const std::string & content )
+    {
+        const auto path = dir.getPath( name );
+        std::ofstream( path, std::ios::binary ) << content;
+        return path;
+    };
+    const auto isRejected = []( auto && f )
+    {
+        try { f(); } catch ( const std::runtime_error & ) { return true; }
+        return false;
+    };
+    cu::JobSystem jobSystem( 2 );
+
+    // Polygons become fans. Negative indices count back from the last
+    // vertex read so far.
+    auto objMesh = cu::importObj( writeFile( "quad.obj",
+        "# comment\nv 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nf 1 2 3 4\n"
+        "v 0 0 1.5e0\nf -1 -4/1/1 -3//2\n" ), jobSystem );
+    assert( objMesh.positions.size() == 5 );
+    assert( objMesh.positions[4] == makeVec( 0.f, 0.f, 1.5f ) );
+    assert( objMesh.indices == (std::vector<std::uint32_t>{ 0, 1, 2, 0, 2, 3, 4, 1, 2 }) );
+
+    // Large files are parsed in several chunks by parallel jobs. Relative
+    // indices refer to vertices of earlier chunks and errors in any chunk
+    // are reported as exceptions.
+    std::string bigObj;
+    for ( int i = 0; i < 300000; ++i )
+        bigObj += "v 0 0 0\n";
+    const auto bigMesh = cu::importObj(
+        writeFile( "big.obj", bigObj + "f -1 -2 -300000\n" ), jobSystem );
+    assert( bigMesh.indices == (std::vector<std::uint32_t>{ 299999, 299998, 0 }) );
+    assert( isRejected( [&]{ cu::importObj(
+        writeFile( "bad_index.obj", bigObj + "f 1 2 300001\n" ), jobSystem ); } ) );
+    assert( isRejected( [&]{ cu::importObj(
+        writeFile( "bad_vertex.obj", "v 0 0 0\n" + bigObj + "v 0 x 0\n" ), jobSystem ); } ) );
+
+    const std::string plyHeader =
+        "element vertex 4\nproperty float x\nproperty float y\nproperty float z\n"
+        "property uchar red\nelement face 1\nproperty list uchar uint vertex_indices\n"
+        "end_header\n";
+    const auto asciiMesh = cu::importPly( writeFile( "quad.ply",
+        "ply\nformat ascii 1.0\n" + plyHeader +
+        "0 0 0 9\n1 0 0 9\n1 1 0 9\n0 1 -2 9\n4 0 1 2 3\n" ), jobSystem );
+    assert( asciiMesh.positions.size() == 4 );
+    assert( asciiMesh.positions[3] == makeVec( 0.f, 1.f, -2.f ) );
+    assert( asciiMesh.indices == (std::vector<std::uint32_t>{ 0, 1, 2, 0, 2, 3 }) );
+
+    std::string binaryPly = "ply\nformat binary_little_endian 1.0\n" + plyHeader;
+    const auto append = [&binaryPly]( const auto & value )
+    {
+        binaryPly.append( reinterpret_cast<const char *>( &value ), sizeof(value) );
+    };
+    for ( const auto & position : asciiMesh.positions )
+    {
+        for ( const auto coord : position )
+            append( coord );
+        append( std::uint8_t(9) );
+    }
+    append( std::uint8_t(4) );
+    for ( const std::uint32_t index : { 0, 1, 2, 3 } )
+        append( index );
+    const auto binaryMesh = cu::importPly( writeFile( "binary.ply", binaryPly ), jobSystem );
+    assert( binaryMesh.positions == asciiMesh.positions );
+    assert( binaryMesh.indices == asciiMesh.indices );
+
+    // Large ASCII elements are parsed in parallel chunks of lines. Indices
+    // are integers, so fractional ones are rejected.
+    std::string bigPly = "ply\nformat ascii 1.0\nelement vertex 40000\n"
+        "property float x\nproperty float y\nproperty int z\n"
+        "element face 1\nproperty list uchar int vertex_indices\nend_header\n";
+    for ( int i = 0; i < 40000; ++i )
+        bigPly += std::to_string( i ) + " 0.5 -1\n";
+    const auto bigPlyMesh = cu::importPly(
+        writeFile( "big.ply", bigPly + "\n3 0 20000 39999\n" ), jobSystem );
+    assert( bigPlyMesh.positions.size() == 40000 );
+    assert( bigPlyMesh.positions[39999] == makeVec( 39999.f, 0.5f, -1.f ) );
+    assert( bigPlyMesh.indices == (std::vector<std::uint32_t>{ 0, 20000, 39999 }) );
+    assert( isRejected( [&]{ cu::importPly(
+        writeFile( "fraction.ply", bigPly + "3 0 1 2.5\n" ), jobSystem ); } ) );
+    assert( isRejected( [&]{ cu::importPly(
+        writeFile( "bad_index.ply", bigPly + "3 0 1 40000\n" ), jobSystem ); } ) );
+
+    // A corrupt element count fails before memory is allocated for it.
+    assert( isRejected( [&]{ cu::importPly( writeFile( "huge.ply",
+        "ply\nformat ascii 1.0\nelement vertex 100000000000000\nproperty float x\n"
+        "property float y\nproperty float z\nend_header\n0 0 0\n" ), jobSystem ); } ) );
+
+    // Mesh files map the arrays as they were written.
+    const auto meshPath = dir.getPath( "quad.mesh" );
+    cu::writeMeshFile( meshPath, objMesh );
+    {
+        const cu::MappedMesh mapped( meshPath );
+        mapped.validate();
+        const auto view = mapped.getView();
+        assert( view.boundingSphere.center == cu::MeshView<float>( objMesh ).boundingSphere.center );
+        assert( view.boundingSphere.radius == cu::MeshView<float>( objMesh ).boundingSphere.radius );
+        assert( std::equal( view.positions, view.positions + view.nVertices,
+                            objMesh.positions.begin(), objMesh.positions.end() ) );
+        assert( std::equal( view.indices, view.indices + view.nIndices,
+                            objMesh.indices.begin(), objMesh.indices.end() ) );
+    }
+
+    std::ifstream meshFile( meshPath, std::ios::binary );
+    const std::string meshBytes( ( std::istreambuf_iterator<char>( meshFile ) ),
+                                 std::istreambuf_iterator<char>() );
+    const auto truncatedPath = writeFile( "truncated.mesh",
+                                          meshBytes.substr( 0, meshBytes.size() - 4 ) );
+    assert( isRejected( [&]{ cu::MappedMesh( truncatedPath ).validate(); } ) );
+    auto shrunkBytes = meshBytes;
+    const float tooSmallRadius = 0.5f;
+    std::memcpy( &shrunkBytes[offsetof( cu::MeshFileHeader, boundingSphereRadius )],
+                 &tooSmallRadius, sizeof(tooSmallRadius) );
+    const auto shrunkPath = writeFile( "shrunk.mesh", shrunkBytes );
+    assert( isRejected( [&]{ cu::MappedMesh( shrunkPath ).validate(); } ) );
+
+    objMesh.indices.back() = 5;
+    const auto badIndexPath = dir.getPath( "bad_index.mesh" );
+    cu::writeMeshFile( badIndexPath, objMesh );
+    const cu::MappedMesh badIndexMesh( badIndexPath );
+    assert( isRejected( [&]{ badIndexMesh.validate(); } ) );
+}
+
+
+static void testQuaternion()
+{
+    using cu::Vec;
+    using cu::Mat;
+    using cu::makeVec;
+
+    const auto isClose = []( const auto & lhs, const auto & rhs )
+    {
+        for ( std::size_t row = 0; row < lhs.getNRows(); ++row )
+            for ( std::size_t col = 0; col < lhs.getNCols(); ++col )
+                if ( std::abs( lhs[row][col] - rhs[row][col] ) > 1e-5 )
+                    return false;
+        return true;
+    };
+
+    // Quaternions rotate like the matrices and compose the same way.
+    const auto v1 = makeVec( 0.3f, -1.2f, 0.5f );
+    const auto v2 = makeVec( -2.f, 0.1f, 0.7f );
+    const auto q1 = cu::makeRotationQuaternion( v1 );
+    const auto q2 = cu::makeRotationQuaternion( v2 );
+    assert( isClose( cu::makeRotationMat( q1 ), cu::makeRotationMat( v1 ) ) );
+    assert( isClose( cu::makeRotationMat( q1*q2 ),
+                     cu::makeRotationMat( v1 ) * cu::makeRotationMat( v2 ) ) );
+    const auto p = makeVec( 1.f, 2.f, 3.f );
+    assert( isClose( Mat<float,1,3>{ cu::rotate( q1, p ) },
+                     Mat<float,1,3>{ cu::makeRotationMat( v1 ) * p } ) );
+    assert( isClose( cu::makeRotationMat( q1 * cu::conjugate( q1 ) ),
+                     cu::makeIdentityMat<float,3>() ) );
+
+    // Slerp halves the angle, nlerp keeps the endpoints.
+    const auto axis = makeVec( 0.f, 0.f, 1.f );
+    const auto q0 = cu::makeAxisAngleQuaternion( axis, 0.f );
+    const auto q90 = cu::makeAxisAngleQuaternion( axis, 1.5707963f );
+    assert( isClose( cu::makeRotationMat( cu::slerp( q0, q90, 0.5f ) ),
+                     cu::makeRotationMat( cu::makeAxisAngleQuaternion( axis, 0.78539816f ) ) ) );
+    assert( isClose( cu::makeRotationMat( cu::nlerp( q0, q90, 1.f ) ),
+                     cu::makeRotationMat( q90 ) ) );
+
+    // TRS transforms compose like their matrices.
+    const cu::TrsTransform<float> a{ makeVec( 1.f, 2.f, 3.f ), q1, 2.f };
+    const cu::TrsTransform<float> b{ makeVec( -1.f, 0.f, 4.f ), q2, 0.5f };
+    const auto aMat = cu::makeExtendedMat( cu::makeAffineMat( a ) );
+    const auto bMat = cu::makeExtendedMat( cu::makeAffineMat( b ) );
+    assert( isClose( cu::makeExtendedMat( cu::makeAffineMat( a*b ) ), aMat*bMat ) );
+    const auto shifted = cu::transformPoint( a, p );
+    assert( isClose( Mat<float,1,3>{ shifted },
+                     Mat<float,1,3>{ cu::popBack( aMat * makeVec( 1.f, 2.f, 3.f, 1.f ) ) } ) );
+
+    // The scene transform is unchanged by using quaternions.
+    cu::CubeScene scene;
+    scene.angle = 2.5f;
+    assert( isClose( scene.getTransform(),
+        cu::makeTranslationMat( makeVec( 0.f, 0.f, -scene.distance ) ) *
+        cu::makeExtendedMat( cu::makeRotationMat( makeVec( scene.pitch, 0.f, 0.f ) ) *
+                             cu::makeRotationMat( scene.angle*makeVec( 0.f, 1.f, 0.f ) ) ) ) );
+
+    // Batches of sines and cosines match std::sin() and std::cos(), also for
+    // angles the polynomials do not handle.
+    std::vector<float> angles;
+    for ( int i = -20000; i <= 20000; ++i )
+        angles.push_back( i * 0.37f );
+    angles.push_back( 1e30f );
+    angles.push_back( std::numeric_limits<float>::infinity() );
+    std::vector<float> sines( angles.size() ), cosines( angles.size() );
+    cu::sinCos( angles.data(), sines.data(), cosines.data(), angles.size() );
+    for ( std::size_t i = 0; i + 1 < angles.size(); ++i )
+    {
+        assert( std::abs( sines[i] - std::sin( double( angles[i] ) ) ) < 2e-7 );
+        assert( std::abs( cosines[i] - std::cos( double( angles[i] ) ) ) < 2e-7 );
+    }
+    assert( std::isnan( sines.back() ) && std::isnan( cosines.back() ) );
+
+    std::vector<Vec<float,3>> axes( angles.size() - 2, normalize( v1 ) );
+    std::vector<cu::Quaternion<float>> quaternions( axes.size() );
+    cu::makeAxisAngleQuaternions( axes.data(), angles.data(), quaternions.data(), axes.size() );
+    assert( isClose( cu::makeRotationMat( quaternions[20001] ),
+                     cu::makeRotationMat( 0.37f * normalize( v1 ) ) ) );
+}
+
+
+static void testShading()
+{
+    using cu::Mat;
+    using cu::makeVec;
+
+    // A light straight behind the camera: ambient plus full diffuse
+    // reflection and the brightest highlight.
+    cu::Material material;
+    material.ambient = 0.25f;
+    material.diffuse = 0.5f;
+    material.specular = 0.25f;
+    const cu::Lighting lighting(
+        { cu::DirectionalLight{ makeVec( 0.f, 0.f, 3.f ) } }, {}, material );
+    cu::Vec3Array normals, positions;
+    normals.resize( 11 );
+    positions.resize( 11 );
+    for ( std::size_t i = 0; i < 11; ++i )
+    {
+        normals.set( i, makeVec( 0.f, 0.f, 1.f ) );
+        positions.set( i, makeVec( 0.f, 0.f, -5.f ) );
+    }
+    // facing away from the light and the camera
+    normals.set( 10, makeVec( 0.f, 0.f, -1.f ) );
+    std::vector<std::uint8_t> gray( 11, 100 ), shadedGray( 11 );
+    lighting.shadeGray( normals, positions, gray.data(), shadedGray.data(), 0, 11 );
+    for ( std::size_t i = 0; i < 10; ++i )
+        assert( shadedGray[i] == 100 );
+    assert( shadedGray[10] == 25 );
+    std::vector<std::uint32_t> argb( 11, 0x80FF4000u ), shadedArgb( 11 );
+    lighting.shadeArgb( normals, positions, argb.data(), shadedArgb.data(), 0, 11 );
+    assert( shadedArgb[3] == 0x80FF4000u );
+    assert( shadedArgb[10] == 0x80401000u );
+
+    // Point lights fade with the distance.
+    const cu::Lighting pointLighting(
+        {}, { cu::PointLight{ makeVec( 0.f, 0.f, -3.f ), makeVec( 1.f, 1.f, 1.f ), 0.25f } },
+        material );
+    pointLighting.shadeGray( normals, positions, gray.data(), shadedGray.data(), 0, 1 );
+    assert( std::abs( shadedGray[0] - 62.5 ) < 1 );
+
+    // Very bright lights saturate instead of overflowing.
+    const cu::Lighting brightLighting(
+        {}, { cu::PointLight{ makeVec( 0.f, 0.f, -3.f ), makeVec( 1e30f, 1e30f, 1e30f ), 0 } },
+        material );
+    brightLighting.shadeGray( normals, positions, gray.data(), shadedGray.data(), 0, 1 );
+    assert( shadedGray[0] == 255 );
+
+    // Shading faces in batches gives the same image as shading them one by
+    // one. Without point lights and highlights the positions of the faces do
+    // not matter.
+    const auto cube = cu::makeCubeMesh<float>();
+    cu::JobSystem jobSystem( 2 );
+    cu::CommandExecutor executor( jobSystem, { cube } );
+    cu::CommandBuffer commands;
+    cu::CubeScene scene;
+    scene.angle = 0.7f;
+    scene.record( commands, 64, 48 );
+    material.specular = 0;
+    material.isTwoSided = true;
+    const cu::Lighting diffuseLighting(
+        { cu::DirectionalLight{ makeVec( -1.f, -1.f, 2.f ) } }, {}, material );
+    Mat<unsigned char> batchImg( 48, 64 ), faceImg( 48, 64 );
+    Mat<float> zBuffer( 48, 64 );
+    executor.execute( &commands, 1, batchImg, zBuffer, diffuseLighting );
+    executor.execute( &commands, 1, faceImg, zBuffer,
+        [&]( const cu::Vec<float,3> & normal, std::uint8_t color )
+    {
+        cu::Vec3Array faceNormal, facePosition;
+        faceNormal.resize( 1 );
+        facePosition.resize( 1 );
+        faceNormal.set( 0, normal );
+        facePosition.set( 0, makeVec( 0.f, 0.f, -scene.distance ) );
+        std::uint8_t shaded;
+        diffuseLighting.shadeGray( faceNormal, facePosition, &color, &shaded, 0, 1 );
+        return shaded;
+    } );
+    assert( batchImg[24][32] != 0 );
+    std::size_t nDifferent = 0;
+    for ( std::size_t row = 0; row < 48; ++row )
+        for ( std::size_t col = 0; col < 64; ++col )
+            nDifferent += batchImg[row][col] != faceImg[row][col];
+    assert( nDifferent == 0 );
+}
+
+
+static void testDifferentialFuzz()
+{
+    std::ostringstream log;
+    const auto nFailures = cu::runDifferentialFuzz( 1, 200, log );
+    if ( nFailures != 0 )
+        throw std::runtime_error( log.str() );
+}
+
+
+/// Runs the tests which are slow or need the file system, shared memory or
+/// sockets. They are not run on every start of the application.
+static int runSelfTest()
+{
+    try
+    {
+        testDifferentialFuzz();
+        testFrameWriter();
+        testReplay();
+        testMeshIo();
+#ifdef __linux__
+        testRenderServer();
+#endif
+        std::cerr << "Self-test passed." << std::endl;
+        return 0;
+    }
+    catch ( std::exception & e )
+    {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+}
+
+
 int main(int argc, char *argv[])
 {
     testVec();
     testMat();
+    testTiledMat();
+    testTexture();
+    testJobSystem();
+    testDrawQueue();
+    testInstancing();
+    testCommandBuffer();
+    testMeshlets();
+    testDirtyRegion();
+    testResolutionScaling();
+    testMsaa();
+    testQuaternion();
+    testShading();
+
+    if ( argc == 2 && std::string( argv[1] ) == "--self-test" )
+        return runSelfTest();
+    if ( argc == 4 && std::string( argv[1] ) == "--convert-mesh" )
+        return convertMesh( argv[2], argv[3] );
+    if ( argc == 6 && std::string( argv[1] ) == "--render-frames" )
+        return renderFrames( argv[2], argv[3], argv[4], argv[5] );
+    if ( argc == 7 && std::string( argv[1] ) == "--replay" )
+        return replayFrame( argv[2], argv[3], argv[4], argv[5], argv[6] );
+    if ( argc == 4 && std::string( argv[1] ) == "--fuzz" )
+        return runFuzz( argv[2], argv[3] );
+#ifdef __linux__
+    if ( argc == 6 && std::string( argv[1] ) == "--render-server" )
+        return runRenderServer( argv[2], argv[3], argv[4], argv[5] );
+    if ( argc == 5 && std::string( argv[1] ) == "--latency-client" )
+        return runLatencyClient( argv[2], argv[3], argv[4] );
+#endif
 
     QApplication a(argc, argv);
     MainWindow w;
+    for ( int i = 1; i + 1 < argc; i += 2 )
+    {
+        const std::string option = argv[i];
+        try
+        {
+            if ( option == "--frame-budget-ms" )
+                w.setFrameTimeBudget( std::stod( argv[i+1] ) / 1000 );
+            else if ( option == "--msaa" )
+                w.setMsaaSamples( std::stoi( argv[i+1] ) );
+            else if ( option == "--capture" )
+                w.captureFrame( argv[i+1] );
+        }
+        catch ( std::exception & e )
+        {
+            std::cerr << "Invalid value '" << argv[i+1] << "' for " << option
+                      << ": " << e.what() << std::endl;
+            return 1;
+        }
+    }
     w.show();
 
     return a.exec();
@@ -1,109 +1,282 @@
 #include "main_window.hpp"
 #include "ui_main_window.h"
 
+#include "command_buffer.hpp"
+#include "cube_scene.hpp"
+#include "dirty_region.hpp"
 #include "drawing.hpp"
+#include "framebuffer.hpp"
+#include "instancing.hpp"
+#include "job_system.hpp"
+#include "mesh.hpp"
+#include "msaa.hpp"
+#include "resolution_scaling.hpp"
 #include "vec.hpp"
 #include "mat.hpp"
 #include "trafo_mats.hpp"
 
+#include <QElapsedTimer>
 #include <QPainter>
+#include <QPaintEvent>
+#include <QResizeEvent>
 #include <QTimer>
 
 #include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
 
 struct MainWindow::Impl
 {
   Ui::MainWindow ui;
-  float angle{};
+  cu::CubeScene scene;
+  cu::JobSystem jobSystem;
+  cu::Mesh<float> cube = cu::makeCubeMesh<float>();
+  cu::Box<float> cubeBox = cu::makeBoundingBox( cu::MeshView<float>( cube ) );
+  cu::CommandExecutor executor{ jobSystem, { cube } };
+
+  // The buffers keep their contents between frames. Only the parts
+  // marked dirty by the tracker are redrawn.
+  cu::TiledMat<unsigned char> colorBuffer;
+  cu::TiledMat<float> zBuffer;
+  QImage frame;
+  cu::DirtyTracker dirtyTracker;
+  cu::CommandBuffer commands;
+  // Receives the commands of the next frame, if it is open.
+  std::ofstream captureFile;
+
+  // With dynamic resolution the buffers above are smaller than the frame
+  // and get upscaled.
+  std::optional<cu::ResolutionController> resolutionController;
+  double scale = 1;
+  cu::Mat<unsigned char> lowResImg;
+  cu::Mat<unsigned char> upscaledImg;
+  cu::BilinearUpscaler upscaler;
+  // The first frame after the buffers have been reallocated redraws
+  // everything, so its time is not fed to the controller.
+  bool skipFrameTime = false;
+
+  // With multisampling the scene is drawn into these and resolved into
+  // colorBuffer.
+  std::size_t msaaSamples = 0;
+  cu::MsaaMat<unsigned char> msaaColor;
+  cu::MsaaMat<float> msaaDepth;
+
+  void resize( int width, int height );
+  void resizeBuffers();
+  void updateScene();
+  QRect renderDirtyRegion();
+  void adaptResolution( double frameTime );
+
+  template <typename Image>
+  void copyToFrame( const Image & img, const cu::PixelRect & rect );
 };
 
+
+void MainWindow::Impl::resize( int width, int height )
+{
+  frame = QImage( width, height, QImage::Format_RGB32 );
+  resizeBuffers();
+}
+
+
+/// Reallocates the render buffers for the size of the frame and the current
+/// scale and marks everything dirty. The frame keeps showing the previous
+/// image until it has been redrawn.
+void MainWindow::Impl::resizeBuffers()
+{
+  const auto width = frame.width();
+  const auto height = frame.height();
+  const auto nRows = cu::getScaledSize( height, scale );
+  const auto nCols = cu::getScaledSize( width, scale );
+  colorBuffer = cu::TiledMat<unsigned char>( nRows, nCols );
+  zBuffer = cu::TiledMat<float>( nRows, nCols );
+  dirtyTracker.resize( nRows, nCols );
+  skipFrameTime = true;
+  if ( msaaSamples != 0 )
+  {
+    msaaColor = cu::MsaaMat<unsigned char>( nRows, nCols, msaaSamples );
+    msaaDepth = cu::MsaaMat<float>( nRows, nCols, msaaSamples );
+  }
+  if ( scale != 1 )
+  {
+    lowResImg = cu::Mat<unsigned char>( nRows, nCols );
+    upscaledImg = cu::Mat<unsigned char>( height, width );
+  }
+  else
+  {
+    lowResImg = {};
+    upscaledImg = {};
+  }
+}
+
+
+/// Changes the resolution for the next frame, if the controller asks for it.
+void MainWindow::Impl::adaptResolution( double frameTime )
+{
+  if ( !resolutionController || std::exchange( skipFrameTime, false ) )
+    return;
+  const auto newScale = resolutionController->update( frameTime );
+  if ( newScale == scale )
+    return;
+  scale = newScale;
+  resizeBuffers();
+}
+
+
+template <typename Image>
+void MainWindow::Impl::copyToFrame( const Image & img, const cu::PixelRect & rect )
+{
+  for ( auto row = rect.top; row < rect.bottom; ++row )
+  {
+    const auto src = img[row];
+    const auto dst = reinterpret_cast<QRgb*>( frame.scanLine( row ) );
+    for ( auto col = rect.left; col < rect.right; ++col )
+      dst[col] = src[col] * 0x10101u + 0xFF000000u;
+  }
+}
+
+
+/// Records the commands for the current frame and marks the screen areas
+/// dirty, which have changed since the previous frame.
+void MainWindow::Impl::updateScene()
+{
+  const auto width = dirtyTracker.getNCols();
+  const auto height = dirtyTracker.getNRows();
+  commands = {};
+  scene.record( commands, width, height );
+  if ( captureFile.is_open() )
+  {
+    // A failed capture must not stop the rendering.
+    try
+    {
+      cu::writeCommandBuffers( captureFile, { commands } );
+    }
+    catch ( std::exception & e )
+    {
+      std::cerr << e.what() << std::endl;
+    }
+    captureFile.close();
+  }
+
+  // The cube rotates, so it changes every frame.
+  dirtyTracker.setObjectBounds(
+        0, cu::getScreenBounds( cubeBox, scene.getTransform(),
+                                cu::CubeScene::getProjection( width, height ) ),
+        true );
+}
+
+
+/// Clears and redraws the dirty region and copies it into the frame,
+/// upscaling it if necessary. Returns the bounding rectangle of the updated
+/// pixels of the frame.
+///
+/// The commands are executed once, clipped to the bounds of the dirty
+/// rectangles, instead of once per rectangle, which would set up every
+/// triangle for every rectangle. Clean pixels inside the bounds are redrawn
+/// with the same result.
+QRect MainWindow::Impl::renderDirtyRegion()
+{
+  const auto shadeFace = cu::CubeScene::getLighting();
+  auto bounds = dirtyTracker.getDirtyBounds();
+  if ( !bounds.isEmpty() )
+  {
+    // The clear command only clears the scissor rectangle.
+    if ( msaaSamples != 0 )
+    {
+      cu::ScissoredImage<cu::MsaaMat<unsigned char>> color( msaaColor, bounds );
+      cu::ScissoredImage<cu::MsaaMat<float>> depth( msaaDepth, bounds );
+      executor.execute( &commands, 1, color, depth, shadeFace );
+      cu::resolve( msaaColor, colorBuffer, bounds, jobSystem );
+    }
+    else
+    {
+      cu::ScissoredImage<cu::TiledMat<unsigned char>> color( colorBuffer, bounds );
+      cu::ScissoredImage<cu::TiledMat<float>> depth( zBuffer, bounds );
+      executor.execute( &commands, 1, color, depth, shadeFace );
+    }
+    if ( scale == 1 )
+      copyToFrame( colorBuffer, bounds );
+    else
+      for ( auto row = bounds.top; row < bounds.bottom; ++row )
+        cu::detail::resolveRow( colorBuffer,
+                                lowResImg.data() + row*lowResImg.getNCols(), row );
+  }
+  dirtyTracker.markClean();
+  if ( scale != 1 )
+  {
+    bounds = cu::getUpscaledRect( bounds,
+        lowResImg.getNRows(), lowResImg.getNCols(),
+        upscaledImg.getNRows(), upscaledImg.getNCols() );
+    upscaler.upscale( lowResImg, upscaledImg, bounds, jobSystem );
+    copyToFrame( upscaledImg, bounds );
+  }
+  return QRect( bounds.left, bounds.top,
+                bounds.right - bounds.left, bounds.bottom - bounds.top );
+}
+
+
 MainWindow::MainWindow(QWidget *parent)
   : QWidget(parent)
   , m( std::make_unique<Impl>() )
 {
   m->ui.setupUi(this);
+  m->resize( width(), height() );
   auto timer = new QTimer(this);
-  connect( timer, &QTimer::timeout, this, [this](){ m->angle += 0.01; update(); } );
+  connect( timer, &QTimer::timeout, this, [this]()
+  {
+    m->scene.angle += 0.01;
+    m->updateScene();
+    QElapsedTimer frameTimer;
+    frameTimer.start();
+    const auto dirtyRect = m->renderDirtyRegion();
+    m->adaptResolution( frameTimer.nsecsElapsed() * 1e-9 );
+    if ( !dirtyRect.isEmpty() )
+      update( dirtyRect );
+  } );
   timer->start(20);
 }
 
-void MainWindow::paintEvent( QPaintEvent * )
+void MainWindow::setFrameTimeBudget( double seconds )
 {
-  std::array<cu::Vec<float,4>,8> points =
-  {{
-    { 1, 1, 1, 1},
-    { 1, 1,-1, 1},
-    { 1,-1, 1, 1},
-    { 1,-1,-1, 1},
-    {-1, 1, 1, 1},
-    {-1, 1,-1, 1},
-    {-1,-1, 1, 1},
-    {-1,-1,-1, 1}
-  }};
-  const auto shiftMat =
-          cu::makeTranslationMat( cu::makeVec(0.f,0.f,-6.f) );
-  const auto rotMat =
-          cu::makeExtendedMat(
-          cu::makeRotationMat( cu::makeVec( -0.3f,0.f,0.f ) ) *
-          cu::makeRotationMat( m->angle*cu::makeVec(0.f,1.f,0.f) ) );
-  const auto width = this->width();
-  const auto height = this->height();
-  const auto scaleFactor = std::min( width, height );
-  const auto systemMatrix =
-          shiftMat *
-          rotMat;
-  std::array<cu::Vec<float,2>,8> transformedPoints2d;
-  std::array<cu::Vec<float,3>,8> transformedPoints3d;
-  for ( std::size_t i = 0; i!= points.size(); ++i )
-  {
-    transformedPoints3d[i] = cu::popBack( systemMatrix * points[i] );
-    const auto & vec = transformedPoints3d[i];
-    transformedPoints2d[i] = { 1.5f*scaleFactor * vec[0] / -vec[2] + 0.5f*width,
-                               1.5f*scaleFactor * vec[1] / -vec[2] + 0.5f*height };
-  }
+  if ( seconds > 0 )
+    m->resolutionController.emplace( seconds );
+  else
+    m->resolutionController.reset();
+  m->scale = 1;
+  m->resizeBuffers();
+}
 
-  cu::Mat<unsigned char> img( this->height(), this->width() );
-  const auto imgSize = img.getNRows()*img.getNCols();
-  std::fill_n( img.data(), imgSize, 0 );
-  const auto maxZ = -0.1f;
-  const auto minZ = -100.f;
-  cu::Mat<float> zBuffer( img.getNRows(), img.getNCols() );
-  std::fill_n( zBuffer.data(), imgSize, minZ );
-  for ( std::size_t i = 0; i!= points.size(); ++i )
-  {
-    for ( auto bit1 : { 1, 2, 4 } )
-      for ( auto bit2 : { 1, 2, 4 } )
-      {
-        if ( bit1 >= bit2 )
-            continue;
-        if ( i & ( bit1 | bit2 ) )
-            continue;
-        const auto & P2d = transformedPoints2d[ i               ];
-        const auto & Q2d = transformedPoints2d[ i | bit1        ];
-        const auto & R2d = transformedPoints2d[ i        | bit2 ];
-        const auto & S2d = transformedPoints2d[ i | bit1 | bit2 ];
-        const auto & P3d = transformedPoints3d[ i               ];
-        const auto & Q3d = transformedPoints3d[ i | bit1        ];
-        const auto & R3d = transformedPoints3d[ i        | bit2 ];
-        const auto z = (Q3d + R3d)[2];
-        const auto normalVec = cu::normalVector( P3d, Q3d, R3d );
-        const auto lightVec = cu::normalize( cu::makeVec( 1.f, 1.f, -2.f ) );
-        const auto absCos = std::abs( normalVec * lightVec );
-        const unsigned char color = (0.8*absCos*absCos+0.2) * 0xFF;
-        cu::drawTriangle( img, P2d, R2d, S2d, color, zBuffer, maxZ, z );
-        cu::drawTriangle( img, P2d, Q2d, S2d, color, zBuffer, maxZ, z );
-      }
-  }
+void MainWindow::setMsaaSamples( int nSamples )
+{
+  if ( nSamples != 0 && !cu::MsaaMat<unsigned char>::isValidNSamples( std::size_t(nSamples) ) )
+    throw std::runtime_error( "The number of MSAA samples must be 0, 4 or 8, not " +
+                              std::to_string( nSamples ) + "." );
+  m->msaaSamples = std::size_t(nSamples);
+  m->resizeBuffers();
+}
 
+void MainWindow::captureFrame( const std::string & path )
+{
+  m->captureFile = std::ofstream( path, std::ios::binary | std::ios::trunc );
+  if ( !m->captureFile )
+    throw std::runtime_error( "Could not create '" + path + "'." );
+}
+
+void MainWindow::resizeEvent( QResizeEvent * )
+{
+  m->resize( width(), height() );
+  m->updateScene();
+  m->renderDirtyRegion();
+}
+
+void MainWindow::paintEvent( QPaintEvent * event )
+{
   QPainter painter(this);
-  painter.fillRect( this->rect(), Qt::black );
-  painter.setPen( Qt::white );
-  QImage qImg( img.getNCols(), img.getNRows(), QImage::Format_RGB888 );
-  qImg.fill( Qt::black );
-  for ( std::size_t row = 0; row < img.getNRows(); ++row )
-    for ( std::size_t col = 0; col < img.getNCols(); ++col )
-      qImg.setPixel( col, row, img[row][col] * 0x10101 + 0xFF000000 );
-  painter.drawImage( this->rect(), qImg );
+  painter.drawImage( event->rect(), m->frame, event->rect() );
 }
 
 
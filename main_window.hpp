@@ -2,6 +2,7 @@
 
 #include <QWidget>
 #include <memory>
+#include <string>
 
 class MainWindow final : public QWidget
 {
@@ -11,7 +12,22 @@ public:
   explicit MainWindow(QWidget *parent = nullptr);
   virtual ~MainWindow() override;
 
+  /// Enables dynamic resolution scaling, which lowers the render resolution
+  /// until frames take at most the given number of seconds to render. The
+  /// frames are upscaled to the window size. Pass 0 to disable it.
+  void setFrameTimeBudget( double seconds );
+
+  /// Enables multisample anti-aliasing with 4 or 8 samples per pixel.
+  /// Pass 0 to disable it. Throws std::runtime_error for other values.
+  void setMsaaSamples( int nSamples );
+
+  /// Writes the command buffer of the next frame into a command file, which
+  /// can be replayed offline with --replay. Throws std::runtime_error, if
+  /// the file cannot be created.
+  void captureFrame( const std::string & path );
+
   virtual void paintEvent( QPaintEvent * event );
+  virtual void resizeEvent( QResizeEvent * event );
 
 private:
   struct Impl;
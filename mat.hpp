@@ -1,6 +1,8 @@
 #pragma once
 
 #include <cassert>
+#include <memory>
+#include <stdexcept>
 #include <utility>
 #include <vec.hpp>
 
@@ -0,0 +1,177 @@
+#pragma once
+
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+namespace cu
+{
+
+/// An indexed triangle mesh. Every three consecutive indices form
+/// a triangle.
+template <typename Coord>
+struct Mesh
+{
+  std::vector<Vec<Coord,3>> positions;
+  std::vector<std::uint32_t> indices;
+
+  std::size_t getNTriangles() const { return indices.size() / 3; }
+};
+
+
+template <typename Coord>
+struct Sphere
+{
+  Vec<Coord,3> center;
+  Coord radius{};
+};
+
+
+/// An axis aligned box.
+template <typename Coord>
+struct Box
+{
+  Vec<Coord,3> min;
+  Vec<Coord,3> max;
+};
+
+
+template <typename Coord>
+Box<Coord> makeBoundingBox( const Vec<Coord,3> * points, std::size_t nPoints )
+{
+  if ( nPoints == 0 )
+    return {};
+  Box<Coord> result{ points[0], points[0] };
+  for ( std::size_t i = 1; i < nPoints; ++i )
+    for ( std::size_t dim = 0; dim < 3; ++dim )
+    {
+      result.min[dim] = std::min( result.min[dim], points[i][dim] );
+      result.max[dim] = std::max( result.max[dim], points[i][dim] );
+    }
+  return result;
+}
+
+
+/// Returns a sphere containing all points. It is centered in the bounding box
+/// of the points, which is not optimal, but cheap and good enough for culling.
+template <typename Coord>
+Sphere<Coord> makeBoundingSphere( const Vec<Coord,3> * points, std::size_t nPoints )
+{
+  if ( nPoints == 0 )
+    return {};
+  const auto box = makeBoundingBox( points, nPoints );
+  Sphere<Coord> result;
+  result.center = Coord(0.5) * ( box.min + box.max );
+  Coord sqrRadius = 0;
+  for ( std::size_t i = 0; i < nPoints; ++i )
+    sqrRadius = std::max( sqrRadius, sqrNorm( points[i] - result.center ) );
+  result.radius = std::sqrt( sqrRadius );
+  return result;
+}
+
+
+/// A mesh whose vertex and index arrays are owned by someone else, e.g. a
+/// Mesh or a memory mapped mesh file. This is what the renderers consume.
+///
+/// The bounding sphere is computed once when the view is created, or taken
+/// from a mesh file, so renderers need not touch all vertices for culling
+/// on every draw. Views must be recreated when the vertices change.
+template <typename Coord>
+struct MeshView
+{
+  const Vec<Coord,3> * positions = nullptr;
+  std::size_t nVertices = 0;
+  const std::uint32_t * indices = nullptr;
+  std::size_t nIndices = 0;
+  Sphere<Coord> boundingSphere;
+
+  MeshView() = default;
+
+  MeshView( const Vec<Coord,3> * positions_,
+            std::size_t nVertices_,
+            const std::uint32_t * indices_,
+            std::size_t nIndices_ )
+    : MeshView( positions_, nVertices_, indices_, nIndices_,
+                makeBoundingSphere( positions_, nVertices_ ) )
+  {}
+
+  MeshView( const Vec<Coord,3> * positions_,
+            std::size_t nVertices_,
+            const std::uint32_t * indices_,
+            std::size_t nIndices_,
+            const Sphere<Coord> & boundingSphere_ )
+    : positions(positions_)
+    , nVertices(nVertices_)
+    , indices(indices_)
+    , nIndices(nIndices_)
+    , boundingSphere(boundingSphere_)
+  {}
+
+  MeshView( const Mesh<Coord> & mesh )
+    : MeshView( mesh.positions.data(), mesh.positions.size(),
+                mesh.indices.data(), mesh.indices.size() )
+  {}
+
+  std::size_t getNTriangles() const { return nIndices / 3; }
+};
+
+
+template <typename Coord>
+Box<Coord> makeBoundingBox( const MeshView<Coord> & mesh )
+{
+  return makeBoundingBox( mesh.positions, mesh.nVertices );
+}
+
+
+template <typename Coord>
+Sphere<Coord> makeBoundingSphere( const MeshView<Coord> & mesh )
+{
+  return mesh.boundingSphere;
+}
+
+
+template <typename Coord>
+Sphere<Coord> makeBoundingSphere( const Mesh<Coord> & mesh )
+{
+  return makeBoundingSphere( MeshView<Coord>( mesh ) );
+}
+
+
+/// Returns the cube [-1,1]^3. The vertex with index i has the coordinate -1
+/// in dimension d, if bit 2-d of i is set, and 1 otherwise. The triangles are
+/// oriented, so that normalVector() points outwards.
+template <typename Coord>
+Mesh<Coord> makeCubeMesh()
+{
+  Mesh<Coord> mesh;
+  for ( std::uint32_t i = 0; i != 8; ++i )
+    mesh.positions.push_back( { i & 4 ? Coord(-1) : Coord(1),
+                                i & 2 ? Coord(-1) : Coord(1),
+                                i & 1 ? Coord(-1) : Coord(1) } );
+  for ( std::uint32_t i = 0; i != 8; ++i )
+    for ( std::uint32_t bit1 : { 1, 2, 4 } )
+      for ( std::uint32_t bit2 : { 1, 2, 4 } )
+      {
+        if ( bit1 >= bit2 )
+          continue;
+        if ( i & ( bit1 | bit2 ) )
+          continue;
+        mesh.indices.insert( mesh.indices.end(),
+            { i, i | bit2, i | bit1 | bit2,
+              i, i | bit1, i | bit1 | bit2 } );
+      }
+  for ( std::size_t t = 0; t < mesh.indices.size(); t += 3 )
+  {
+    const auto & P = mesh.positions[mesh.indices[t  ]];
+    const auto & Q = mesh.positions[mesh.indices[t+1]];
+    const auto & R = mesh.positions[mesh.indices[t+2]];
+    if ( normalVector( P, Q, R ) * ( P + Q + R ) < 0 )
+      std::swap( mesh.indices[t+1], mesh.indices[t+2] );
+  }
+  return mesh;
+}
+
+} // namespace cu
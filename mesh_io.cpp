@@ -0,0 +1,945 @@
+#include "mesh_io.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace cu
+{
+
+namespace
+{
+
+  static_assert( sizeof(Vec<float,3>) == 3*sizeof(float),
+                 "Vec<float,3> must be layout compatible with float[3]." );
+
+  constexpr char meshFileMagic[8] = { 'R','3','D','M','E','S','H','\0' };
+  constexpr std::uint32_t meshFileVersion = 1;
+  constexpr std::uint32_t byteOrderMark = 0x01020304;
+
+
+  std::runtime_error makeSystemError( const std::string & what,
+                                      const std::string & path )
+  {
+    return std::runtime_error( what + " '" + path + "': " + std::strerror(errno) );
+  }
+
+
+  std::uint64_t alignUp( std::uint64_t offset )
+  {
+    return (offset + meshFileAlignment - 1) / meshFileAlignment * meshFileAlignment;
+  }
+
+
+  // text parsing
+
+  bool isBlank( char c )
+  {
+    return c == ' ' || c == '\t' || c == '\r';
+  }
+
+
+  void skipBlanks( const char *& p, const char * end )
+  {
+    while ( p != end && isBlank(*p) )
+      ++p;
+  }
+
+
+  void skipToken( const char *& p, const char * end )
+  {
+    while ( p != end && !isBlank(*p) && *p != '\n' )
+      ++p;
+  }
+
+
+  const char * findLineEnd( const char * p, const char * end )
+  {
+    const auto lineEnd = static_cast<const char*>( std::memchr( p, '\n', end - p ) );
+    return lineEnd ? lineEnd : end;
+  }
+
+
+  const char * findNextLine( const char * p, const char * end )
+  {
+    const auto lineEnd = findLineEnd( p, end );
+    return lineEnd == end ? end : lineEnd + 1;
+  }
+
+
+  double getPowerOf10( int exponent )
+  {
+    static const double table[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+      1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    if ( exponent >= 0 && exponent <= 22 )
+      return table[exponent];
+    if ( exponent < 0 && exponent >= -22 )
+      return 1 / table[-exponent];
+    return std::pow( 10., exponent );
+  }
+
+
+  /// Parses a decimal number without going through the locale machinery of
+  /// strtod(). The result is not always correctly rounded in the last bit,
+  /// which is irrelevant for vertex data.
+  bool parseNumber( const char *& p, const char * end, double & result )
+  {
+    skipBlanks( p, end );
+    const auto start = p;
+    bool negative = false;
+    if ( p != end && ( *p == '-' || *p == '+' ) )
+      negative = *p++ == '-';
+    std::uint64_t mantissa = 0;
+    int nSignificantDigits = 0;
+    int exponent = 0;
+    bool hasDigits = false;
+    // The value is mantissa * 10^exponent. Digits beyond the precision of
+    // the mantissa only shift the exponent, if they are before the point.
+    const auto addDigit = [&]( char c, bool isFraction )
+    {
+      hasDigits = true;
+      const bool isSignificant = mantissa != 0 || c != '0';
+      if ( isSignificant && nSignificantDigits == 19 )
+      {
+        exponent += isFraction ? 0 : 1;
+        return;
+      }
+      if ( isSignificant )
+      {
+        mantissa = mantissa * 10 + std::uint64_t(c - '0');
+        ++nSignificantDigits;
+      }
+      exponent -= isFraction ? 1 : 0;
+    };
+    for ( ; p != end && std::isdigit( static_cast<unsigned char>(*p) ); ++p )
+      addDigit( *p, false );
+    if ( p != end && *p == '.' )
+      for ( ++p; p != end && std::isdigit( static_cast<unsigned char>(*p) ); ++p )
+        addDigit( *p, true );
+    if ( !hasDigits )
+    {
+      p = start;
+      return false;
+    }
+    if ( p != end && ( *p == 'e' || *p == 'E' ) )
+    {
+      ++p;
+      bool negativeExponent = false;
+      if ( p != end && ( *p == '-' || *p == '+' ) )
+        negativeExponent = *p++ == '-';
+      int e = 0;
+      for ( ; p != end && std::isdigit( static_cast<unsigned char>(*p) ); ++p )
+        e = std::min( e * 10 + (*p - '0'), 100000 );
+      exponent += negativeExponent ? -e : e;
+    }
+    result = double(mantissa) * getPowerOf10( exponent );
+    if ( negative )
+      result = -result;
+    return true;
+  }
+
+
+  bool parseInteger( const char *& p, const char * end, std::int64_t & result )
+  {
+    skipBlanks( p, end );
+    const auto start = p;
+    bool negative = false;
+    if ( p != end && ( *p == '-' || *p == '+' ) )
+      negative = *p++ == '-';
+    std::int64_t value = 0;
+    const auto digitsBegin = p;
+    for ( ; p != end && std::isdigit( static_cast<unsigned char>(*p) ); ++p )
+      value = std::min<std::int64_t>( value * 10 + (*p - '0'),
+                                      std::numeric_limits<std::uint32_t>::max() );
+    if ( p == digitsBegin )
+    {
+      p = start;
+      return false;
+    }
+    result = negative ? -value : value;
+    return true;
+  }
+
+
+  std::uint32_t checkIndex( std::int64_t index, std::size_t nVertices )
+  {
+    if ( index < 0 || std::uint64_t(index) >= nVertices )
+      throw std::runtime_error( "Vertex index out of range." );
+    return std::uint32_t(index);
+  }
+
+
+  // OBJ
+
+  struct ObjChunk
+  {
+    std::vector<Vec<float,3>> positions;
+    /// Absolute zero-based indices, except for those at relativeIndexPositions
+    /// which are relative to the first vertex of the chunk.
+    std::vector<std::int64_t> indices;
+    std::vector<std::size_t> relativeIndexPositions;
+  };
+
+
+  void parseObjChunk( const char * p, const char * end, ObjChunk & chunk )
+  {
+    std::vector<std::int64_t> polygon;
+    std::vector<bool> isRelative;
+    for ( ; p != end; p = findNextLine( p, end ) )
+    {
+      skipBlanks( p, end );
+      if ( end - p < 2 || !isBlank( p[1] ) )
+        continue;
+      if ( p[0] == 'v' )
+      {
+        ++p;
+        Vec<float,3> position;
+        for ( auto & coord : position )
+        {
+          double value;
+          if ( !parseNumber( p, end, value ) )
+            throw std::runtime_error( "Invalid vertex in OBJ file." );
+          coord = float(value);
+        }
+        chunk.positions.push_back( position );
+      }
+      else if ( p[0] == 'f' )
+      {
+        ++p;
+        polygon.clear();
+        isRelative.clear();
+        std::int64_t index;
+        while ( parseInteger( p, end, index ) )
+        {
+          if ( index == 0 )
+            throw std::runtime_error( "Invalid vertex index 0 in OBJ file." );
+          isRelative.push_back( index < 0 );
+          polygon.push_back( index < 0
+                             ? std::int64_t(chunk.positions.size()) + index
+                             : index - 1 );
+          skipToken( p, end ); // texture coordinate and normal indices
+        }
+        for ( std::size_t k = 1; k + 1 < polygon.size(); ++k )
+          for ( auto corner : { std::size_t(0), k, k+1 } )
+          {
+            if ( isRelative[corner] )
+              chunk.relativeIndexPositions.push_back( chunk.indices.size() );
+            chunk.indices.push_back( polygon[corner] );
+          }
+      }
+    }
+  }
+
+
+  // PLY
+
+  enum class PlyType
+  {
+    Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64
+  };
+
+
+  struct PlyProperty
+  {
+    std::string name;
+    PlyType type;
+    bool isList;
+    PlyType countType;
+  };
+
+
+  struct PlyElement
+  {
+    std::string name;
+    std::uint64_t count;
+    std::vector<PlyProperty> properties;
+  };
+
+
+  PlyType parsePlyType( const std::string & name )
+  {
+    if ( name == "char"   || name == "int8"    ) return PlyType::Int8;
+    if ( name == "uchar"  || name == "uint8"   ) return PlyType::UInt8;
+    if ( name == "short"  || name == "int16"   ) return PlyType::Int16;
+    if ( name == "ushort" || name == "uint16"  ) return PlyType::UInt16;
+    if ( name == "int"    || name == "int32"   ) return PlyType::Int32;
+    if ( name == "uint"   || name == "uint32"  ) return PlyType::UInt32;
+    if ( name == "float"  || name == "float32" ) return PlyType::Float32;
+    if ( name == "double" || name == "float64" ) return PlyType::Float64;
+    throw std::runtime_error( "Unknown PLY property type '" + name + "'." );
+  }
+
+
+  std::size_t getSize( PlyType type )
+  {
+    switch ( type )
+    {
+    case PlyType::Int8:
+    case PlyType::UInt8:   return 1;
+    case PlyType::Int16:
+    case PlyType::UInt16:  return 2;
+    case PlyType::Int32:
+    case PlyType::UInt32:
+    case PlyType::Float32: return 4;
+    case PlyType::Float64: return 8;
+    }
+    return 0;
+  }
+
+
+  template <typename T>
+  double readBinary( const char * p )
+  {
+    T value;
+    std::memcpy( &value, p, sizeof(T) );
+    return double(value);
+  }
+
+
+  /// Reads a value of the type, which must lie within the file.
+  double readBinary( PlyType type, const char * p )
+  {
+    switch ( type )
+    {
+    case PlyType::Int8:    return readBinary<std::int8_t  >( p );
+    case PlyType::UInt8:   return readBinary<std::uint8_t >( p );
+    case PlyType::Int16:   return readBinary<std::int16_t >( p );
+    case PlyType::UInt16:  return readBinary<std::uint16_t>( p );
+    case PlyType::Int32:   return readBinary<std::int32_t >( p );
+    case PlyType::UInt32:  return readBinary<std::uint32_t>( p );
+    case PlyType::Float32: return readBinary<float        >( p );
+    case PlyType::Float64: return readBinary<double       >( p );
+    }
+    return 0;
+  }
+
+
+  class PlyReader
+  {
+  public:
+    PlyReader( const char * p, const char * end )
+      : p_(p)
+      , end_(end)
+    {}
+
+    const char * getPos() const { return p_; }
+    void setPos( const char * p ) { p_ = p; }
+
+    double read( PlyType type )
+    {
+      const auto size = getSize( type );
+      if ( std::size_t(end_ - p_) < size )
+        throw std::runtime_error( "Unexpected end of PLY file." );
+      const auto p = p_;
+      p_ += size;
+      return readBinary( type, p );
+    }
+
+  private:
+    const char * p_;
+    const char * end_;
+  };
+
+
+  std::vector<PlyElement> parsePlyHeader( const char *& p,
+                                          const char * end,
+                                          bool & isBinary )
+  {
+    std::vector<PlyElement> elements;
+    bool hasFormat = false;
+    for ( bool first = true; ; first = false )
+    {
+      if ( p == end )
+        throw std::runtime_error( "Missing end_header in PLY file." );
+      const auto lineEnd = findLineEnd( p, end );
+      std::vector<std::string> words;
+      for ( auto q = p; ; )
+      {
+        skipBlanks( q, lineEnd );
+        if ( q == lineEnd )
+          break;
+        const auto wordBegin = q;
+        skipToken( q, lineEnd );
+        words.emplace_back( wordBegin, q );
+      }
+      p = findNextLine( p, end );
+      if ( first )
+      {
+        if ( words.size() != 1 || words[0] != "ply" )
+          throw std::runtime_error( "Not a PLY file." );
+        continue;
+      }
+      if ( words.empty() || words[0] == "comment" || words[0] == "obj_info" )
+        continue;
+      if ( words[0] == "end_header" )
+        break;
+      if ( words[0] == "format" && words.size() >= 2 )
+      {
+        if ( words[1] == "ascii" )
+          isBinary = false;
+        else if ( words[1] == "binary_little_endian" )
+          isBinary = true;
+        else
+          throw std::runtime_error( "Unsupported PLY format '" + words[1] + "'." );
+        hasFormat = true;
+      }
+      else if ( words[0] == "element" && words.size() == 3 )
+        elements.push_back( { words[1], std::stoull( words[2] ), {} } );
+      else if ( words[0] == "property" && !elements.empty() )
+      {
+        if ( words.size() == 5 && words[1] == "list" )
+          elements.back().properties.push_back(
+            { words[4], parsePlyType( words[3] ), true, parsePlyType( words[2] ) } );
+        else if ( words.size() == 3 )
+          elements.back().properties.push_back(
+            { words[2], parsePlyType( words[1] ), false, PlyType::UInt8 } );
+        else
+          throw std::runtime_error( "Invalid PLY property." );
+      }
+      else
+        throw std::runtime_error( "Invalid PLY header line." );
+    }
+    if ( !hasFormat )
+      throw std::runtime_error( "Missing format in PLY file." );
+    return elements;
+  }
+
+
+  std::ptrdiff_t findProperty( const PlyElement & element,
+                               std::initializer_list<const char *> names )
+  {
+    for ( std::size_t i = 0; i < element.properties.size(); ++i )
+      for ( const auto name : names )
+        if ( element.properties[i].name == name )
+          return std::ptrdiff_t(i);
+    return -1;
+  }
+
+
+  /// Reads the vertex positions in parallel, if every vertex has the same
+  /// size in the file. Returns false otherwise.
+  bool readFixedSizeBinaryVertices( const PlyElement & element,
+                                    const char * p,
+                                    const char * end,
+                                    const std::ptrdiff_t (&xyz)[3],
+                                    std::vector<Vec<float,3>> & positions,
+                                    JobSystem & jobSystem )
+  {
+    std::size_t stride = 0;
+    std::size_t offsets[3] = {};
+    for ( std::size_t i = 0; i < element.properties.size(); ++i )
+    {
+      const auto & property = element.properties[i];
+      if ( property.isList )
+        return false;
+      for ( std::size_t dim = 0; dim < 3; ++dim )
+        if ( xyz[dim] == std::ptrdiff_t(i) )
+          offsets[dim] = stride;
+      stride += getSize( property.type );
+    }
+    if ( std::uint64_t(end - p) / stride < element.count )
+      throw std::runtime_error( "Unexpected end of PLY file." );
+    positions.resize( element.count );
+    // All vertices lie within the file, so the jobs cannot fail.
+    jobSystem.parallelFor( "read PLY vertices", element.count, 1 << 16,
+                           [&]( std::size_t first, std::size_t last )
+    {
+      for ( auto v = first; v < last; ++v )
+        for ( std::size_t dim = 0; dim < 3; ++dim )
+          positions[v][dim] = float( readBinary(
+              element.properties[xyz[dim]].type, p + v*stride + offsets[dim] ) );
+    } );
+    return true;
+  }
+
+  bool isFloat( PlyType type )
+  {
+    return type == PlyType::Float32 || type == PlyType::Float64;
+  }
+
+
+  struct PlyChunk
+  {
+    std::vector<Vec<float,3>> positions;
+    std::vector<std::uint32_t> indices;
+  };
+
+
+  /// Parses the ASCII lines of an element, one element per line. Integer
+  /// properties are parsed as integers, so indices are exact.
+  void parsePlyAsciiChunk( const PlyElement & element,
+                           const char * p,
+                           const char * end,
+                           const std::ptrdiff_t (&xyz)[3],
+                           std::ptrdiff_t indexList,
+                           PlyChunk & chunk )
+  {
+    const bool isVertex = element.name == "vertex";
+    const bool isFace = element.name == "face";
+    std::vector<std::uint32_t> polygon;
+    for ( ; p != end; p = findNextLine( p, end ) )
+    {
+      const auto lineEnd = findLineEnd( p, end );
+      skipBlanks( p, lineEnd );
+      if ( p == lineEnd )
+        continue;
+      Vec<float,3> position;
+      for ( std::size_t prop = 0; prop < element.properties.size(); ++prop )
+      {
+        const auto & property = element.properties[prop];
+        if ( !property.isList )
+        {
+          double value;
+          std::int64_t integer;
+          if ( isFloat( property.type ) ? !parseNumber( p, lineEnd, value )
+                                        : !parseInteger( p, lineEnd, integer ) )
+            throw std::runtime_error( "Invalid number in PLY file." );
+          for ( std::size_t dim = 0; dim < 3; ++dim )
+            if ( xyz[dim] == std::ptrdiff_t(prop) )
+              position[dim] = isFloat( property.type ) ? float(value) : float(integer);
+          continue;
+        }
+        std::int64_t count;
+        if ( !parseInteger( p, lineEnd, count ) || count < 0 || count > 1000000 )
+          throw std::runtime_error( "Invalid list size in PLY file." );
+        polygon.clear();
+        for ( std::int64_t k = 0; k < count; ++k )
+        {
+          std::int64_t index;
+          if ( !parseInteger( p, lineEnd, index ) )
+            throw std::runtime_error( "Invalid number in PLY file." );
+          if ( index < 0 || index > std::numeric_limits<std::uint32_t>::max() )
+            throw std::runtime_error( "Vertex index out of range." );
+          polygon.push_back( std::uint32_t(index) );
+        }
+        if ( !isFace || std::ptrdiff_t(prop) != indexList )
+          continue;
+        for ( std::size_t k = 1; k + 1 < polygon.size(); ++k )
+          chunk.indices.insert( chunk.indices.end(),
+                                { polygon[0], polygon[k], polygon[k+1] } );
+      }
+      skipBlanks( p, lineEnd );
+      if ( p != lineEnd )
+        throw std::runtime_error( "Invalid PLY element line." );
+      if ( isVertex )
+        chunk.positions.push_back( position );
+    }
+  }
+
+
+  /// Reads the lines of an ASCII element in parallel chunks and appends the
+  /// vertices or triangles to the mesh. Returns the end of the element.
+  const char * readPlyAsciiElement( const PlyElement & element,
+                                    const char * p,
+                                    const char * end,
+                                    const std::ptrdiff_t (&xyz)[3],
+                                    std::ptrdiff_t indexList,
+                                    Mesh<float> & mesh,
+                                    JobSystem & jobSystem )
+  {
+    // Only the line ends are searched serially. Chunks start at line
+    // beginnings and contain chunkSize non-blank lines each.
+    constexpr std::uint64_t chunkSize = 1 << 14;
+    std::vector<const char *> chunkBegins( 1, p );
+    for ( std::uint64_t i = 0; i < element.count; p = findNextLine( p, end ) )
+    {
+      if ( p == end )
+        throw std::runtime_error( "Unexpected end of PLY file." );
+      auto q = p;
+      skipBlanks( q, end );
+      if ( q == end || *q == '\n' )
+        continue;
+      if ( i > 0 && i % chunkSize == 0 )
+        chunkBegins.push_back( p );
+      ++i;
+    }
+    chunkBegins.push_back( p );
+    const auto nChunks = chunkBegins.size() - 1;
+    std::vector<PlyChunk> chunks( nChunks );
+    std::vector<std::exception_ptr> errors( nChunks );
+    jobSystem.parallelFor( "parse PLY", nChunks, 1,
+                           [&]( std::size_t first, std::size_t last )
+    {
+      for ( auto i = first; i < last; ++i )
+      {
+        try
+        {
+          parsePlyAsciiChunk( element, chunkBegins[i], chunkBegins[i+1],
+                              xyz, indexList, chunks[i] );
+        }
+        catch ( ... )
+        {
+          errors[i] = std::current_exception();
+        }
+      }
+    } );
+    for ( const auto & error : errors )
+      if ( error )
+        std::rethrow_exception( error );
+    for ( const auto & chunk : chunks )
+    {
+      mesh.positions.insert( mesh.positions.end(),
+                             chunk.positions.begin(), chunk.positions.end() );
+      mesh.indices.insert( mesh.indices.end(),
+                           chunk.indices.begin(), chunk.indices.end() );
+    }
+    return p;
+  }
+
+} // namespace
+
+
+MappedFile::MappedFile( const std::string & path )
+{
+  const auto fd = ::open( path.c_str(), O_RDONLY | O_CLOEXEC );
+  if ( fd < 0 )
+    throw makeSystemError( "Could not open", path );
+  struct stat status;
+  if ( ::fstat( fd, &status ) != 0 )
+  {
+    const auto error = makeSystemError( "Could not stat", path );
+    ::close( fd );
+    throw error;
+  }
+  size_ = std::size_t(status.st_size);
+  if ( size_ > 0 )
+  {
+    const auto address = ::mmap( nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+    if ( address == MAP_FAILED )
+    {
+      const auto error = makeSystemError( "Could not map", path );
+      ::close( fd );
+      throw error;
+    }
+    data_ = static_cast<const char*>( address );
+  }
+  ::close( fd );
+}
+
+
+MappedFile::~MappedFile()
+{
+  if ( data_ )
+    ::munmap( const_cast<char*>(data_), size_ );
+}
+
+
+MappedFile::MappedFile( MappedFile && other ) noexcept
+  : data_( other.data_ )
+  , size_( other.size_ )
+{
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+
+MappedFile & MappedFile::operator=( MappedFile && other ) noexcept
+{
+  std::swap( data_, other.data_ );
+  std::swap( size_, other.size_ );
+  return *this;
+}
+
+
+MappedMesh::MappedMesh( const std::string & path )
+  : file_( path )
+{
+  if ( file_.size() < sizeof(header_) )
+    throw std::runtime_error( "Not a mesh file: '" + path + "'." );
+  std::memcpy( &header_, file_.data(), sizeof(header_) );
+  if ( std::memcmp( header_.magic, meshFileMagic, sizeof(meshFileMagic) ) != 0 )
+    throw std::runtime_error( "Not a mesh file: '" + path + "'." );
+  if ( header_.version != meshFileVersion )
+    throw std::runtime_error( "Unsupported mesh file version: '" + path + "'." );
+  if ( header_.byteOrderMark != byteOrderMark )
+    throw std::runtime_error( "Mesh file has wrong byte order: '" + path + "'." );
+  const auto fitsIntoFile = [this]( std::uint64_t offset,
+                                    std::uint64_t count,
+                                    std::uint64_t elementSize )
+  {
+    return offset % meshFileAlignment == 0 &&
+        offset <= file_.size() &&
+        count <= (file_.size() - offset) / elementSize;
+  };
+  if ( !fitsIntoFile( header_.positionsOffset, header_.nVertices, sizeof(Vec<float,3>) ) ||
+       !fitsIntoFile( header_.indicesOffset, header_.nIndices, sizeof(std::uint32_t) ) )
+    throw std::runtime_error( "Corrupt mesh file: '" + path + "'." );
+}
+
+
+MeshView<float> MappedMesh::getView() const
+{
+  return {
+    reinterpret_cast<const Vec<float,3>*>( file_.data() + header_.positionsOffset ),
+    std::size_t(header_.nVertices),
+    reinterpret_cast<const std::uint32_t*>( file_.data() + header_.indicesOffset ),
+    std::size_t(header_.nIndices),
+    { { header_.boundingSphereCenter[0],
+        header_.boundingSphereCenter[1],
+        header_.boundingSphereCenter[2] },
+      header_.boundingSphereRadius } };
+}
+
+
+void MappedMesh::validate() const
+{
+  const auto view = getView();
+  for ( std::size_t i = 0; i < view.nIndices; ++i )
+    checkIndex( view.indices[i], view.nVertices );
+  // Culling with a too small sphere would drop visible meshes. The
+  // tolerance allows for rounding in the distance computation.
+  const auto & sphere = view.boundingSphere;
+  const auto maxDistance = sphere.radius * 1.0001f + 1e-6f;
+  for ( std::size_t i = 0; i < view.nVertices; ++i )
+    if ( !( l2Norm( view.positions[i] - sphere.center ) <= maxDistance ) )
+      throw std::runtime_error( "Vertex outside the bounding sphere." );
+}
+
+
+void writeMeshFile( const std::string & path, const MeshView<float> & mesh )
+{
+  MeshFileHeader header{};
+  std::memcpy( header.magic, meshFileMagic, sizeof(meshFileMagic) );
+  header.version = meshFileVersion;
+  header.byteOrderMark = byteOrderMark;
+  header.nVertices = mesh.nVertices;
+  header.nIndices = mesh.nIndices;
+  header.positionsOffset = alignUp( sizeof(header) );
+  header.indicesOffset = alignUp( header.positionsOffset +
+                                  mesh.nVertices * sizeof(Vec<float,3>) );
+  for ( std::size_t dim = 0; dim < 3; ++dim )
+    header.boundingSphereCenter[dim] = mesh.boundingSphere.center[dim];
+  header.boundingSphereRadius = mesh.boundingSphere.radius;
+
+  std::ofstream file( path, std::ios::binary | std::ios::trunc );
+  if ( !file )
+    throw makeSystemError( "Could not create", path );
+  const char padding[meshFileAlignment] = {};
+  const auto writePadding = [&]( std::uint64_t offset )
+  {
+    file.write( padding, std::streamsize( offset - std::uint64_t(file.tellp()) ) );
+  };
+  file.write( reinterpret_cast<const char*>(&header), sizeof(header) );
+  writePadding( header.positionsOffset );
+  file.write( reinterpret_cast<const char*>(mesh.positions),
+              std::streamsize( mesh.nVertices * sizeof(Vec<float,3>) ) );
+  writePadding( header.indicesOffset );
+  file.write( reinterpret_cast<const char*>(mesh.indices),
+              std::streamsize( mesh.nIndices * sizeof(std::uint32_t) ) );
+  file.close();
+  if ( !file )
+    throw makeSystemError( "Could not write", path );
+}
+
+
+Mesh<float> importObj( const std::string & path, JobSystem & jobSystem )
+{
+  const MappedFile file( path );
+  const auto begin = file.data();
+  const auto end = begin + file.size();
+
+  // Chunks start at line beginnings. Each is parsed by a separate job.
+  constexpr std::size_t chunkSize = 1 << 20;
+  std::vector<const char *> chunkBegins( 1, begin );
+  while ( std::size_t(end - chunkBegins.back()) > chunkSize )
+  {
+    const auto p = findNextLine( chunkBegins.back() + chunkSize, end );
+    if ( p == end )
+      break;
+    chunkBegins.push_back( p );
+  }
+  chunkBegins.push_back( end );
+  const auto nChunks = chunkBegins.size() - 1;
+  std::vector<ObjChunk> chunks( nChunks );
+  // Errors are collected per chunk, so the first one in the file is
+  // reported, no matter which job finds it first.
+  std::vector<std::exception_ptr> errors( nChunks );
+  const auto rethrowFirstError = [&errors]
+  {
+    for ( const auto & error : errors )
+      if ( error )
+        std::rethrow_exception( error );
+  };
+  jobSystem.parallelFor( "parse OBJ", nChunks, 1,
+                         [&]( std::size_t first, std::size_t last )
+  {
+    for ( auto i = first; i < last; ++i )
+    {
+      try
+      {
+        parseObjChunk( chunkBegins[i], chunkBegins[i+1], chunks[i] );
+      }
+      catch ( ... )
+      {
+        errors[i] = std::current_exception();
+      }
+    }
+  } );
+  rethrowFirstError();
+
+  std::vector<std::size_t> vertexOffsets( nChunks+1 );
+  std::vector<std::size_t> indexOffsets( nChunks+1 );
+  for ( std::size_t i = 0; i < nChunks; ++i )
+  {
+    vertexOffsets[i+1] = vertexOffsets[i] + chunks[i].positions.size();
+    indexOffsets [i+1] = indexOffsets [i] + chunks[i].indices  .size();
+  }
+  const auto nVertices = vertexOffsets.back();
+  if ( nVertices > std::numeric_limits<std::uint32_t>::max() )
+    throw std::runtime_error( "Too many vertices in OBJ file." );
+
+  Mesh<float> mesh;
+  mesh.positions.resize( nVertices );
+  mesh.indices.resize( indexOffsets.back() );
+  jobSystem.parallelFor( "merge OBJ", nChunks, 1,
+                         [&]( std::size_t first, std::size_t last )
+  {
+    for ( auto i = first; i < last; ++i )
+    {
+      try
+      {
+        auto & chunk = chunks[i];
+        for ( const auto pos : chunk.relativeIndexPositions )
+          chunk.indices[pos] += std::int64_t(vertexOffsets[i]);
+        std::copy( chunk.positions.begin(), chunk.positions.end(),
+                   mesh.positions.begin() + vertexOffsets[i] );
+        std::transform( chunk.indices.begin(), chunk.indices.end(),
+                        mesh.indices.begin() + indexOffsets[i],
+                        [nVertices]( std::int64_t index )
+                        { return checkIndex( index, nVertices ); } );
+      }
+      catch ( ... )
+      {
+        errors[i] = std::current_exception();
+      }
+    }
+  } );
+  rethrowFirstError();
+  return mesh;
+}
+
+
+Mesh<float> importPly( const std::string & path, JobSystem & jobSystem )
+{
+  const MappedFile file( path );
+  const char * p = file.data();
+  const auto end = p + file.size();
+  bool isBinary = false;
+  const auto elements = parsePlyHeader( p, end, isBinary );
+
+  Mesh<float> mesh;
+  PlyReader reader( p, end );
+  for ( const auto & element : elements )
+  {
+    const bool isVertex = element.name == "vertex";
+    const bool isFace = element.name == "face";
+    const std::ptrdiff_t xyz[3] = {
+      findProperty( element, { "x" } ),
+      findProperty( element, { "y" } ),
+      findProperty( element, { "z" } ) };
+    const auto indexList = findProperty( element, { "vertex_indices", "vertex_index" } );
+    if ( isVertex && std::min( { xyz[0], xyz[1], xyz[2] } ) < 0 )
+      throw std::runtime_error( "PLY vertices without x, y or z." );
+    if ( isFace && indexList < 0 )
+      throw std::runtime_error( "PLY faces without vertex indices." );
+    if ( isVertex && isBinary &&
+         readFixedSizeBinaryVertices( element, reader.getPos(), end, xyz,
+                                      mesh.positions, jobSystem ) )
+    {
+      std::size_t stride = 0;
+      for ( const auto & property : element.properties )
+        stride += getSize( property.type );
+      reader.setPos( reader.getPos() + element.count * stride );
+      continue;
+    }
+    // Every element takes at least one byte per property, so a corrupt
+    // count is detected before allocating memory for it.
+    std::uint64_t minElementSize = 0;
+    for ( const auto & property : element.properties )
+      minElementSize += isBinary
+          ? getSize( property.isList ? property.countType : property.type )
+          : 1;
+    if ( element.count > 0 &&
+         element.count > std::uint64_t(end - reader.getPos()) /
+                         std::max<std::uint64_t>( minElementSize, 1 ) )
+      throw std::runtime_error( "Unexpected end of PLY file." );
+    if ( isVertex )
+      mesh.positions.reserve( element.count );
+    if ( !isBinary )
+    {
+      reader.setPos( readPlyAsciiElement( element, reader.getPos(), end, xyz,
+                                          indexList, mesh, jobSystem ) );
+      continue;
+    }
+    std::vector<std::uint32_t> polygon;
+    for ( std::uint64_t i = 0; i < element.count; ++i )
+    {
+      Vec<float,3> position;
+      for ( std::size_t prop = 0; prop < element.properties.size(); ++prop )
+      {
+        const auto & property = element.properties[prop];
+        if ( !property.isList )
+        {
+          const auto value = reader.read( property.type );
+          for ( std::size_t dim = 0; dim < 3; ++dim )
+            if ( xyz[dim] == std::ptrdiff_t(prop) )
+              position[dim] = float(value);
+          continue;
+        }
+        const auto count = reader.read( property.countType );
+        if ( !( count >= 0 ) || count > 1e6 )
+          throw std::runtime_error( "Invalid list size in PLY file." );
+        polygon.clear();
+        for ( std::size_t k = 0; k < std::size_t(count); ++k )
+        {
+          const auto value = reader.read( property.type );
+          if ( !( value >= 0 && value <= std::numeric_limits<std::uint32_t>::max() ) )
+            throw std::runtime_error( "Vertex index out of range." );
+          polygon.push_back( std::uint32_t(value) );
+        }
+        if ( !isFace || std::ptrdiff_t(prop) != indexList )
+          continue;
+        for ( std::size_t k = 1; k + 1 < polygon.size(); ++k )
+          mesh.indices.insert( mesh.indices.end(),
+                               { polygon[0], polygon[k], polygon[k+1] } );
+      }
+      if ( isVertex )
+        mesh.positions.push_back( position );
+    }
+  }
+  for ( const auto index : mesh.indices )
+    checkIndex( index, mesh.positions.size() );
+  return mesh;
+}
+
+
+void convertToMeshFile( const std::string & inPath,
+                        const std::string & outPath,
+                        JobSystem & jobSystem )
+{
+  auto extension = inPath.substr( std::min( inPath.size(), inPath.rfind('.') ) );
+  std::transform( extension.begin(), extension.end(), extension.begin(),
+                  []( unsigned char c ) { return char( std::tolower(c) ); } );
+  if ( extension == ".obj" )
+    writeMeshFile( outPath, importObj( inPath, jobSystem ) );
+  else if ( extension == ".ply" )
+    writeMeshFile( outPath, importPly( inPath, jobSystem ) );
+  else
+    throw std::runtime_error( "Unknown mesh file type: '" + inPath + "'." );
+}
+
+} // namespace cu
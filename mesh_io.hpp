@@ -0,0 +1,95 @@
+#pragma once
+
+#include "job_system.hpp"
+#include "mesh.hpp"
+
+#include <cstdint>
+#include <string>
+
+
+namespace cu
+{
+
+/// A read-only memory mapping of a whole file. Throws std::runtime_error, if
+/// the file cannot be opened or mapped.
+class MappedFile
+{
+public:
+  MappedFile() = default;
+  explicit MappedFile( const std::string & path );
+  ~MappedFile();
+
+  MappedFile( MappedFile && other ) noexcept;
+  MappedFile & operator=( MappedFile && other ) noexcept;
+
+  const char * data() const { return data_; }
+  std::size_t size() const { return size_; }
+
+private:
+  const char * data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+
+/// The header of a binary mesh file. It is followed by the vertex positions
+/// as three floats each and the triangle indices as 32 bit integers. Both
+/// arrays start at multiples of meshFileAlignment bytes, so a memory mapped
+/// file can be used as vertex and index streams without any parsing.
+/// Files are written in the byte order of the machine, which is recorded
+/// in byteOrderMark. The bounding sphere of the vertices is stored, so it
+/// need not be computed from the vertices when the file is loaded.
+struct MeshFileHeader
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t byteOrderMark;
+  std::uint64_t nVertices;
+  std::uint64_t nIndices;
+  std::uint64_t positionsOffset;
+  std::uint64_t indicesOffset;
+  float boundingSphereCenter[3];
+  float boundingSphereRadius;
+};
+
+constexpr std::size_t meshFileAlignment = 64;
+
+
+/// A binary mesh file mapped into memory. The pages are loaded lazily by
+/// the operating system when the renderer touches them.
+class MappedMesh
+{
+public:
+  /// Checks the header, but not the indices. Call validate() before
+  /// drawing files from untrusted sources.
+  explicit MappedMesh( const std::string & path );
+
+  MeshView<float> getView() const;
+
+  /// Throws std::runtime_error, if an index is out of range or a vertex
+  /// lies outside the bounding sphere.
+  void validate() const;
+
+private:
+  MappedFile file_;
+  MeshFileHeader header_;
+};
+
+
+void writeMeshFile( const std::string & path, const MeshView<float> & mesh );
+
+/// Reads a Wavefront OBJ file. Only vertex positions and faces are used.
+/// Polygons are triangulated as fans. The file is parsed in chunks in
+/// parallel.
+Mesh<float> importObj( const std::string & path, JobSystem & jobSystem );
+
+/// Reads an ASCII or binary little endian PLY file. Only the x, y and z
+/// properties of vertices and the vertex index lists of faces are used.
+Mesh<float> importPly( const std::string & path, JobSystem & jobSystem );
+
+/// Converts an OBJ or PLY file, depending on the file extension of
+/// inPath, to a binary mesh file.
+void convertToMeshFile( const std::string & inPath,
+                        const std::string & outPath,
+                        JobSystem & jobSystem );
+
+} // namespace cu
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "mesh.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+
+namespace cu
+{
+
+namespace detail
+{
+
+  /// Scores after Tom Forsyth, "Linear-Speed Vertex Cache Optimisation".
+  /// Vertices which have just been used score high, so triangles sharing
+  /// them are emitted next. Vertices with few remaining triangles score
+  /// high, so no lonely triangles are left behind.
+  class VertexCacheScores
+  {
+  public:
+    static constexpr std::size_t cacheSize = 32;
+
+    VertexCacheScores()
+    {
+      for ( std::size_t pos = 0; pos < cacheSize; ++pos )
+        cacheScores_[pos] = pos < 3
+            ? 0.75f
+            : std::pow( 1.f - float(pos-3) / float(cacheSize-3), 1.5f );
+      valenceScores_[0] = 0;
+      for ( std::size_t n = 1; n < valenceScores_.size(); ++n )
+        valenceScores_[n] = 2.f / std::sqrt( float(n) );
+    }
+
+    /// cachePos is the position in the simulated LRU cache or -1.
+    float get( std::ptrdiff_t cachePos, std::size_t nRemainingTriangles ) const
+    {
+      if ( nRemainingTriangles == 0 )
+        return -1;
+      const auto valenceScore = nRemainingTriangles < valenceScores_.size()
+          ? valenceScores_[nRemainingTriangles]
+          : 2.f / std::sqrt( float(nRemainingTriangles) );
+      return valenceScore + ( cachePos < 0 ? 0.f : cacheScores_[cachePos] );
+    }
+
+  private:
+    std::array<float,cacheSize> cacheScores_;
+    std::array<float,64> valenceScores_;
+  };
+
+} // namespace detail
+
+
+/// Reorders the triangles, so that consecutive triangles share vertices as
+/// often as possible. This improves the reuse of transformed vertices and
+/// the locality of framebuffer writes. Runs in linear time.
+inline std::vector<std::uint32_t> optimizeVertexCache(
+    const std::uint32_t * indices,
+    std::size_t nIndices,
+    std::size_t nVertices )
+{
+  constexpr auto cacheSize = detail::VertexCacheScores::cacheSize;
+  const auto nTriangles = nIndices / 3;
+  const detail::VertexCacheScores scores;
+
+  // triangles adjacent to each vertex, the first nRemaining[v] of them
+  // not emitted yet
+  std::vector<std::uint32_t> adjacencyOffsets( nVertices+1 );
+  std::vector<std::uint32_t> nRemaining( nVertices );
+  for ( std::size_t i = 0; i < nTriangles*3; ++i )
+  {
+    assert( indices[i] < nVertices );
+    ++nRemaining[indices[i]];
+  }
+  for ( std::size_t v = 0; v < nVertices; ++v )
+    adjacencyOffsets[v+1] = adjacencyOffsets[v] + nRemaining[v];
+  std::vector<std::uint32_t> adjacency( nTriangles*3 );
+  {
+    auto fillPos = adjacencyOffsets;
+    for ( std::size_t i = 0; i < nTriangles*3; ++i )
+      adjacency[fillPos[indices[i]]++] = std::uint32_t(i/3);
+  }
+
+  std::vector<std::ptrdiff_t> cachePositions( nVertices, -1 );
+  std::vector<float> vertexScores( nVertices );
+  for ( std::size_t v = 0; v < nVertices; ++v )
+    vertexScores[v] = scores.get( -1, nRemaining[v] );
+  std::vector<float> triangleScores( nTriangles );
+  for ( std::size_t t = 0; t < nTriangles; ++t )
+    triangleScores[t] = vertexScores[indices[3*t  ]] +
+                        vertexScores[indices[3*t+1]] +
+                        vertexScores[indices[3*t+2]];
+  std::vector<char> isEmitted( nTriangles );
+
+  std::vector<std::uint32_t> result;
+  result.reserve( nTriangles*3 );
+  std::vector<std::uint32_t> cache;
+  std::vector<std::uint32_t> newCache;
+  std::size_t cursor = 0; // all triangles before it have been emitted
+  auto best = std::ptrdiff_t(
+        std::max_element( triangleScores.begin(), triangleScores.end() ) -
+        triangleScores.begin() );
+  while ( result.size() < nTriangles*3 )
+  {
+    if ( best < 0 )
+    {
+      // The cache does not touch any remaining triangle. Restart anywhere.
+      while ( isEmitted[cursor] )
+        ++cursor;
+      best = std::ptrdiff_t(cursor);
+    }
+    const auto triangle = std::size_t(best);
+    isEmitted[triangle] = true;
+    newCache.clear();
+    for ( std::size_t corner = 0; corner < 3; ++corner )
+    {
+      const auto v = indices[3*triangle+corner];
+      result.push_back( v );
+      newCache.push_back( v );
+      // remove the triangle from the remaining adjacent triangles of v
+      const auto begin = adjacency.begin() + adjacencyOffsets[v];
+      const auto end = begin + nRemaining[v];
+      std::iter_swap( std::find( begin, end, std::uint32_t(triangle) ), end-1 );
+      --nRemaining[v];
+    }
+    for ( const auto v : cache )
+      if ( std::find( newCache.begin(), newCache.end(), v ) == newCache.end() )
+        newCache.push_back( v );
+    for ( std::size_t pos = 0; pos < newCache.size(); ++pos )
+      cachePositions[newCache[pos]] = pos < cacheSize ? std::ptrdiff_t(pos) : -1;
+    if ( newCache.size() > cacheSize )
+      newCache.resize( cacheSize ); // the dropped vertices were updated above
+
+    // Update the scores of all vertices whose cache position changed and of
+    // their triangles. The best next triangle is among these.
+    best = -1;
+    float bestScore = -std::numeric_limits<float>::infinity();
+    for ( const auto v : cache )
+      if ( cachePositions[v] < 0 )
+        vertexScores[v] = scores.get( -1, nRemaining[v] );
+    for ( const auto v : newCache )
+      vertexScores[v] = scores.get( cachePositions[v], nRemaining[v] );
+    for ( const auto v : newCache )
+      for ( std::size_t i = 0; i < nRemaining[v]; ++i )
+      {
+        const auto t = adjacency[adjacencyOffsets[v]+i];
+        triangleScores[t] = vertexScores[indices[3*t  ]] +
+                            vertexScores[indices[3*t+1]] +
+                            vertexScores[indices[3*t+2]];
+        if ( triangleScores[t] > bestScore )
+        {
+          bestScore = triangleScores[t];
+          best = t;
+        }
+      }
+    cache.swap( newCache );
+  }
+  return result;
+}
+
+
+inline void optimizeVertexCache( std::vector<std::uint32_t> & indices,
+                                 std::size_t nVertices )
+{
+  indices = optimizeVertexCache( indices.data(), indices.size(), nVertices );
+}
+
+
+/// Reorders the vertices in the order of their first use by the triangles
+/// and drops unused vertices. After optimizeVertexCache() this makes
+/// vertex fetches mostly sequential.
+template <typename Coord>
+void optimizeVertexFetch( Mesh<Coord> & mesh )
+{
+  constexpr auto unused = std::numeric_limits<std::uint32_t>::max();
+  std::vector<std::uint32_t> remap( mesh.positions.size(), unused );
+  std::vector<Vec<Coord,3>> positions;
+  positions.reserve( mesh.positions.size() );
+  for ( auto & index : mesh.indices )
+  {
+    if ( remap[index] == unused )
+    {
+      remap[index] = std::uint32_t(positions.size());
+      positions.push_back( mesh.positions[index] );
+    }
+    index = remap[index];
+  }
+  mesh.positions.swap( positions );
+}
+
+} // namespace cu
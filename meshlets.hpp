@@ -0,0 +1,241 @@
+#pragma once
+
+#include "drawing.hpp"
+#include "instancing.hpp"
+#include "mat.hpp"
+#include "mesh.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+namespace cu
+{
+
+/// A small cluster of triangles of a mesh. Its vertices are
+/// MeshletMesh::vertices[vertexOffset,vertexOffset+nVertices). Its
+/// triangles are given by 3*nTriangles local vertex indices starting at
+/// MeshletMesh::triangles[triangleOffset].
+struct Meshlet
+{
+  std::uint32_t vertexOffset;
+  std::uint32_t triangleOffset;
+  std::uint8_t nVertices;
+  std::uint8_t nTriangles;
+};
+
+
+/// Bounds for rejecting whole meshlets. The meshlet is back-facing for every
+/// camera position c with dot( normalize(coneApex-c), coneAxis ) >= coneCutoff.
+/// If the normals of the meshlet vary too much, coneCutoff is greater than 1,
+/// which disables this test.
+template <typename Coord>
+struct MeshletBounds
+{
+  Sphere<Coord> sphere;
+  Vec<Coord,3> coneApex;
+  Vec<Coord,3> coneAxis;
+  Coord coneCutoff;
+};
+
+
+template <typename Coord>
+struct MeshletMesh
+{
+  std::vector<Meshlet> meshlets;
+  std::vector<MeshletBounds<Coord>> bounds;
+  std::vector<std::uint32_t> vertices;
+  std::vector<std::uint8_t> triangles;
+};
+
+
+namespace detail
+{
+
+  template <typename Coord>
+  MeshletBounds<Coord> makeMeshletBounds( const MeshView<Coord> & mesh,
+                                          const std::uint32_t * vertices,
+                                          const Meshlet & meshlet,
+                                          const std::uint8_t * triangles )
+  {
+    std::array<Vec<Coord,3>,255> points;
+    for ( std::size_t i = 0; i < meshlet.nVertices; ++i )
+      points[i] = mesh.positions[vertices[i]];
+    MeshletBounds<Coord> bounds;
+    bounds.sphere = makeBoundingSphere( points.data(), meshlet.nVertices );
+    bounds.coneApex = bounds.sphere.center;
+    bounds.coneCutoff = 2;
+
+    std::array<Vec<Coord,3>,255> normals;
+    Vec<Coord,3> axis;
+    for ( std::size_t t = 0; t < meshlet.nTriangles; ++t )
+    {
+      normals[t] = normalVector( points[triangles[3*t  ]],
+                                 points[triangles[3*t+1]],
+                                 points[triangles[3*t+2]] );
+      axis += normals[t];
+    }
+    if ( sqrNorm( axis ) == 0 )
+      return bounds;
+    axis = normalize( axis );
+    Coord minDot = 1;
+    for ( std::size_t t = 0; t < meshlet.nTriangles; ++t )
+      if ( sqrNorm( normals[t] ) != 0 )
+        minDot = std::min( minDot, normals[t] * axis );
+    // Beyond this spread the cone would hardly ever reject anything.
+    if ( minDot <= Coord(0.1) )
+      return bounds;
+
+    // Move the apex back along the axis until it lies behind the planes of
+    // all triangles.
+    Coord maxT = 0;
+    for ( std::size_t t = 0; t < meshlet.nTriangles; ++t )
+    {
+      const auto & n = normals[t];
+      if ( sqrNorm( n ) == 0 )
+        continue;
+      const auto dc = ( bounds.sphere.center - points[triangles[3*t]] ) * n;
+      maxT = std::max( maxT, dc / ( n * axis ) );
+    }
+    bounds.coneApex = bounds.sphere.center - maxT * axis;
+    bounds.coneAxis = axis;
+    bounds.coneCutoff = std::sqrt( 1 - minDot*minDot );
+    return bounds;
+  }
+
+} // namespace detail
+
+
+/// Splits the mesh into meshlets of at most maxVertices vertices and
+/// maxTriangles triangles. Consecutive triangles are grouped, so run
+/// optimizeVertexCache() first to get compact meshlets.
+template <typename Coord>
+MeshletMesh<Coord> buildMeshlets( const MeshView<Coord> & mesh,
+                                  std::size_t maxVertices = 64,
+                                  std::size_t maxTriangles = 124 )
+{
+  assert( maxVertices >= 3 && maxVertices <= 255 );
+  assert( maxTriangles >= 1 && maxTriangles <= 255 );
+  MeshletMesh<Coord> result;
+  constexpr std::uint8_t notInMeshlet = 0xFF;
+  std::vector<std::uint8_t> localIndices( mesh.nVertices, notInMeshlet );
+  Meshlet current{ 0, 0, 0, 0 };
+
+  const auto finishMeshlet = [&]
+  {
+    if ( current.nTriangles == 0 )
+      return;
+    for ( std::size_t i = 0; i < current.nVertices; ++i )
+      localIndices[result.vertices[current.vertexOffset+i]] = notInMeshlet;
+    result.meshlets.push_back( current );
+    result.bounds.push_back( detail::makeMeshletBounds(
+        mesh, &result.vertices[current.vertexOffset], current,
+        &result.triangles[current.triangleOffset] ) );
+    current = { std::uint32_t(result.vertices.size()),
+                std::uint32_t(result.triangles.size()), 0, 0 };
+  };
+
+  for ( std::size_t i = 0; i + 2 < mesh.nIndices; i += 3 )
+  {
+    const auto a = mesh.indices[i], b = mesh.indices[i+1], c = mesh.indices[i+2];
+    const std::size_t nNewVertices =
+        ( localIndices[a] == notInMeshlet ) +
+        ( localIndices[b] == notInMeshlet && b != a ) +
+        ( localIndices[c] == notInMeshlet && c != a && c != b );
+    if ( current.nVertices + nNewVertices > maxVertices ||
+         current.nTriangles + 1u > maxTriangles )
+      finishMeshlet();
+    for ( const auto v : { a, b, c } )
+    {
+      if ( localIndices[v] == notInMeshlet )
+      {
+        localIndices[v] = current.nVertices++;
+        result.vertices.push_back( v );
+      }
+      result.triangles.push_back( localIndices[v] );
+    }
+    ++current.nTriangles;
+  }
+  finishMeshlet();
+  return result;
+}
+
+
+/// Returns false, if the meshlet is completely outside the view frustum or
+/// faces away from the camera. The transform into view space must be a
+/// similarity transform, i.e. not scale non-uniformly. Culling back-facing
+/// meshlets assumes that back faces are hidden, e.g. for closed meshes.
+template <typename Coord>
+bool isMeshletVisible( const MeshletBounds<Coord> & bounds,
+                       const Mat<Coord,4,4> & transform,
+                       const Projection<Coord> & projection )
+{
+  const Sphere<Coord> sphere{
+    detail::transformPoint( transform, bounds.sphere.center ),
+    bounds.sphere.radius * detail::getMaxScale( transform ) };
+  if ( !projection.isVisible( sphere ) )
+    return false;
+  if ( bounds.coneCutoff > 1 )
+    return true;
+  // The camera is in the origin of view space.
+  const auto apex = detail::transformPoint( transform, bounds.coneApex );
+  const Vec<Coord,3> axis = {
+    transform[0][0]*bounds.coneAxis[0] + transform[0][1]*bounds.coneAxis[1] + transform[0][2]*bounds.coneAxis[2],
+    transform[1][0]*bounds.coneAxis[0] + transform[1][1]*bounds.coneAxis[1] + transform[1][2]*bounds.coneAxis[2],
+    transform[2][0]*bounds.coneAxis[0] + transform[2][1]*bounds.coneAxis[1] + transform[2][2]*bounds.coneAxis[2] };
+  const auto sqrDist = sqrNorm( apex );
+  if ( sqrDist == 0 )
+    return true;
+  return apex * axis < bounds.coneCutoff * std::sqrt( sqrDist * sqrNorm( axis ) );
+}
+
+
+/// Draws a mesh split into meshlets. Meshlets failing isMeshletVisible() are
+/// rejected before any of their vertices are transformed. For the other
+/// parameters see InstancedRenderer::draw().
+template <typename Image, typename ZBuffer, typename Coord,
+          typename Color, typename ShadeFace>
+void drawMeshlets( Image & img,
+                   ZBuffer & zBuffer,
+                   const MeshView<Coord> & mesh,
+                   const MeshletMesh<Coord> & meshlets,
+                   const Mat<Coord,4,4> & transform,
+                   const Color & color,
+                   const Projection<Coord> & projection,
+                   ShadeFace && shadeFace )
+{
+  std::array<Vec<Coord,3>,255> points3d;
+  std::array<Vec<Coord,2>,255> points2d;
+  for ( std::size_t m = 0; m < meshlets.meshlets.size(); ++m )
+  {
+    if ( !isMeshletVisible( meshlets.bounds[m], transform, projection ) )
+      continue;
+    const auto & meshlet = meshlets.meshlets[m];
+    const auto vertices = &meshlets.vertices[meshlet.vertexOffset];
+    for ( std::size_t i = 0; i < meshlet.nVertices; ++i )
+    {
+      points3d[i] = detail::transformPoint( transform, mesh.positions[vertices[i]] );
+      points2d[i] = projection.project( points3d[i] );
+    }
+    const auto triangles = &meshlets.triangles[meshlet.triangleOffset];
+    for ( std::size_t t = 0; t < meshlet.nTriangles; ++t )
+    {
+      const auto a = triangles[3*t], b = triangles[3*t+1], c = triangles[3*t+2];
+      const auto & P = points3d[a];
+      const auto & Q = points3d[b];
+      const auto & R = points3d[c];
+      if ( std::max( { P[2], Q[2], R[2] } ) >= projection.maxZ )
+        continue;
+      drawTriangle( img, points2d[a], points2d[b], points2d[c],
+                    shadeFace( normalVector( P, Q, R ), color ),
+                    zBuffer, projection.maxZ, ( P[2] + Q[2] + R[2] ) / 3 );
+    }
+  }
+}
+
+} // namespace cu
@@ -0,0 +1,443 @@
+#pragma once
+
+#include "drawing.hpp"
+#include "job_system.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+
+namespace cu
+{
+
+/// A multisampled framebuffer with 4 or 8 samples per pixel. The pixels are
+/// stored in tiles of tileSize x tileSize pixels like in a TiledMat. As long
+/// as all samples of every pixel of a tile are equal, the tile is compressed
+/// and stores one value per pixel. Only tiles containing triangle edges are
+/// expanded to store all samples. Since most tiles are either empty or in
+/// the interior of a triangle, this costs hardly more memory bandwidth than a
+/// framebuffer without multisampling.
+///
+/// Use one MsaaMat for colors and one for depths with the same dimensions
+/// and number of samples. Use resolve() to average the samples.
+template <typename T>
+class MsaaMat
+{
+public:
+  static constexpr std::size_t tileSizeLog2 = 3;
+  static constexpr std::size_t tileSize = std::size_t(1) << tileSizeLog2;
+  static constexpr std::size_t tileArea = tileSize * tileSize;
+
+  MsaaMat() = default;
+  MsaaMat( std::size_t nRows,
+           std::size_t nCols,
+           std::size_t nSamples )
+    : nRows_(nRows)
+    , nCols_(nCols)
+    , nSamples_(nSamples)
+    , nTileRows_( (nRows + tileSize - 1) >> tileSizeLog2 )
+    , nTileCols_( (nCols + tileSize - 1) >> tileSizeLog2 )
+    , pixels_( nTileRows_*nTileCols_*tileArea )
+    , isCompressed_( nTileRows_*nTileCols_, char(true) )
+    , sampleOffsets_( nTileRows_*nTileCols_, noSamples )
+  {
+    if ( !isValidNSamples( nSamples ) )
+      throw std::runtime_error( "Multisampling needs 4 or 8 samples per pixel." );
+  }
+
+  /// Only these sample counts have sample patterns.
+  static bool isValidNSamples( std::size_t nSamples )
+  {
+    return nSamples == 4 || nSamples == 8;
+  }
+
+  std::size_t getNRows() const { return nRows_; }
+  std::size_t getNCols() const { return nCols_; }
+  std::size_t getNSamples() const { return nSamples_; }
+  std::size_t getNTileRows() const { return nTileRows_; }
+  std::size_t getNTileCols() const { return nTileCols_; }
+
+  std::size_t getTileIndex( std::size_t row, std::size_t col ) const
+  {
+    return (row >> tileSizeLog2) * nTileCols_ + (col >> tileSizeLog2);
+  }
+
+  static std::size_t getPixelIndex( std::size_t row, std::size_t col )
+  {
+    return ( (row & (tileSize-1)) << tileSizeLog2 ) | (col & (tileSize-1));
+  }
+
+  bool isCompressed( std::size_t tile ) const { return isCompressed_[tile]; }
+
+  /// The values of the pixels of a compressed tile.
+  T * getPixelData( std::size_t tile ) { return &pixels_[tile*tileArea]; }
+  const T * getPixelData( std::size_t tile ) const { return &pixels_[tile*tileArea]; }
+
+  /// The samples of an expanded tile. The samples of every pixel are
+  /// stored consecutively.
+  T * getSampleData( std::size_t tile )
+  {
+    assert( !isCompressed_[tile] );
+    return &samples_[sampleOffsets_[tile]];
+  }
+
+  const T * getSampleData( std::size_t tile ) const
+  {
+    return const_cast<MsaaMat&>(*this).getSampleData( tile );
+  }
+
+  /// Stores all samples of the tile separately. Sample storage of a tile is
+  /// kept, when it is compressed again by clearing a rectangle, so redrawing
+  /// the same region every frame does not allocate.
+  void expand( std::size_t tile )
+  {
+    if ( !isCompressed_[tile] )
+      return;
+    if ( sampleOffsets_[tile] == noSamples )
+    {
+      sampleOffsets_[tile] = samples_.size();
+      samples_.resize( samples_.size() + tileArea*nSamples_ );
+    }
+    const auto pixels = getPixelData( tile );
+    const auto samples = &samples_[sampleOffsets_[tile]];
+    for ( std::size_t i = 0; i < tileArea; ++i )
+      std::fill_n( samples + i*nSamples_, nSamples_, pixels[i] );
+    isCompressed_[tile] = false;
+  }
+
+  const T & getSample( std::size_t row, std::size_t col, std::size_t sample ) const
+  {
+    assert( row < nRows_ && col < nCols_ && sample < nSamples_ );
+    const auto tile = getTileIndex( row, col );
+    const auto pixel = getPixelIndex( row, col );
+    return isCompressed_[tile]
+        ? getPixelData( tile )[pixel]
+        : getSampleData( tile )[pixel*nSamples_+sample];
+  }
+
+  /// Sets all samples of the given tiles and compresses them.
+  void fillTiles( std::size_t beginTile, std::size_t endTile, const T & value )
+  {
+    std::fill( pixels_.begin() + beginTile*tileArea,
+               pixels_.begin() + endTile*tileArea, value );
+    std::fill( isCompressed_.begin() + beginTile,
+               isCompressed_.begin() + endTile, char(true) );
+  }
+
+  /// Sets all samples to the value and releases the sample storage.
+  void fill( const T & value )
+  {
+    fillTiles( 0, isCompressed_.size(), value );
+    std::fill( sampleOffsets_.begin(), sampleOffsets_.end(), noSamples );
+    samples_.clear();
+  }
+
+private:
+  static constexpr std::size_t noSamples = std::numeric_limits<std::size_t>::max();
+
+  std::size_t nRows_{};
+  std::size_t nCols_{};
+  std::size_t nSamples_{};
+  std::size_t nTileRows_{};
+  std::size_t nTileCols_{};
+  std::vector<T> pixels_;
+  std::vector<char> isCompressed_;
+  std::vector<std::size_t> sampleOffsets_;
+  std::vector<T> samples_;
+};
+
+
+namespace detail
+{
+
+  /// The standard sample positions relative to the sample point of the
+  /// pixel, which is the pixel coordinate itself as in the rasterizer
+  /// without multisampling. The samples are spread in x and y, so that
+  /// near horizontal and near vertical edges get as many coverage levels as
+  /// there are samples.
+  template <typename Coord>
+  const Vec<Coord,2> * getSampleOffsets( std::size_t nSamples )
+  {
+    static const Vec<Coord,2> offsets4[] = {
+      { Coord(-2)/16, Coord(-6)/16 }, { Coord( 6)/16, Coord(-2)/16 },
+      { Coord(-6)/16, Coord( 2)/16 }, { Coord( 2)/16, Coord( 6)/16 } };
+    static const Vec<Coord,2> offsets8[] = {
+      { Coord( 1)/16, Coord(-3)/16 }, { Coord(-1)/16, Coord( 3)/16 },
+      { Coord( 5)/16, Coord( 1)/16 }, { Coord(-3)/16, Coord(-5)/16 },
+      { Coord(-5)/16, Coord( 5)/16 }, { Coord(-7)/16, Coord(-1)/16 },
+      { Coord( 3)/16, Coord( 7)/16 }, { Coord( 7)/16, Coord(-7)/16 } };
+    assert( nSamples == 4 || nSamples == 8 );
+    return nSamples == 4 ? offsets4 : offsets8;
+  }
+
+
+  /// Rasterizes a triangle by evaluating the edge functions at every sample
+  /// of the pixels in its bounding box. The depth test runs per sample,
+  /// while the color is determined once per pixel and triangle. Fully
+  /// covered pixels of compressed tiles keep the tiles compressed.
+  template <typename T, typename Coord, typename Color>
+  void drawTriangleMsaa( MsaaMat<T> & img,
+                         MsaaMat<Coord> & zBuffer,
+                         const PixelRect & clipRect,
+                         Vec<Coord,2> A,
+                         Vec<Coord,2> B,
+                         Vec<Coord,2> C,
+                         const Color & color,
+                         Coord maxZ,
+                         Coord z )
+  {
+    assert( img.getNRows() == zBuffer.getNRows() );
+    assert( img.getNCols() == zBuffer.getNCols() );
+    assert( img.getNSamples() == zBuffer.getNSamples() );
+    if ( z >= maxZ )
+      return;
+    const auto cross = []( const Vec<Coord,2> & u, const Vec<Coord,2> & v )
+    { return u[0]*v[1] - u[1]*v[0]; };
+    const auto area = cross( B-A, C-A );
+    if ( area == 0 )
+      return;
+    if ( area < 0 )
+      std::swap( B, C );
+
+    // Edge i goes from P[i] to P[(i+1)%3]. A sample lies inside, if it is
+    // on the inner side of every edge. Samples on an edge belong to the
+    // triangle on the side selected by ownsTies, so triangles sharing an
+    // edge never cover a sample twice.
+    const std::array<Vec<Coord,2>,3> P = { A, B, C };
+    std::array<Vec<Coord,2>,3> dirs;
+    std::array<bool,3> ownsTies;
+    for ( std::size_t i = 0; i < 3; ++i )
+    {
+      dirs[i] = P[(i+1)%3] - P[i];
+      ownsTies[i] = dirs[i][1] > 0 || ( dirs[i][1] == 0 && dirs[i][0] < 0 );
+    }
+
+    const auto nSamples = img.getNSamples();
+    const auto offsets = getSampleOffsets<Coord>( nSamples );
+    std::array<std::array<Coord,8>,3> sampleSteps;
+    for ( std::size_t i = 0; i < 3; ++i )
+      for ( std::size_t s = 0; s < nSamples; ++s )
+        sampleSteps[i][s] = cross( dirs[i], offsets[s] );
+    const std::uint32_t fullMask = ( 1u << nSamples ) - 1;
+
+    const auto bounds = intersect( clipRect,
+        { std::ptrdiff_t( std::ceil( std::min( { A[0], B[0], C[0] } ) - Coord(0.5) ) ),
+          std::ptrdiff_t( std::ceil( std::min( { A[1], B[1], C[1] } ) - Coord(0.5) ) ),
+          std::ptrdiff_t( std::floor( std::max( { A[0], B[0], C[0] } ) + Coord(0.5) ) ) + 1,
+          std::ptrdiff_t( std::floor( std::max( { A[1], B[1], C[1] } ) + Coord(0.5) ) ) + 1 } );
+    for ( auto y = bounds.top; y < bounds.bottom; ++y )
+      for ( auto x = bounds.left; x < bounds.right; ++x )
+      {
+        std::uint32_t mask = fullMask;
+        for ( std::size_t i = 0; i < 3 && mask != 0; ++i )
+        {
+          const auto e = cross( dirs[i], Vec<Coord,2>{ x - P[i][0], y - P[i][1] } );
+          for ( std::size_t s = 0; s < nSamples; ++s )
+          {
+            const auto es = e + sampleSteps[i][s];
+            if ( ownsTies[i] ? es < 0 : es <= 0 )
+              mask &= ~( 1u << s );
+          }
+        }
+        if ( mask == 0 )
+          continue;
+
+        const auto tile = img.getTileIndex( y, x );
+        const auto pixel = img.getPixelIndex( y, x );
+        if ( mask == fullMask && img.isCompressed( tile ) && zBuffer.isCompressed( tile ) )
+        {
+          auto & currentZ = zBuffer.getPixelData( tile )[pixel];
+          if ( z > currentZ )
+          {
+            currentZ = z;
+            img.getPixelData( tile )[pixel] = color;
+          }
+          continue;
+        }
+        img.expand( tile );
+        zBuffer.expand( tile );
+        const auto colors = img.getSampleData( tile ) + pixel*nSamples;
+        const auto depths = zBuffer.getSampleData( tile ) + pixel*nSamples;
+        for ( std::size_t s = 0; s < nSamples; ++s )
+          if ( ( mask >> s & 1 ) && z > depths[s] )
+          {
+            depths[s] = z;
+            colors[s] = color;
+          }
+      }
+  }
+
+
+  template <typename T>
+  T averageSamples( const T * samples, std::size_t nSamples )
+  {
+    if constexpr ( std::is_integral<T>::value )
+    {
+      std::int64_t sum = 0;
+      for ( std::size_t s = 0; s < nSamples; ++s )
+        sum += samples[s];
+      return T( ( sum + std::int64_t(nSamples/2) ) / std::int64_t(nSamples) );
+    }
+    else
+    {
+      T sum{};
+      for ( std::size_t s = 0; s < nSamples; ++s )
+        sum += samples[s];
+      return sum / T(nSamples);
+    }
+  }
+
+} // namespace detail
+
+
+/// Draws a triangle with a flat color and depth z into a multisampled
+/// framebuffer. The depth test works as for the drawTriangle() overloads
+/// in drawing.hpp, but per sample.
+template <typename T, typename Coord, typename Color>
+void drawTriangle( MsaaMat<T> & img,
+                   Vec<Coord,2> A,
+                   Vec<Coord,2> B,
+                   Vec<Coord,2> C,
+                   Color color,
+                   MsaaMat<Coord> & zBuffer,
+                   Coord maxZ,
+                   Coord z )
+{
+  detail::drawTriangleMsaa( img, zBuffer,
+      { 0, 0, std::ptrdiff_t(img.getNCols()), std::ptrdiff_t(img.getNRows()) },
+      A, B, C, T(color), maxZ, z );
+}
+
+
+template <typename T, typename Coord, typename Color>
+void drawTriangle( ScissoredImage<MsaaMat<T>> & img,
+                   Vec<Coord,2> A,
+                   Vec<Coord,2> B,
+                   Vec<Coord,2> C,
+                   Color color,
+                   ScissoredImage<MsaaMat<Coord>> & zBuffer,
+                   Coord maxZ,
+                   Coord z )
+{
+  detail::drawTriangleMsaa( img.getImage(), zBuffer.getImage(),
+      intersect( img.getRect(), zBuffer.getRect() ),
+      A, B, C, T(color), maxZ, z );
+}
+
+
+template <typename T>
+void clear( MsaaMat<T> & img, const T & value )
+{
+  img.fill( value );
+}
+
+
+template <typename T>
+void clear( MsaaMat<T> & img, const T & value, JobSystem & )
+{
+  // Compressing all tiles leaves little to parallelize.
+  img.fill( value );
+}
+
+
+/// Clears the rectangle. Tiles inside it are compressed. The samples of
+/// pixels in expanded tiles at its border are set individually.
+template <typename T>
+void clear( ScissoredImage<MsaaMat<T>> & scissored, const T & value, JobSystem & jobSystem )
+{
+  auto & img = scissored.getImage();
+  const auto & rect = scissored.getRect();
+  if ( rect.isEmpty() )
+    return;
+  constexpr auto tileSize = MsaaMat<T>::tileSize;
+  const auto nSamples = img.getNSamples();
+  const auto firstTileRow = std::size_t(rect.top) / tileSize;
+  const auto endTileRow = ( std::size_t(rect.bottom) + tileSize - 1 ) / tileSize;
+  const auto firstTileCol = std::size_t(rect.left) / tileSize;
+  const auto endTileCol = ( std::size_t(rect.right) + tileSize - 1 ) / tileSize;
+  jobSystem.parallelFor( "clear", endTileRow - firstTileRow, 1,
+                         [&]( std::size_t begin, std::size_t end )
+  {
+    for ( auto tr = firstTileRow + begin; tr < firstTileRow + end; ++tr )
+      for ( auto tc = firstTileCol; tc < endTileCol; ++tc )
+      {
+        const auto tile = tr * img.getNTileCols() + tc;
+        const auto top = std::max( std::ptrdiff_t(tr*tileSize), rect.top );
+        const auto bottom = std::min( std::ptrdiff_t((tr+1)*tileSize), rect.bottom );
+        const auto left = std::max( std::ptrdiff_t(tc*tileSize), rect.left );
+        const auto right = std::min( std::ptrdiff_t((tc+1)*tileSize), rect.right );
+        if ( bottom - top == std::ptrdiff_t(tileSize) &&
+             right - left == std::ptrdiff_t(tileSize) )
+        {
+          img.fillTiles( tile, tile+1, value );
+          continue;
+        }
+        for ( auto row = top; row < bottom; ++row )
+          for ( auto col = left; col < right; ++col )
+          {
+            const auto pixel = img.getPixelIndex( row, col );
+            if ( img.isCompressed( tile ) )
+              img.getPixelData( tile )[pixel] = value;
+            else
+              std::fill_n( img.getSampleData( tile ) + pixel*nSamples,
+                           nSamples, value );
+          }
+      }
+  } );
+}
+
+
+/// Averages the samples of the pixels inside rect and writes them to dst,
+/// which can be any image with the interface of Mat<T>, e.g. a TiledMat<T>.
+/// Compressed tiles are simply copied. Every job resolves a band of rows.
+template <typename T, typename Image>
+void resolve( const MsaaMat<T> & src,
+              Image & dst,
+              const PixelRect & rect,
+              JobSystem & jobSystem )
+{
+  assert( src.getNRows() == dst.getNRows() );
+  assert( src.getNCols() == dst.getNCols() );
+  const auto clipped = intersect( rect, { 0, 0, std::ptrdiff_t(src.getNCols()),
+                                                std::ptrdiff_t(src.getNRows()) } );
+  if ( clipped.isEmpty() )
+    return;
+  const auto nSamples = src.getNSamples();
+  jobSystem.parallelFor( "resolve", std::size_t(clipped.bottom - clipped.top),
+                         MsaaMat<T>::tileSize,
+                         [&]( std::size_t begin, std::size_t end )
+  {
+    for ( auto row = clipped.top + std::ptrdiff_t(begin);
+          row < clipped.top + std::ptrdiff_t(end); ++row )
+    {
+      auto dstRow = dst[row];
+      for ( auto col = clipped.left; col < clipped.right; ++col )
+      {
+        const auto tile = src.getTileIndex( row, col );
+        const auto pixel = src.getPixelIndex( row, col );
+        dstRow[col] = src.isCompressed( tile )
+            ? src.getPixelData( tile )[pixel]
+            : detail::averageSamples( src.getSampleData( tile ) + pixel*nSamples,
+                                      nSamples );
+      }
+    }
+  } );
+}
+
+
+template <typename T, typename Image>
+void resolve( const MsaaMat<T> & src, Image & dst, JobSystem & jobSystem )
+{
+  resolve( src, dst, { 0, 0, std::ptrdiff_t(src.getNCols()),
+                             std::ptrdiff_t(src.getNRows()) }, jobSystem );
+}
+
+} // namespace cu
@@ -0,0 +1,237 @@
+#pragma once
+
+#include "fast_trig.hpp"
+#include "mat.hpp"
+#include "trafo_mats.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+
+
+namespace cu
+{
+
+/// A quaternion w + v[0]*i + v[1]*j + v[2]*k. Unit quaternions represent
+/// rotations. Composing them takes 16 multiplications instead of the 27 of
+/// 3x3 matrices and they can be interpolated smoothly.
+template <typename T>
+struct Quaternion
+{
+  T w = 1;
+  Vec<T,3> v;
+};
+
+
+namespace detail
+{
+
+  template <typename T>
+  void getSinCos( T angle, T & sine, T & cosine )
+  {
+    sine = std::sin( angle );
+    cosine = std::cos( angle );
+  }
+
+
+  inline void getSinCos( float angle, float & sine, float & cosine )
+  {
+    sinCos( angle, sine, cosine );
+  }
+
+} // namespace detail
+
+
+/// Returns the rotation by angle about the unit vector axis.
+template <typename T>
+Quaternion<T> makeAxisAngleQuaternion( const Vec<T,3> & axis, T angle )
+{
+  T sine, cosine;
+  detail::getSinCos( angle/2, sine, cosine );
+  return { cosine, sine * axis };
+}
+
+
+/// Returns the same rotation as makeRotationMat( v ): about the axis v by
+/// the angle l2Norm( v ).
+template <typename T>
+Quaternion<T> makeRotationQuaternion( const Vec<T,3> & v )
+{
+  const auto angle = l2Norm( v );
+  if ( angle == 0 )
+    return {};
+  return makeAxisAngleQuaternion( v / angle, angle );
+}
+
+
+/// Computes the rotations by angles[i] about the unit vectors axes[i] with
+/// the vectorized sinCos().
+inline void makeAxisAngleQuaternions( const Vec<float,3> * axes,
+                                      const float * angles,
+                                      Quaternion<float> * quaternions,
+                                      std::size_t n )
+{
+  constexpr std::size_t blockSize = 256;
+  float halfAngles[blockSize];
+  float sines[blockSize];
+  float cosines[blockSize];
+  for ( std::size_t begin = 0; begin < n; begin += blockSize )
+  {
+    const auto size = std::min( blockSize, n - begin );
+    for ( std::size_t i = 0; i < size; ++i )
+      halfAngles[i] = 0.5f * angles[begin+i];
+    sinCos( halfAngles, sines, cosines, size );
+    for ( std::size_t i = 0; i < size; ++i )
+      quaternions[begin+i] = { cosines[i], sines[i] * axes[begin+i] };
+  }
+}
+
+
+/// The Hamilton product. As a rotation lhs * rhs first rotates by rhs and
+/// then by lhs, like the product of the matrices.
+template <typename T>
+Quaternion<T> operator*( const Quaternion<T> & lhs, const Quaternion<T> & rhs )
+{
+  return { lhs.w*rhs.w - lhs.v*rhs.v,
+           lhs.w*rhs.v + rhs.w*lhs.v + crossProduct( lhs.v, rhs.v ) };
+}
+
+
+template <typename T>
+Quaternion<T> conjugate( const Quaternion<T> & q )
+{
+  return { q.w, T(-1) * q.v };
+}
+
+
+template <typename T>
+T dot( const Quaternion<T> & lhs, const Quaternion<T> & rhs )
+{
+  return lhs.w*rhs.w + lhs.v*rhs.v;
+}
+
+
+template <typename T>
+Quaternion<T> normalize( const Quaternion<T> & q )
+{
+  const auto factor = 1 / std::sqrt( dot( q, q ) );
+  return { factor * q.w, factor * q.v };
+}
+
+
+/// Rotates p by the unit quaternion q.
+template <typename T>
+Vec<T,3> rotate( const Quaternion<T> & q, const Vec<T,3> & p )
+{
+  const auto t = T(2) * crossProduct( q.v, p );
+  return p + q.w * t + crossProduct( q.v, t );
+}
+
+
+/// Interpolates linearly between the unit quaternions along the shorter arc
+/// and normalizes the result. This is much cheaper than slerp() and close
+/// to it for nearby rotations, but the angular velocity is not constant.
+template <typename T>
+Quaternion<T> nlerp( const Quaternion<T> & a, Quaternion<T> b, T t )
+{
+  if ( dot( a, b ) < 0 )
+    b = { -b.w, T(-1) * b.v };
+  return normalize( Quaternion<T>{ a.w + t*(b.w-a.w), a.v + t*(b.v-a.v) } );
+}
+
+
+/// Interpolates between the unit quaternions along the shorter arc with
+/// constant angular velocity.
+template <typename T>
+Quaternion<T> slerp( const Quaternion<T> & a, Quaternion<T> b, T t )
+{
+  auto cosAngle = dot( a, b );
+  if ( cosAngle < 0 )
+  {
+    b = { -b.w, T(-1) * b.v };
+    cosAngle = -cosAngle;
+  }
+  // For tiny angles the weights below lose precision.
+  if ( cosAngle > T(0.9995) )
+    return nlerp( a, b, t );
+  const auto angle = std::acos( cosAngle );
+  const auto sinAngle = std::sin( angle );
+  const auto wa = std::sin( (1-t)*angle ) / sinAngle;
+  const auto wb = std::sin( t*angle ) / sinAngle;
+  return { wa*a.w + wb*b.w, wa*a.v + wb*b.v };
+}
+
+
+/// Returns the rotation matrix of the unit quaternion q.
+template <typename T>
+Mat<T,3,3> makeRotationMat( const Quaternion<T> & q )
+{
+  const auto & v = q.v;
+  const auto x2 = 2*v[0], y2 = 2*v[1], z2 = 2*v[2];
+  const auto xx = x2*v[0], yy = y2*v[1], zz = z2*v[2];
+  const auto xy = x2*v[1], xz = x2*v[2], yz = y2*v[2];
+  const auto wx = x2*q.w , wy = y2*q.w , wz = z2*q.w ;
+  return { { 1-yy-zz,   xy-wz,   xz+wy },
+           {   xy+wz, 1-xx-zz,   yz-wx },
+           {   xz-wy,   yz+wx, 1-xx-yy } };
+}
+
+
+/// A transformation, which scales uniformly, then rotates and finally
+/// translates. Such transformations are closed under composition, unlike
+/// ones with non-uniform scaling.
+template <typename T>
+struct TrsTransform
+{
+  Vec<T,3> translation;
+  Quaternion<T> rotation;
+  T scale = 1;
+};
+
+
+template <typename T>
+Vec<T,3> transformPoint( const TrsTransform<T> & trs, const Vec<T,3> & p )
+{
+  return trs.translation + trs.scale * rotate( trs.rotation, p );
+}
+
+
+/// Returns the transformation, which applies rhs first and then lhs.
+template <typename T>
+TrsTransform<T> operator*( const TrsTransform<T> & lhs, const TrsTransform<T> & rhs )
+{
+  return { transformPoint( lhs, rhs.translation ),
+           lhs.rotation * rhs.rotation,
+           lhs.scale * rhs.scale };
+}
+
+
+/// Interpolates translation and scale linearly and the rotation with
+/// slerp().
+template <typename T>
+TrsTransform<T> interpolate( const TrsTransform<T> & a, const TrsTransform<T> & b, T t )
+{
+  return { a.translation + t * ( b.translation - a.translation ),
+           slerp( a.rotation, b.rotation, t ),
+           a.scale + t * ( b.scale - a.scale ) };
+}
+
+
+/// Returns the upper three rows of the homogeneous matrix of trs. Use
+/// makeExtendedMat() to get the full 4x4 matrix.
+template <typename T>
+Mat<T,3,4> makeAffineMat( const TrsTransform<T> & trs )
+{
+  const auto rotMat = makeRotationMat( trs.rotation );
+  Mat<T,3,4> result;
+  for ( std::size_t row = 0; row != 3; ++row )
+  {
+    for ( std::size_t col = 0; col != 3; ++col )
+      result[row][col] = trs.scale * rotMat[row][col];
+    result[row][3] = trs.translation[row];
+  }
+  return result;
+}
+
+} // namespace cu
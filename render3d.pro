@@ -7,15 +7,46 @@ TARGET = render3d
 TEMPLATE = app
 
 SOURCES += \
+    differential_fuzz.cpp \
+    frame_writer.cpp \
+    job_system.cpp \
     main.cpp \
-    main_window.cpp
+    main_window.cpp \
+    mesh_io.cpp
+
+# The render server uses futexes.
+linux {
+    SOURCES += render_server.cpp
+    LIBS += -lrt
+}
 
 HEADERS  += \
     main_window.hpp \
+    bounded_queue.hpp \
+    command_buffer.hpp \
+    cube_scene.hpp \
     mat.hpp \
     trafo_mats.hpp \
     vec.hpp \
-    drawing.hpp
+    differential_fuzz.hpp \
+    dirty_region.hpp \
+    drawing.hpp \
+    draw_queue.hpp \
+    fast_trig.hpp \
+    frame_writer.hpp \
+    framebuffer.hpp \
+    instancing.hpp \
+    job_system.hpp \
+    mesh.hpp \
+    mesh_io.hpp \
+    mesh_optimizer.hpp \
+    meshlets.hpp \
+    msaa.hpp \
+    quaternion.hpp \
+    render_server.hpp \
+    resolution_scaling.hpp \
+    shading.hpp \
+    texture.hpp
 
 FORMS += \
     main_window.ui
@@ -0,0 +1,560 @@
+#include "render_server.hpp"
+
+#include "framebuffer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+
+namespace cu
+{
+
+namespace
+{
+
+  constexpr char frameRingMagic[8] = { 'R','3','D','F','R','M','S','\0' };
+  constexpr std::uint32_t frameRingVersion = 1;
+  constexpr std::size_t pageSize = 4096;
+
+
+  std::runtime_error makeSystemError( const std::string & what,
+                                      const std::string & name )
+  {
+    return std::runtime_error( what + " '" + name + "': " + std::strerror(errno) );
+  }
+
+
+  std::uint64_t alignToPage( std::uint64_t size )
+  {
+    return (size + pageSize - 1) / pageSize * pageSize;
+  }
+
+
+  // The futex syscalls operate on the physical page, so they work for
+  // processes mapping the same shared memory at different addresses.
+  void futexWakeAll( const std::atomic<std::uint32_t> & word )
+  {
+    ::syscall( SYS_futex, &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0 );
+  }
+
+
+  void futexWait( const std::atomic<std::uint32_t> & word,
+                  std::uint32_t expected,
+                  std::chrono::nanoseconds timeout )
+  {
+    timespec ts;
+    ts.tv_sec = time_t( timeout.count() / 1000000000 );
+    ts.tv_nsec = long( timeout.count() % 1000000000 );
+    ::syscall( SYS_futex, &word, FUTEX_WAIT, expected, &ts, nullptr, 0 );
+  }
+
+
+  sockaddr_un makeSocketAddress( const std::string & path )
+  {
+    sockaddr_un address;
+    std::memset( &address, 0, sizeof(address) );
+    address.sun_family = AF_UNIX;
+    if ( path.size() >= sizeof(address.sun_path) )
+      throw std::runtime_error( "Socket path too long: '" + path + "'." );
+    std::memcpy( address.sun_path, path.c_str(), path.size() );
+    return address;
+  }
+
+} // namespace
+
+
+std::uint64_t getMonotonicTime()
+{
+  timespec ts;
+  ::clock_gettime( CLOCK_MONOTONIC, &ts );
+  return std::uint64_t(ts.tv_sec) * 1000000000u + std::uint64_t(ts.tv_nsec);
+}
+
+
+// FrameRingWriter
+
+FrameRingWriter::FrameRingWriter( const std::string & name,
+                                  std::size_t width,
+                                  std::size_t height,
+                                  std::size_t nSlots )
+  : name_( name )
+{
+  if ( nSlots < 2 )
+    throw std::runtime_error( "A frame ring needs at least two slots." );
+  const auto slotSize = alignToPage( frameSlotPixelOffset + width*height );
+  const auto slotsOffset = alignToPage( sizeof(FrameRingHeader) );
+  size_ = slotsOffset + nSlots*slotSize;
+
+  const auto fd = ::shm_open( name.c_str(), O_CREAT | O_RDWR | O_CLOEXEC, 0600 );
+  if ( fd < 0 )
+    throw makeSystemError( "Could not create shared memory", name );
+  // Truncating to zero first discards the contents left by a crashed server.
+  if ( ::ftruncate( fd, 0 ) != 0 || ::ftruncate( fd, off_t(size_) ) != 0 )
+  {
+    const auto error = makeSystemError( "Could not resize shared memory", name );
+    ::close( fd );
+    ::shm_unlink( name.c_str() );
+    throw error;
+  }
+  data_ = ::mmap( nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  ::close( fd );
+  if ( data_ == MAP_FAILED )
+  {
+    const auto error = makeSystemError( "Could not map shared memory", name );
+    ::shm_unlink( name.c_str() );
+    throw error;
+  }
+
+  header_ = new (data_) FrameRingHeader();
+  header_->version = frameRingVersion;
+  header_->nSlots = std::uint32_t(nSlots);
+  header_->width = std::uint32_t(width);
+  header_->height = std::uint32_t(height);
+  header_->slotSize = slotSize;
+  header_->slotsOffset = slotsOffset;
+  for ( std::size_t i = 0; i < nSlots; ++i )
+    new (getSlot( i )) FrameSlotHeader();
+  // Readers check the magic, so set it last.
+  std::atomic_thread_fence( std::memory_order_release );
+  std::memcpy( header_->magic, frameRingMagic, sizeof(frameRingMagic) );
+}
+
+
+FrameRingWriter::~FrameRingWriter()
+{
+  ::munmap( data_, size_ );
+  ::shm_unlink( name_.c_str() );
+}
+
+
+FrameSlotHeader * FrameRingWriter::getSlot( std::uint64_t frameIndex ) const
+{
+  return reinterpret_cast<FrameSlotHeader*>(
+      static_cast<char*>( data_ ) + header_->slotsOffset +
+      frameIndex % header_->nSlots * header_->slotSize );
+}
+
+
+std::uint8_t * FrameRingWriter::beginFrame()
+{
+  auto slot = getSlot( nextFrame_ );
+  const auto sequence = slot->sequence.load( std::memory_order_relaxed );
+  slot->sequence.store( sequence+1, std::memory_order_relaxed );
+  // The odd sequence must be visible before any pixel changes.
+  std::atomic_thread_fence( std::memory_order_release );
+  return reinterpret_cast<std::uint8_t*>( slot ) + frameSlotPixelOffset;
+}
+
+
+void FrameRingWriter::endFrame( std::uint64_t updateId, std::uint64_t updateTime )
+{
+  auto slot = getSlot( nextFrame_ );
+  slot->frameIndex.store( nextFrame_, std::memory_order_relaxed );
+  slot->updateId.store( updateId, std::memory_order_relaxed );
+  slot->updateTime.store( updateTime, std::memory_order_relaxed );
+  slot->publishTime.store( getMonotonicTime(), std::memory_order_relaxed );
+  slot->sequence.store( slot->sequence.load( std::memory_order_relaxed ) + 1,
+                        std::memory_order_release );
+  header_->nFrames.store( ++nextFrame_, std::memory_order_release );
+  header_->frameCounter.fetch_add( 1, std::memory_order_release );
+  futexWakeAll( header_->frameCounter );
+}
+
+
+// FrameRingReader
+
+FrameRingReader::FrameRingReader( const std::string & name )
+{
+  const auto fd = ::shm_open( name.c_str(), O_RDONLY | O_CLOEXEC, 0 );
+  if ( fd < 0 )
+    throw makeSystemError( "Could not open shared memory", name );
+  struct stat status;
+  if ( ::fstat( fd, &status ) != 0 )
+  {
+    const auto error = makeSystemError( "Could not stat shared memory", name );
+    ::close( fd );
+    throw error;
+  }
+  size_ = std::size_t(status.st_size);
+  if ( size_ < sizeof(FrameRingHeader) )
+  {
+    ::close( fd );
+    throw std::runtime_error( "Not a frame ring: '" + name + "'." );
+  }
+  data_ = ::mmap( nullptr, size_, PROT_READ, MAP_SHARED, fd, 0 );
+  ::close( fd );
+  if ( data_ == MAP_FAILED )
+    throw makeSystemError( "Could not map shared memory", name );
+  header_ = static_cast<const FrameRingHeader*>( data_ );
+
+  const auto fail = [&]( const std::string & what )
+  {
+    ::munmap( data_, size_ );
+    throw std::runtime_error( what + ": '" + name + "'." );
+  };
+  if ( std::memcmp( header_->magic, frameRingMagic, sizeof(frameRingMagic) ) != 0 )
+    fail( "Not a frame ring" );
+  std::atomic_thread_fence( std::memory_order_acquire );
+  if ( header_->version != frameRingVersion )
+    fail( "Unsupported frame ring version" );
+  if ( header_->slotSize < frameSlotPixelOffset + std::uint64_t(header_->width)*header_->height ||
+       header_->slotsOffset < sizeof(FrameRingHeader) ||
+       header_->slotsOffset + std::uint64_t(header_->nSlots)*header_->slotSize > size_ ||
+       header_->nSlots == 0 )
+    fail( "Corrupt frame ring" );
+}
+
+
+FrameRingReader::~FrameRingReader()
+{
+  ::munmap( data_, size_ );
+}
+
+
+std::uint64_t FrameRingReader::getNFrames() const
+{
+  return header_->nFrames.load( std::memory_order_acquire );
+}
+
+
+bool FrameRingReader::waitForFrame( std::uint64_t nFrames, int timeoutMs ) const
+{
+  const auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds( timeoutMs );
+  for (;;)
+  {
+    // Read the counter first, so a frame published in between makes the
+    // futex return immediately.
+    const auto counter = header_->frameCounter.load( std::memory_order_acquire );
+    if ( getNFrames() > nFrames )
+      return true;
+    const auto now = std::chrono::steady_clock::now();
+    if ( now >= deadline )
+      return false;
+    futexWait( header_->frameCounter, counter, deadline - now );
+  }
+}
+
+
+bool FrameRingReader::acquireLatest( Frame & frame ) const
+{
+  // The writer may overtake a slow reader. Then retry with the newer frame.
+  for ( int attempt = 0; attempt < 4; ++attempt )
+  {
+    const auto nFrames = getNFrames();
+    if ( nFrames == 0 )
+      return false;
+    const auto frameIndex = nFrames - 1;
+    const auto slot = reinterpret_cast<const FrameSlotHeader*>(
+        static_cast<const char*>( data_ ) + header_->slotsOffset +
+        frameIndex % header_->nSlots * header_->slotSize );
+    frame.slot = slot;
+    frame.sequence = slot->sequence.load( std::memory_order_acquire );
+    if ( frame.sequence % 2 != 0 )
+      continue;
+    frame.frameIndex = slot->frameIndex.load( std::memory_order_relaxed );
+    frame.updateId = slot->updateId.load( std::memory_order_relaxed );
+    frame.updateTime = slot->updateTime.load( std::memory_order_relaxed );
+    frame.publishTime = slot->publishTime.load( std::memory_order_relaxed );
+    frame.pixels = reinterpret_cast<const std::uint8_t*>( slot ) + frameSlotPixelOffset;
+    if ( frame.frameIndex == frameIndex && isValid( frame ) )
+      return true;
+  }
+  return false;
+}
+
+
+bool FrameRingReader::isValid( const Frame & frame ) const
+{
+  std::atomic_thread_fence( std::memory_order_acquire );
+  return frame.slot->sequence.load( std::memory_order_relaxed ) == frame.sequence;
+}
+
+
+// RenderServer
+
+struct RenderServer::Impl
+{
+  struct Client
+  {
+    int fd;
+    std::vector<char> buffer;
+  };
+
+  std::string socketPath;
+  int listenFd = -1;
+  std::vector<Client> clients;
+  FrameRingWriter frameRing;
+  JobSystem & jobSystem;
+  Mesh<float> cube = makeCubeMesh<float>();
+  CommandExecutor executor{ jobSystem, { cube } };
+  TiledMat<unsigned char> colorBuffer;
+  TiledMat<float> zBuffer;
+  CommandBuffer commands;
+  CubeScene scene;
+  std::uint64_t updateId = 0;
+  std::uint64_t updateTime = 0;
+
+  Impl( const std::string & socketPath_,
+        const std::string & frameRingName,
+        std::size_t width,
+        std::size_t height,
+        JobSystem & jobSystem_ )
+    : socketPath( socketPath_ )
+    , frameRing( frameRingName, width, height )
+    , jobSystem( jobSystem_ )
+    , colorBuffer( height, width )
+    , zBuffer( height, width )
+  {}
+
+  /// Handles the complete messages in the buffer of the client. Returns
+  /// true, if one of them asks for shutdown.
+  bool handleMessages( Client & client, bool & sceneChanged );
+  void renderFrame();
+};
+
+
+bool RenderServer::Impl::handleMessages( Client & client, bool & sceneChanged )
+{
+  bool shutdown = false;
+  std::size_t pos = 0;
+  for ( ; pos + sizeof(SceneUpdateMessage) <= client.buffer.size();
+        pos += sizeof(SceneUpdateMessage) )
+  {
+    SceneUpdateMessage message;
+    std::memcpy( &message, &client.buffer[pos], sizeof(message) );
+    if ( message.type == SceneUpdateMessage::Shutdown )
+      shutdown = true;
+    else if ( message.type == SceneUpdateMessage::Update )
+    {
+      scene.angle = message.angle;
+      scene.pitch = message.pitch;
+      scene.distance = message.distance;
+      scene.color = std::uint8_t( std::min<std::uint32_t>( message.color, 0xFF ) );
+      updateId = message.updateId;
+      updateTime = message.sendTime;
+      sceneChanged = true;
+    }
+  }
+  client.buffer.erase( client.buffer.begin(), client.buffer.begin() + pos );
+  return shutdown;
+}
+
+
+/// Renders the scene and resolves it directly into the next slot of the
+/// frame ring.
+void RenderServer::Impl::renderFrame()
+{
+  commands.reset();
+  scene.record( commands, colorBuffer.getNCols(), colorBuffer.getNRows() );
+  executor.execute( &commands, 1, colorBuffer, zBuffer, CubeScene::getLighting() );
+
+  const auto pixels = frameRing.beginFrame();
+  const auto nRows = colorBuffer.getNRows();
+  const auto nCols = colorBuffer.getNCols();
+  constexpr auto tileSize = TiledMat<unsigned char>::tileSize;
+  jobSystem.parallelFor( "resolve", colorBuffer.getNTileRows(), 4,
+                         [&]( std::size_t begin, std::size_t end )
+  {
+    const auto endRow = std::min( end*tileSize, nRows );
+    for ( auto row = begin*tileSize; row < endRow; ++row )
+      detail::resolveRow( colorBuffer, pixels + row*nCols, row );
+  } );
+  frameRing.endFrame( updateId, updateTime );
+}
+
+
+RenderServer::RenderServer( const std::string & socketPath,
+                            const std::string & frameRingName,
+                            std::size_t width,
+                            std::size_t height,
+                            JobSystem & jobSystem )
+  : m( std::make_unique<Impl>( socketPath, frameRingName, width, height, jobSystem ) )
+{
+  const auto address = makeSocketAddress( socketPath );
+  m->listenFd = ::socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if ( m->listenFd < 0 )
+    throw makeSystemError( "Could not create socket", socketPath );
+  // Remove the socket of a previous server, which has not shut down cleanly.
+  ::unlink( socketPath.c_str() );
+  if ( ::bind( m->listenFd, reinterpret_cast<const sockaddr*>( &address ),
+               sizeof(address) ) != 0 ||
+       ::listen( m->listenFd, 16 ) != 0 )
+  {
+    const auto error = makeSystemError( "Could not listen on socket", socketPath );
+    ::close( m->listenFd );
+    throw error;
+  }
+}
+
+
+RenderServer::~RenderServer()
+{
+  for ( const auto & client : m->clients )
+    ::close( client.fd );
+  ::close( m->listenFd );
+  ::unlink( m->socketPath.c_str() );
+}
+
+
+void RenderServer::run()
+{
+  // Clients find a frame as soon as the ring exists.
+  m->renderFrame();
+  std::vector<pollfd> fds;
+  for ( bool shutdown = false; !shutdown; )
+  {
+    fds.clear();
+    fds.push_back( { m->listenFd, POLLIN, 0 } );
+    for ( const auto & client : m->clients )
+      fds.push_back( { client.fd, POLLIN, 0 } );
+    if ( ::poll( fds.data(), fds.size(), -1 ) < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      throw makeSystemError( "Could not poll socket", m->socketPath );
+    }
+
+    // Handle everything which has arrived, before rendering the latest
+    // state once.
+    bool sceneChanged = false;
+    for ( std::size_t i = fds.size()-1; i > 0; --i )
+    {
+      if ( fds[i].revents == 0 )
+        continue;
+      auto & client = m->clients[i-1];
+      char buffer[4096];
+      const auto nRead = ::recv( client.fd, buffer, sizeof(buffer), 0 );
+      if ( nRead <= 0 )
+      {
+        ::close( client.fd );
+        m->clients.erase( m->clients.begin() + std::ptrdiff_t(i-1) );
+        continue;
+      }
+      client.buffer.insert( client.buffer.end(), buffer, buffer + nRead );
+      shutdown = m->handleMessages( client, sceneChanged ) || shutdown;
+    }
+    if ( fds[0].revents & POLLIN )
+    {
+      const auto fd = ::accept4( m->listenFd, nullptr, nullptr, SOCK_CLOEXEC );
+      if ( fd >= 0 )
+        m->clients.push_back( { fd, {} } );
+    }
+    if ( sceneChanged )
+      m->renderFrame();
+  }
+}
+
+
+// RenderClient
+
+RenderClient::RenderClient( const std::string & socketPath )
+{
+  const auto address = makeSocketAddress( socketPath );
+  fd_ = ::socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+  if ( fd_ < 0 )
+    throw makeSystemError( "Could not create socket", socketPath );
+  if ( ::connect( fd_, reinterpret_cast<const sockaddr*>( &address ),
+                  sizeof(address) ) != 0 )
+  {
+    const auto error = makeSystemError( "Could not connect to", socketPath );
+    ::close( fd_ );
+    throw error;
+  }
+}
+
+
+RenderClient::~RenderClient()
+{
+  ::close( fd_ );
+}
+
+
+void RenderClient::send( const SceneUpdateMessage & message )
+{
+  const auto data = reinterpret_cast<const char*>( &message );
+  for ( std::size_t pos = 0; pos < sizeof(message); )
+  {
+    const auto nSent = ::send( fd_, data + pos, sizeof(message) - pos, MSG_NOSIGNAL );
+    if ( nSent < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      throw std::runtime_error( std::string( "Could not send scene update: " ) +
+                                std::strerror(errno) );
+    }
+    pos += std::size_t(nSent);
+  }
+}
+
+
+int runLatencyClient( const std::string & socketPath,
+                      const std::string & frameRingName,
+                      std::size_t nFrames,
+                      std::ostream & out )
+{
+  RenderClient client( socketPath );
+  FrameRingReader frameRing( frameRingName );
+  std::vector<double> latencies;
+  std::uint64_t checksum = 0;
+  for ( std::size_t i = 0; i < nFrames; ++i )
+  {
+    const auto updateId = std::uint64_t(i+1);
+    auto nSeen = frameRing.getNFrames();
+    client.send( { SceneUpdateMessage::Update, 0.01f*i, -0.3f, 6.f, 0xFF,
+                   updateId, getMonotonicTime() } );
+    for (;;)
+    {
+      if ( !frameRing.waitForFrame( nSeen, 1000 ) )
+      {
+        out << "Timeout waiting for frame of update " << updateId << "." << std::endl;
+        return 1;
+      }
+      FrameRingReader::Frame frame;
+      if ( !frameRing.acquireLatest( frame ) )
+        continue;
+      nSeen = frame.frameIndex + 1;
+      if ( frame.updateId < updateId )
+        continue;
+      // Read the frame in place like a consumer would.
+      std::uint64_t sum = 0;
+      for ( std::size_t p = 0; p < frameRing.getWidth()*frameRing.getHeight(); ++p )
+        sum += frame.pixels[p];
+      if ( !frameRing.isValid( frame ) )
+        continue;
+      checksum += sum;
+      latencies.push_back( double( getMonotonicTime() - frame.updateTime ) * 1e-3 );
+      break;
+    }
+  }
+  if ( latencies.empty() )
+    return 0;
+  std::sort( latencies.begin(), latencies.end() );
+  const auto percentile = [&]( double p )
+  { return latencies[std::size_t( p * double(latencies.size()-1) + 0.5 )]; };
+  out << latencies.size() << " frames of " << frameRing.getWidth() << "x"
+      << frameRing.getHeight() << " pixels, latency in microseconds: min "
+      << latencies.front() << ", median " << percentile( 0.5 ) << ", 99% "
+      << percentile( 0.99 ) << ", max " << latencies.back()
+      << " (checksum " << checksum << ")" << std::endl;
+  return 0;
+}
+
+} // namespace cu
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "cube_scene.hpp"
+#include "job_system.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <ostream>
+#include <string>
+
+
+namespace cu
+{
+
+/// The header at the start of the shared memory of a frame ring. It is
+/// followed by nSlots slots of slotSize bytes each. A slot starts with a
+/// FrameSlotHeader and its 8 bit gray pixels follow at frameSlotPixelOffset
+/// row by row without padding.
+struct FrameRingHeader
+{
+  char magic[8];
+  std::uint32_t version;
+  std::uint32_t nSlots;
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint64_t slotSize;
+  std::uint64_t slotsOffset;
+  /// Incremented whenever a frame has been published. Readers wait for it
+  /// to change with a futex, which works across processes.
+  std::atomic<std::uint32_t> frameCounter;
+  /// The index of the latest published frame plus one, 0 before the first.
+  std::atomic<std::uint64_t> nFrames;
+};
+
+
+/// A slot is protected by a sequence lock. sequence is odd while the slot is
+/// being written. Readers check that it is even and unchanged after they
+/// have read the slot. All timestamps are in nanoseconds of the monotonic
+/// clock, which is shared by all processes on the machine.
+struct FrameSlotHeader
+{
+  std::atomic<std::uint64_t> sequence;
+  std::atomic<std::uint64_t> frameIndex;
+  /// The id of the latest scene update contained in the frame.
+  std::atomic<std::uint64_t> updateId;
+  /// When the client sent that update.
+  std::atomic<std::uint64_t> updateTime;
+  /// When the frame was published.
+  std::atomic<std::uint64_t> publishTime;
+};
+
+constexpr std::size_t frameSlotPixelOffset = 64;
+
+static_assert( std::atomic<std::uint32_t>::is_always_lock_free &&
+               std::atomic<std::uint64_t>::is_always_lock_free,
+               "Atomics in shared memory must be lock free." );
+
+
+/// Nanoseconds of CLOCK_MONOTONIC.
+std::uint64_t getMonotonicTime();
+
+
+/// Creates a ring of frames in POSIX shared memory and publishes frames in
+/// it. The shared memory object is removed again by the destructor. Throws
+/// std::runtime_error, if it cannot be created.
+class FrameRingWriter
+{
+public:
+  FrameRingWriter( const std::string & name,
+                   std::size_t width,
+                   std::size_t height,
+                   std::size_t nSlots = 4 );
+  ~FrameRingWriter();
+
+  FrameRingWriter( const FrameRingWriter & ) = delete;
+  FrameRingWriter & operator=( const FrameRingWriter & ) = delete;
+
+  std::size_t getWidth() const { return header_->width; }
+  std::size_t getHeight() const { return header_->height; }
+
+  /// Returns the pixels of the next slot. Readers ignore the slot until
+  /// endFrame() has been called.
+  std::uint8_t * beginFrame();
+
+  /// Publishes the frame and wakes up all waiting readers.
+  void endFrame( std::uint64_t updateId, std::uint64_t updateTime );
+
+private:
+  FrameSlotHeader * getSlot( std::uint64_t frameIndex ) const;
+
+  std::string name_;
+  void * data_ = nullptr;
+  std::size_t size_ = 0;
+  FrameRingHeader * header_ = nullptr;
+  std::uint64_t nextFrame_ = 0;
+};
+
+
+/// Maps the frame ring of a FrameRingWriter, possibly in another process,
+/// read-only. Frames are read in place without copying them.
+class FrameRingReader
+{
+public:
+  struct Frame
+  {
+    const std::uint8_t * pixels = nullptr;
+    std::uint64_t frameIndex = 0;
+    std::uint64_t updateId = 0;
+    std::uint64_t updateTime = 0;
+    std::uint64_t publishTime = 0;
+    std::uint64_t sequence = 0;
+    const FrameSlotHeader * slot = nullptr;
+  };
+
+  /// Throws std::runtime_error, if the ring does not exist or is invalid.
+  explicit FrameRingReader( const std::string & name );
+  ~FrameRingReader();
+
+  FrameRingReader( const FrameRingReader & ) = delete;
+  FrameRingReader & operator=( const FrameRingReader & ) = delete;
+
+  std::size_t getWidth() const { return header_->width; }
+  std::size_t getHeight() const { return header_->height; }
+
+  /// Returns the number of frames published so far.
+  std::uint64_t getNFrames() const;
+
+  /// Blocks until more than nFrames frames have been published or the
+  /// timeout in milliseconds has passed. Returns false on timeout.
+  bool waitForFrame( std::uint64_t nFrames, int timeoutMs ) const;
+
+  /// Gets the latest frame. Returns false, if there is none yet or the
+  /// writer is just overwriting it.
+  bool acquireLatest( Frame & frame ) const;
+
+  /// Returns true, if the frame has not been touched by the writer since it
+  /// has been acquired. Check this after reading the pixels. If it fails,
+  /// the pixels may be torn.
+  bool isValid( const Frame & frame ) const;
+
+private:
+  void * data_ = nullptr;
+  std::size_t size_ = 0;
+  const FrameRingHeader * header_ = nullptr;
+};
+
+
+/// The messages clients send to a render server over its Unix domain
+/// socket. Every message is sent as these bytes in the byte order of the
+/// machine.
+struct SceneUpdateMessage
+{
+  enum Type : std::uint32_t { Update = 1, Shutdown = 2 };
+
+  std::uint32_t type;
+  float angle;
+  float pitch;
+  float distance;
+  std::uint32_t color;
+  std::uint64_t updateId;
+  /// getMonotonicTime() when the message was sent
+  std::uint64_t sendTime;
+};
+
+static_assert( sizeof(SceneUpdateMessage) == 40,
+               "The message layout is part of the protocol." );
+
+
+/// Renders the cube scene without a window. It applies scene updates
+/// received over a Unix domain socket and publishes every rendered frame
+/// in a FrameRingWriter. Updates arriving while a frame is rendered are
+/// coalesced, so the next frame always shows the latest state.
+class RenderServer
+{
+public:
+  /// Throws std::runtime_error, if the socket or the frame ring cannot be
+  /// created.
+  RenderServer( const std::string & socketPath,
+                const std::string & frameRingName,
+                std::size_t width,
+                std::size_t height,
+                JobSystem & jobSystem );
+  ~RenderServer();
+
+  RenderServer( const RenderServer & ) = delete;
+  RenderServer & operator=( const RenderServer & ) = delete;
+
+  /// Serves clients until one of them sends a shutdown message.
+  void run();
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> m;
+};
+
+
+/// A connection to a render server for sending messages. Throws
+/// std::runtime_error on failure.
+class RenderClient
+{
+public:
+  explicit RenderClient( const std::string & socketPath );
+  ~RenderClient();
+
+  RenderClient( const RenderClient & ) = delete;
+  RenderClient & operator=( const RenderClient & ) = delete;
+
+  void send( const SceneUpdateMessage & message );
+
+private:
+  int fd_ = -1;
+};
+
+
+/// Sends nFrames scene updates one after another. After each one it waits
+/// for the frame containing it and records the time from sending the update
+/// until the frame can be read. Prints statistics of these latencies and
+/// returns 0 on success.
+int runLatencyClient( const std::string & socketPath,
+                      const std::string & frameRingName,
+                      std::size_t nFrames,
+                      std::ostream & out );
+
+} // namespace cu
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "drawing.hpp"
+#include "job_system.hpp"
+#include "mat.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+
+namespace cu
+{
+
+/// Chooses the render resolution, so that frames take about as long as
+/// the frame time budget. The cost of a frame is assumed to be proportional
+/// to the number of pixels, i.e. to the square of the scale. The cost per
+/// pixel is smoothed over several frames, so single slow frames do not make
+/// the resolution jump. Scales are multiples of scaleStep and increase more
+/// reluctantly than they decrease, so the resolution does not oscillate.
+class ResolutionController
+{
+public:
+  static constexpr double scaleStep = 1. / 32;
+
+  /// The budget is in seconds.
+  explicit ResolutionController( double frameTimeBudget,
+                                 double minScale = 0.25,
+                                 double maxScale = 1 )
+    : frameTimeBudget_(frameTimeBudget)
+    , minScale_(minScale)
+    , maxScale_(maxScale)
+    , scale_(maxScale)
+  {
+    assert( 0 < minScale && minScale <= maxScale );
+  }
+
+  /// Takes the time in seconds, which the last frame rendered at getScale()
+  /// has taken, and returns the scale for the next frame.
+  double update( double frameTime )
+  {
+    const auto costPerArea = frameTime / ( scale_ * scale_ );
+    smoothedCostPerArea_ = smoothedCostPerArea_ == 0
+        ? costPerArea
+        : 0.8 * smoothedCostPerArea_ + 0.2 * costPerArea;
+    if ( smoothedCostPerArea_ <= 0 )
+      return scale_;
+    // Leave some headroom for the rest of the frame.
+    auto target = std::sqrt( 0.9 * frameTimeBudget_ / smoothedCostPerArea_ );
+    target = std::floor( target / scaleStep ) * scaleStep;
+    target = std::min( std::max( target, minScale_ ), maxScale_ );
+    if ( target < scale_ || target >= scale_ + 2*scaleStep || target == maxScale_ )
+      scale_ = target;
+    return scale_;
+  }
+
+  double getScale() const { return scale_; }
+  double getFrameTimeBudget() const { return frameTimeBudget_; }
+
+private:
+  double frameTimeBudget_;
+  double minScale_;
+  double maxScale_;
+  double scale_;
+  double smoothedCostPerArea_ = 0;
+};
+
+
+/// Returns the size of an image scaled by the given factor, but at least 1.
+inline std::size_t getScaledSize( std::size_t size, double scale )
+{
+  return std::max<std::size_t>( 1, std::size_t( std::lround( size * scale ) ) );
+}
+
+
+/// Returns the rectangle of an image of dstRows x dstCols pixels, which
+/// depends on the given rectangle of an image of srcRows x srcCols pixels
+/// after upscaleBilinear().
+inline PixelRect getUpscaledRect( const PixelRect & rect,
+                                  std::size_t srcRows, std::size_t srcCols,
+                                  std::size_t dstRows, std::size_t dstCols )
+{
+  if ( rect.isEmpty() )
+    return {};
+  const auto scale = []( std::ptrdiff_t v, std::size_t src, std::size_t dst )
+  {
+    return v * std::ptrdiff_t(dst) / std::ptrdiff_t(src);
+  };
+  // Every destination pixel mixes two neighbouring source pixels.
+  return intersect(
+      { scale( rect.left-1, srcCols, dstCols ), scale( rect.top-1, srcRows, dstRows ),
+        scale( rect.right+1, srcCols, dstCols ) + 1,
+        scale( rect.bottom+1, srcRows, dstRows ) + 1 },
+      { 0, 0, std::ptrdiff_t(dstCols), std::ptrdiff_t(dstRows) } );
+}
+
+
+namespace detail
+{
+
+  /// The source pixels and the 8 bit weight of the second one for every
+  /// destination pixel along one axis. Pixel centers are aligned, i.e.
+  /// destination pixel x samples the source at (x+0.5)*src/dst-0.5.
+  struct BilinearTaps
+  {
+    std::size_t src = 0;
+    std::vector<std::uint32_t> first;
+    std::vector<std::uint32_t> second;
+    std::vector<std::uint16_t> weight;
+
+    BilinearTaps() = default;
+
+    BilinearTaps( std::size_t src_, std::size_t dst )
+      : src(src_), first(dst), second(dst), weight(dst)
+    {
+      // 16.16 fixed point
+      const auto step = ( std::int64_t(src) << 16 ) / std::int64_t(dst);
+      for ( std::size_t i = 0; i < dst; ++i )
+      {
+        const auto pos = std::max<std::int64_t>(
+            0, ( ( 2*std::int64_t(i) + 1 ) * step >> 1 ) - ( 1 << 15 ) );
+        first[i] = std::uint32_t( std::min<std::int64_t>( pos >> 16, src-1 ) );
+        second[i] = std::min<std::uint32_t>( first[i]+1, std::uint32_t(src-1) );
+        weight[i] = first[i] == second[i] ? 0 : std::uint16_t( ( pos >> 8 ) & 0xFF );
+      }
+    }
+
+    bool isFor( std::size_t src_, std::size_t dst ) const
+    {
+      return src == src_ && first.size() == dst;
+    }
+  };
+
+
+  /// Computes the columns [left,right) of one destination row. The vertical
+  /// pass blends two whole source rows and the horizontal pass gathers from
+  /// the blended row. Both are simple loops over integers, which compilers
+  /// vectorize.
+  inline void upscaleBilinearRow( const std::uint8_t * srcRow0,
+                                  const std::uint8_t * srcRow1,
+                                  std::uint16_t rowWeight,
+                                  const BilinearTaps & colTaps,
+                                  std::size_t srcBegin,
+                                  std::size_t srcEnd,
+                                  std::uint16_t * blended,
+                                  std::uint8_t * dst,
+                                  std::size_t left,
+                                  std::size_t right )
+  {
+    const std::uint16_t w0 = 256 - rowWeight;
+    const std::uint16_t w1 = rowWeight;
+    for ( auto x = srcBegin; x < srcEnd; ++x )
+      blended[x] = std::uint16_t( srcRow0[x]*w0 + srcRow1[x]*w1 );
+    const auto first = colTaps.first.data();
+    const auto second = colTaps.second.data();
+    const auto weight = colTaps.weight.data();
+    for ( auto x = left; x < right; ++x )
+      dst[x] = std::uint8_t( ( std::uint32_t(blended[first[x]]) * (256u - weight[x]) +
+                               std::uint32_t(blended[second[x]]) * weight[x] +
+                               (1u << 15) ) >> 16 );
+  }
+
+
+  /// The taps must be for the sizes of src and dst.
+  template <typename ForEachRowRange>
+  void upscaleBilinearImpl( const Mat<std::uint8_t> & src,
+                            Mat<std::uint8_t> & dst,
+                            const PixelRect & rect,
+                            const BilinearTaps & rowTaps,
+                            const BilinearTaps & colTaps,
+                            ForEachRowRange && forEachRowRange )
+  {
+    const auto clipped = intersect( rect, { 0, 0, std::ptrdiff_t(dst.getNCols()),
+                                                  std::ptrdiff_t(dst.getNRows()) } );
+    if ( clipped.isEmpty() || src.getNRows() == 0 || src.getNCols() == 0 )
+      return;
+    const auto left = std::size_t(clipped.left);
+    const auto right = std::size_t(clipped.right);
+    const auto srcBegin = colTaps.first[left];
+    const auto srcEnd = colTaps.second[right-1] + 1;
+    const auto srcCols = src.getNCols();
+    const auto dstCols = dst.getNCols();
+    forEachRowRange( std::size_t(clipped.top), std::size_t(clipped.bottom),
+                     [&]( std::size_t begin, std::size_t end )
+    {
+      // Every thread keeps its row buffer, so frames do not allocate.
+      thread_local std::vector<std::uint16_t> blended;
+      if ( blended.size() < srcCols )
+        blended.resize( srcCols );
+      for ( auto y = begin; y < end; ++y )
+        upscaleBilinearRow( src.data() + rowTaps.first[y]*srcCols,
+                            src.data() + rowTaps.second[y]*srcCols,
+                            rowTaps.weight[y], colTaps, srcBegin, srcEnd,
+                            blended.data(), dst.data() + y*dstCols,
+                            left, right );
+    } );
+  }
+
+} // namespace detail
+
+
+/// Scales images with bilinear filtering. Only the pixels of the
+/// destination inside the given rectangle are computed. Interpolation uses
+/// 8 bit fixed point weights. The filter taps are kept for the next call,
+/// as long as the image sizes stay the same.
+class BilinearUpscaler
+{
+public:
+  void upscale( const Mat<std::uint8_t> & src,
+                Mat<std::uint8_t> & dst,
+                const PixelRect & rect )
+  {
+    updateTaps( src, dst );
+    detail::upscaleBilinearImpl( src, dst, rect, rowTaps_, colTaps_,
+        []( std::size_t begin, std::size_t end, auto && f ) { f( begin, end ); } );
+  }
+
+  /// Upscales in parallel. Every job computes a band of rows.
+  void upscale( const Mat<std::uint8_t> & src,
+                Mat<std::uint8_t> & dst,
+                const PixelRect & rect,
+                JobSystem & jobSystem )
+  {
+    updateTaps( src, dst );
+    detail::upscaleBilinearImpl( src, dst, rect, rowTaps_, colTaps_,
+        [&jobSystem]( std::size_t begin, std::size_t end, auto && f )
+    {
+      jobSystem.parallelFor( "upscale", end - begin, 32,
+                             [&]( std::size_t b, std::size_t e )
+      { f( begin + b, begin + e ); } );
+    } );
+  }
+
+private:
+  void updateTaps( const Mat<std::uint8_t> & src, const Mat<std::uint8_t> & dst )
+  {
+    if ( src.getNRows() == 0 || src.getNCols() == 0 ||
+         dst.getNRows() == 0 || dst.getNCols() == 0 )
+      return;
+    if ( !rowTaps_.isFor( src.getNRows(), dst.getNRows() ) )
+      rowTaps_ = detail::BilinearTaps( src.getNRows(), dst.getNRows() );
+    if ( !colTaps_.isFor( src.getNCols(), dst.getNCols() ) )
+      colTaps_ = detail::BilinearTaps( src.getNCols(), dst.getNCols() );
+  }
+
+  detail::BilinearTaps rowTaps_;
+  detail::BilinearTaps colTaps_;
+};
+
+
+/// Scales src to the size of dst with bilinear filtering. Only the pixels of
+/// dst inside rect are computed. Repeated upscaling should use a
+/// BilinearUpscaler instead, which keeps the filter taps.
+inline void upscaleBilinear( const Mat<std::uint8_t> & src,
+                             Mat<std::uint8_t> & dst,
+                             const PixelRect & rect )
+{
+  BilinearUpscaler().upscale( src, dst, rect );
+}
+
+
+inline void upscaleBilinear( const Mat<std::uint8_t> & src,
+                             Mat<std::uint8_t> & dst )
+{
+  upscaleBilinear( src, dst, { 0, 0, std::ptrdiff_t(dst.getNCols()),
+                                     std::ptrdiff_t(dst.getNRows()) } );
+}
+
+
+inline void upscaleBilinear( const Mat<std::uint8_t> & src,
+                             Mat<std::uint8_t> & dst,
+                             const PixelRect & rect,
+                             JobSystem & jobSystem )
+{
+  BilinearUpscaler().upscale( src, dst, rect, jobSystem );
+}
+
+} // namespace cu
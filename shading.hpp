@@ -0,0 +1,372 @@
+#pragma once
+
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <vector>
+
+
+namespace cu
+{
+
+/// A light infinitely far away, e.g. the sun. All vectors are in view space.
+struct DirectionalLight
+{
+  /// points towards the light
+  Vec<float,3> direction;
+  /// red, green and blue intensity
+  Vec<float,3> color{ 1, 1, 1 };
+};
+
+
+/// A light at a point, which becomes weaker with the distance d by the
+/// factor 1 / ( 1 + attenuation * d^2 ).
+struct PointLight
+{
+  Vec<float,3> position;
+  Vec<float,3> color{ 1, 1, 1 };
+  float attenuation = 0;
+};
+
+
+/// How a surface reflects light. The result is ambient plus the sum of the
+/// diffuse and specular reflections of all lights, multiplied by the base
+/// color of the surface.
+struct Material
+{
+  float ambient = 0.2f;
+  float diffuse = 0.8f;
+  float specular = 0;
+  /// the Blinn-Phong exponent
+  float shininess = 32;
+  /// Surfaces facing away from the camera are lit like their front.
+  bool isTwoSided = false;
+};
+
+
+/// Three-dimensional vectors stored as a structure of arrays, so that
+/// consecutive vectors can be processed in parallel lanes.
+struct Vec3Array
+{
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> z;
+
+  std::size_t size() const { return x.size(); }
+
+  void resize( std::size_t n )
+  {
+    x.resize( n );
+    y.resize( n );
+    z.resize( n );
+  }
+
+  void set( std::size_t i, const Vec<float,3> & v )
+  {
+    x[i] = v[0];
+    y[i] = v[1];
+    z[i] = v[2];
+  }
+
+  Vec<float,3> get( std::size_t i ) const
+  {
+    return { x[i], y[i], z[i] };
+  }
+};
+
+
+/// Shades many points at once with Lambert diffuse and Blinn-Phong specular
+/// reflection from any number of directional and point lights. The points
+/// may be vertices or faces. The camera is at the origin of view space.
+///
+/// Everything that only depends on the lights is computed once by
+/// setLights(), typically once per frame. The shading functions then
+/// process blocks of laneCount points. All loops over the lanes of a block
+/// have a fixed length and no branches, so compilers vectorize them.
+/// Specular highlights use Schlick's approximation t / ( s - s*t + t ) of
+/// t^s, which needs a division instead of a call to std::pow().
+class Lighting
+{
+public:
+  static constexpr std::size_t laneCount = 8;
+
+  Lighting() = default;
+
+  Lighting( const std::vector<DirectionalLight> & directionalLights,
+            const std::vector<PointLight> & pointLights,
+            const Material & material )
+  {
+    setLights( directionalLights, pointLights, material );
+  }
+
+  void setLights( const std::vector<DirectionalLight> & directionalLights,
+                  const std::vector<PointLight> & pointLights,
+                  const Material & material )
+  {
+    material_ = material;
+    lights_.clear();
+    for ( const auto & light : directionalLights )
+      lights_.push_back( makeLight( normalize( light.direction ), light.color, 0, 0 ) );
+    for ( const auto & light : pointLights )
+      lights_.push_back( makeLight( light.position, light.color, 1, light.attenuation ) );
+  }
+
+  const Material & getMaterial() const { return material_; }
+
+  /// Computes out[i] = shaded colors[i] for the points i in [begin,end) with
+  /// the given unit normals and positions. The results are gray values.
+  void shadeGray( const Vec3Array & normals,
+                  const Vec3Array & positions,
+                  const std::uint8_t * colors,
+                  std::uint8_t * out,
+                  std::size_t begin,
+                  std::size_t end ) const
+  {
+    for ( auto first = begin; first < end; first += laneCount )
+    {
+      const auto count = std::min( laneCount, end - first );
+      Block<1> block;
+      load( block, normals, positions, first, count );
+      for ( std::size_t lane = 0; lane < count; ++lane )
+        block.base[0][lane] = colors[first+lane];
+      shadeBlock( block );
+      for ( std::size_t lane = 0; lane < count; ++lane )
+        out[first+lane] = block.result[0][lane];
+    }
+  }
+
+  /// Like shadeGray(), but with colors in the format 0xAARRGGBB. Alpha is
+  /// passed through.
+  void shadeArgb( const Vec3Array & normals,
+                  const Vec3Array & positions,
+                  const std::uint32_t * colors,
+                  std::uint32_t * out,
+                  std::size_t begin,
+                  std::size_t end ) const
+  {
+    for ( auto first = begin; first < end; first += laneCount )
+    {
+      const auto count = std::min( laneCount, end - first );
+      Block<3> block;
+      load( block, normals, positions, first, count );
+      for ( std::size_t channel = 0; channel < 3; ++channel )
+        for ( std::size_t lane = 0; lane < count; ++lane )
+          block.base[channel][lane] = ( colors[first+lane] >> ( 16 - 8*channel ) ) & 0xFF;
+      shadeBlock( block );
+      for ( std::size_t lane = 0; lane < count; ++lane )
+        out[first+lane] = ( colors[first+lane] & 0xFF000000u ) |
+                          ( std::uint32_t( block.result[0][lane] ) << 16 ) |
+                          ( std::uint32_t( block.result[1][lane] ) <<  8 ) |
+                            std::uint32_t( block.result[2][lane] );
+    }
+  }
+
+private:
+  /// A light prepared for shading. For directional lights vector is the
+  /// unit direction towards the light and isPoint is 0, for point lights
+  /// vector is the position and isPoint is 1. This avoids branches between
+  /// the kinds of lights.
+  struct Light
+  {
+    Vec<float,3> vector;
+    float isPoint;
+    float attenuation;
+    /// the diffuse and specular intensity per channel, already multiplied
+    /// by the material; for gray output the average over the channels
+    float diffuse[3];
+    float specular[3];
+    float grayDiffuse;
+    float graySpecular;
+  };
+
+  template <std::size_t nChannels>
+  struct Block
+  {
+    float nx[laneCount], ny[laneCount], nz[laneCount];
+    float px[laneCount], py[laneCount], pz[laneCount];
+    float base[nChannels][laneCount] = {};
+    std::int32_t result[nChannels][laneCount];
+  };
+
+  Light makeLight( const Vec<float,3> & vector,
+                   const Vec<float,3> & color,
+                   float isPoint,
+                   float attenuation ) const
+  {
+    Light light{ vector, isPoint, attenuation, {}, {}, 0, 0 };
+    for ( std::size_t channel = 0; channel < 3; ++channel )
+    {
+      light.diffuse[channel] = material_.diffuse * color[channel];
+      light.specular[channel] = material_.specular * color[channel];
+    }
+    light.grayDiffuse = material_.diffuse * ( color[0] + color[1] + color[2] ) / 3;
+    light.graySpecular = material_.specular * ( color[0] + color[1] + color[2] ) / 3;
+    return light;
+  }
+
+  /// Copies up to laneCount points into the block. Unused lanes get a
+  /// harmless point in front of the camera.
+  template <std::size_t nChannels>
+  static void load( Block<nChannels> & block,
+                    const Vec3Array & normals,
+                    const Vec3Array & positions,
+                    std::size_t first,
+                    std::size_t count )
+  {
+    for ( std::size_t lane = 0; lane < laneCount; ++lane )
+    {
+      block.nx[lane] = block.ny[lane] = block.px[lane] = block.py[lane] = 0;
+      block.nz[lane] = 1;
+      block.pz[lane] = -1;
+    }
+    std::copy_n( &normals.x[first], count, block.nx );
+    std::copy_n( &normals.y[first], count, block.ny );
+    std::copy_n( &normals.z[first], count, block.nz );
+    std::copy_n( &positions.x[first], count, block.px );
+    std::copy_n( &positions.y[first], count, block.py );
+    std::copy_n( &positions.z[first], count, block.pz );
+  }
+
+  /// Approximates 1 / sqrt( x ) with a relative error below 1e-5 by the
+  /// well known bit trick and two Newton steps. std::sqrt() may set errno,
+  /// so compilers do not vectorize it by default.
+  static float invSqrt( float x )
+  {
+    std::uint32_t bits;
+    std::memcpy( &bits, &x, sizeof(bits) );
+    bits = 0x5F375A86u - ( bits >> 1 );
+    float y;
+    std::memcpy( &y, &bits, sizeof(y) );
+    y *= 1.5f - 0.5f * x * y * y;
+    y *= 1.5f - 0.5f * x * y * y;
+    return y;
+  }
+
+  /// max( x, 0 ) without a comparison, which would keep the compiler from
+  /// vectorizing.
+  static float clampToPositive( float x )
+  {
+    return 0.5f * ( x + std::abs( x ) );
+  }
+
+  /// Clamps x to [0,255.5], so the conversion to an integer cannot
+  /// overflow, even for infinity and NaN. Non-negative floats are ordered
+  /// like their bits as signed integers and negative ones become negative
+  /// integers, so integer min and max do it without float comparisons.
+  static float clampToColorRange( float x )
+  {
+    const float maxValue = 255.5f;
+    std::int32_t bits, maxBits;
+    std::memcpy( &bits, &x, sizeof(bits) );
+    std::memcpy( &maxBits, &maxValue, sizeof(maxBits) );
+    bits = std::min( std::max( bits, std::int32_t(0) ), maxBits );
+    float result;
+    std::memcpy( &result, &bits, sizeof(result) );
+    return result;
+  }
+
+  template <std::size_t nChannels>
+  void shadeBlock( Block<nChannels> & block ) const
+  {
+    // the unit vectors towards the camera
+    float vx[laneCount], vy[laneCount], vz[laneCount];
+    for ( std::size_t lane = 0; lane < laneCount; ++lane )
+    {
+      const auto invLength = invSqrt( block.px[lane]*block.px[lane] +
+                                      block.py[lane]*block.py[lane] +
+                                      block.pz[lane]*block.pz[lane] );
+      vx[lane] = -block.px[lane] * invLength;
+      vy[lane] = -block.py[lane] * invLength;
+      vz[lane] = -block.pz[lane] * invLength;
+    }
+    if ( material_.isTwoSided )
+      for ( std::size_t lane = 0; lane < laneCount; ++lane )
+      {
+        const auto side = std::copysign( 1.f, block.nx[lane]*vx[lane] +
+                                              block.ny[lane]*vy[lane] +
+                                              block.nz[lane]*vz[lane] );
+        block.nx[lane] *= side;
+        block.ny[lane] *= side;
+        block.nz[lane] *= side;
+      }
+
+    float intensity[nChannels][laneCount];
+    for ( std::size_t channel = 0; channel < nChannels; ++channel )
+      for ( std::size_t lane = 0; lane < laneCount; ++lane )
+        intensity[channel][lane] = material_.ambient;
+
+    const auto shininess = material_.shininess;
+    for ( const auto & light : lights_ )
+    {
+      const auto isPoint = light.isPoint;
+      const auto isDirectional = 1 - isPoint;
+      float diffuse[laneCount], specular[laneCount];
+      for ( std::size_t lane = 0; lane < laneCount; ++lane )
+      {
+        // the vector towards the light
+        auto lx = light.vector[0] - isPoint * block.px[lane];
+        auto ly = light.vector[1] - isPoint * block.py[lane];
+        auto lz = light.vector[2] - isPoint * block.pz[lane];
+        const auto sqrDistance = lx*lx + ly*ly + lz*lz;
+        const auto invDistance = invSqrt( isDirectional + isPoint * sqrDistance );
+        const auto falloff = 1 / ( 1 + isPoint * light.attenuation * sqrDistance );
+        lx *= invDistance;
+        ly *= invDistance;
+        lz *= invDistance;
+        const auto cosLight = block.nx[lane]*lx + block.ny[lane]*ly + block.nz[lane]*lz;
+
+        auto hx = lx + vx[lane];
+        auto hy = ly + vy[lane];
+        auto hz = lz + vz[lane];
+        const auto invHalfLength = invSqrt( hx*hx + hy*hy + hz*hz + 1e-20f );
+        const auto cosHalf = clampToPositive( invHalfLength *
+            ( block.nx[lane]*hx + block.ny[lane]*hy + block.nz[lane]*hz ) );
+        // No highlights on the side facing away from the light.
+        const auto isLit = std::copysign( 0.5f, cosLight ) + 0.5f;
+        diffuse[lane] = falloff * clampToPositive( cosLight );
+        specular[lane] = falloff * isLit *
+            cosHalf / ( shininess - shininess * cosHalf + cosHalf );
+      }
+      for ( std::size_t channel = 0; channel < nChannels; ++channel )
+      {
+        const auto kd = nChannels == 1 ? light.grayDiffuse : light.diffuse[channel];
+        const auto ks = nChannels == 1 ? light.graySpecular : light.specular[channel];
+        for ( std::size_t lane = 0; lane < laneCount; ++lane )
+          intensity[channel][lane] += kd * diffuse[lane] + ks * specular[lane];
+      }
+    }
+
+    for ( std::size_t channel = 0; channel < nChannels; ++channel )
+      for ( std::size_t lane = 0; lane < laneCount; ++lane )
+      {
+        const auto value = clampToColorRange(
+            intensity[channel][lane] * block.base[channel][lane] + 0.5f );
+        block.result[channel][lane] = std::int32_t( value );
+      }
+  }
+
+  Material material_;
+  std::vector<Light> lights_;
+};
+
+
+namespace detail
+{
+
+  /// Tells, whether a face shader shades whole batches with shadeGray() like
+  /// Lighting instead of being called for every face.
+  template <typename ShadeFace, typename = void>
+  struct IsBatchShader : std::false_type {};
+
+  template <typename ShadeFace>
+  struct IsBatchShader<ShadeFace, std::void_t<
+      decltype( &std::decay_t<ShadeFace>::shadeGray )>> : std::true_type {};
+
+} // namespace detail
+
+} // namespace cu
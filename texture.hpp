@@ -0,0 +1,361 @@
+#pragma once
+
+#include "drawing.hpp"
+#include "framebuffer.hpp"
+#include "mat.hpp"
+#include "vec.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <type_traits>
+#include <vector>
+
+
+namespace cu
+{
+
+enum class TextureFilter
+{
+  Nearest,
+  Bilinear,
+  Trilinear
+};
+
+
+/// An image with a precomputed chain of mipmaps. Level 0 is the original
+/// image, every further level has half the width and height of the previous
+/// one down to 1x1 texels. The texels are stored in 4x4 blocks, so the
+/// texels fetched for one pixel and its neighbours share cache lines.
+///
+/// Texture coordinates are normalized to [0,1) and wrap around.
+template <typename T>
+class Texture
+{
+public:
+  using Level = TiledMat<T,2>;
+
+  Texture() = default;
+
+  explicit Texture( const Mat<T> & image )
+  {
+    assert( image.getNRows() > 0 && image.getNCols() > 0 );
+    levels_.emplace_back( image.getNRows(), image.getNCols() );
+    for ( std::size_t row = 0; row < image.getNRows(); ++row )
+      for ( std::size_t col = 0; col < image.getNCols(); ++col )
+        levels_.back()[row][col] = image[row][col];
+    while ( levels_.back().getNRows() > 1 || levels_.back().getNCols() > 1 )
+      levels_.push_back( makeNextLevel( levels_.back() ) );
+  }
+
+  std::size_t getNLevels() const { return levels_.size(); }
+  const Level & getLevel( std::size_t level ) const { return levels_.at(level); }
+  std::size_t getNRows() const { return levels_.front().getNRows(); }
+  std::size_t getNCols() const { return levels_.front().getNCols(); }
+
+  /// Returns the level of detail for the given derivatives of the texture
+  /// coordinates with respect to the screen coordinates x and y.
+  template <typename Coord>
+  Coord computeLod( Coord dudx, Coord dvdx, Coord dudy, Coord dvdy ) const
+  {
+    const auto w = Coord(getNCols());
+    const auto h = Coord(getNRows());
+    const auto sqrRho = std::max(
+          dudx*dudx*w*w + dvdx*dvdx*h*h,
+          dudy*dudy*w*w + dvdy*dvdy*h*h );
+    if ( sqrRho <= 0 )
+      return 0;
+    return Coord(0.5) * std::log2( sqrRho );
+  }
+
+  /// Coordinates which are not finite sample texel (0,0) and a level of
+  /// detail which is NaN selects level 0.
+  template <typename Coord>
+  T sample( Coord u, Coord v, Coord lod, TextureFilter filter ) const
+  {
+    const auto maxLevel = Coord(levels_.size()-1);
+    lod = lod > 0 ? std::min( lod, maxLevel ) : Coord(0);
+    switch ( filter )
+    {
+    case TextureFilter::Nearest:
+      return sampleNearest( levels_[std::lround(lod)], u, v );
+    case TextureFilter::Bilinear:
+      return fromFloat( sampleBilinear( levels_[std::lround(lod)], u, v ) );
+    case TextureFilter::Trilinear:
+      break;
+    }
+    const auto lower = std::size_t(lod);
+    const auto upper = std::min( lower+1, levels_.size()-1 );
+    const auto t = float(lod - Coord(lower));
+    return fromFloat( (1-t) * sampleBilinear( levels_[lower], u, v ) +
+                         t  * sampleBilinear( levels_[upper], u, v ) );
+  }
+
+private:
+  static T fromFloat( float value )
+  {
+    return std::is_integral<T>::value ? T(value + 0.5f) : T(value);
+  }
+
+  /// Scales a texture coordinate to texels. Coordinates for which this is
+  /// not finite become 0, so the texel arithmetic stays defined.
+  template <typename Coord>
+  static Coord toTexels( Coord u, std::size_t size, Coord offset )
+  {
+    const auto x = u * Coord(size) - offset;
+    return std::isfinite(x) ? x : Coord(0);
+  }
+
+  /// Returns the index of the texel containing x, which is in texels,
+  /// wrapped into [0,size). The reduction happens before the conversion to
+  /// an integer, which could overflow otherwise.
+  template <typename Coord>
+  static std::size_t wrap( Coord x, std::size_t size )
+  {
+    const auto n = Coord(size);
+    auto r = std::fmod( std::floor(x), n );
+    if ( r < 0 )
+      r += n;
+    return r >= 0 && r < n ? std::size_t(r) : 0;
+  }
+
+  template <typename Coord>
+  static T sampleNearest( const Level & level, Coord u, Coord v )
+  {
+    const auto x = toTexels( u, level.getNCols(), Coord(0) );
+    const auto y = toTexels( v, level.getNRows(), Coord(0) );
+    return level[wrap(y,level.getNRows())][wrap(x,level.getNCols())];
+  }
+
+  template <typename Coord>
+  static float sampleBilinear( const Level & level, Coord u, Coord v )
+  {
+    const auto x = toTexels( u, level.getNCols(), Coord(0.5) );
+    const auto y = toTexels( v, level.getNRows(), Coord(0.5) );
+    const auto x0 = std::floor(x);
+    const auto y0 = std::floor(y);
+    const auto s = float(x - x0);
+    const auto t = float(y - y0);
+    const auto col0 = wrap( x0  , level.getNCols() );
+    const auto col1 = wrap( x0+1, level.getNCols() );
+    const auto row0 = level[wrap( y0  , level.getNRows() )];
+    const auto row1 = level[wrap( y0+1, level.getNRows() )];
+    return (1-t) * ( (1-s) * float(row0[col0]) + s * float(row0[col1]) ) +
+              t  * ( (1-s) * float(row1[col0]) + s * float(row1[col1]) );
+  }
+
+  /// Averages blocks of 2x2 texels. For odd sizes the last row or column
+  /// is averaged with its single neighbour only.
+  static Level makeNextLevel( const Level & prev )
+  {
+    Level next( std::max<std::size_t>( prev.getNRows()/2, 1 ),
+                std::max<std::size_t>( prev.getNCols()/2, 1 ) );
+    for ( std::size_t row = 0; row < next.getNRows(); ++row )
+    {
+      const auto row0 = 2*row;
+      const auto row1 = std::min( row0+1, prev.getNRows()-1 );
+      for ( std::size_t col = 0; col < next.getNCols(); ++col )
+      {
+        const auto col0 = 2*col;
+        const auto col1 = std::min( col0+1, prev.getNCols()-1 );
+        next[row][col] = fromFloat( 0.25f * (
+              float(prev[row0][col0]) + float(prev[row0][col1]) +
+              float(prev[row1][col0]) + float(prev[row1][col1]) ) );
+      }
+    }
+    return next;
+  }
+
+  std::vector<Level> levels_;
+};
+
+
+namespace detail
+{
+
+  /// Interpolates the texture coordinates perspective correctly. u/w, v/w
+  /// and 1/w are affine functions of the screen coordinates within a
+  /// triangle, where w is the depth of a vertex in view space, so their
+  /// derivatives are computed once per triangle. The derivatives of u and v
+  /// and hence the level of detail change from pixel to pixel.
+  template <typename T, typename Coord>
+  struct TextureInfoStruct
+  {
+    const Texture<T> & texture;
+    TextureFilter filter;
+    Vec<Coord,2> origin;
+    /// u/w, v/w and 1/w at the origin and their derivatives.
+    Vec<Coord,3> uvq0;
+    Vec<Coord,3> uvqPerX;
+    Vec<Coord,3> uvqPerY;
+
+    TextureInfoStruct( const Texture<T> & texture_,
+                       TextureFilter filter_,
+                       const Vec<Coord,2> & A,
+                       const Vec<Coord,2> & B,
+                       const Vec<Coord,2> & C,
+                       const Vec<Coord,2> & uvA,
+                       const Vec<Coord,2> & uvB,
+                       const Vec<Coord,2> & uvC,
+                       Coord wA,
+                       Coord wB,
+                       Coord wC )
+      : texture(texture_)
+      , filter(filter_)
+      , origin(A)
+      , uvq0{ uvA[0]/wA, uvA[1]/wA, 1/wA }
+    {
+      const auto AB = B - A;
+      const auto AC = C - A;
+      const auto det = AB[0]*AC[1] - AC[0]*AB[1];
+      // Degenerate triangles cover no pixels.
+      if ( det == 0 )
+        return;
+      const auto dUvqB = Vec<Coord,3>{ uvB[0]/wB, uvB[1]/wB, 1/wB } - uvq0;
+      const auto dUvqC = Vec<Coord,3>{ uvC[0]/wC, uvC[1]/wC, 1/wC } - uvq0;
+      uvqPerX = ( AC[1] * dUvqB - AB[1] * dUvqC ) / det;
+      uvqPerY = ( AB[0] * dUvqC - AC[0] * dUvqB ) / det;
+    }
+
+    T sample( std::size_t x, std::size_t y ) const
+    {
+      const auto uvq = uvq0 + ( Coord(x) - origin[0] ) * uvqPerX
+                            + ( Coord(y) - origin[1] ) * uvqPerY;
+      const auto w = 1 / uvq[2];
+      const auto u = uvq[0] * w;
+      const auto v = uvq[1] * w;
+      // The quotient rule gives d(u) = ( d(u/w) - u * d(1/w) ) * w.
+      const auto lod = texture.computeLod(
+            ( uvqPerX[0] - u * uvqPerX[2] ) * w, ( uvqPerX[1] - v * uvqPerX[2] ) * w,
+            ( uvqPerY[0] - u * uvqPerY[2] ) * w, ( uvqPerY[1] - v * uvqPerY[2] ) * w );
+      return texture.sample( u, v, lod, filter );
+    }
+
+    template <typename Image>
+    void setPixel( Image & img, std::size_t x, std::size_t y )
+    {
+      img[y][x] = sample( x, y );
+    }
+  };
+
+
+  template <typename T, typename Coord, typename ZBuffer>
+  struct TextureAndZBufferInfoStruct
+      : TextureInfoStruct<T,Coord>
+  {
+    ZBuffer & zBuffer;
+    Coord maxZ;
+    Coord z;
+
+    template <typename ...Args>
+    TextureAndZBufferInfoStruct( ZBuffer & zBuffer_,
+                                 Coord maxZ_,
+                                 Coord z_,
+                                 Args &&... args )
+      : TextureInfoStruct<T,Coord>( std::forward<Args>(args)... )
+      , zBuffer(zBuffer_)
+      , maxZ(maxZ_)
+      , z(z_)
+    {}
+
+    template <typename Image>
+    void setPixel( Image & img, std::size_t x, std::size_t y )
+    {
+      auto & currentZ = zBuffer[y][x];
+      if ( z >= maxZ || z <= currentZ )
+        return;
+      currentZ = z;
+      img[y][x] = this->sample( x, y );
+    }
+  };
+
+} // namespace detail
+
+
+/// Draws a textured triangle. uvA, uvB and uvC are the texture coordinates
+/// at the vertices A, B and C, and wA, wB and wC are the positive depths of
+/// the vertices in view space, e.g. -z for a camera looking along -z. The
+/// texture coordinates are interpolated perspective correctly and the
+/// mipmap level is chosen per pixel.
+template <typename Image, typename Coord, typename T>
+void drawTriangle( Image & img,
+                   Vec<Coord,2> A,
+                   Vec<Coord,2> B,
+                   Vec<Coord,2> C,
+                   Vec<Coord,2> uvA,
+                   Vec<Coord,2> uvB,
+                   Vec<Coord,2> uvC,
+                   Coord wA,
+                   Coord wB,
+                   Coord wC,
+                   const Texture<T> & texture,
+                   TextureFilter filter )
+{
+  detail::drawTriangle( img, A, B, C,
+      detail::TextureInfoStruct<T,Coord>{
+        texture, filter, A, B, C, uvA, uvB, uvC, wA, wB, wC } );
+}
+
+
+/// Draws a textured triangle with depth z. See the overload for flat colors
+/// for the meaning of zBuffer and maxZ.
+template <typename Image, typename Coord, typename T, typename ZBuffer>
+void drawTriangle( Image & img,
+                   Vec<Coord,2> A,
+                   Vec<Coord,2> B,
+                   Vec<Coord,2> C,
+                   Vec<Coord,2> uvA,
+                   Vec<Coord,2> uvB,
+                   Vec<Coord,2> uvC,
+                   Coord wA,
+                   Coord wB,
+                   Coord wC,
+                   const Texture<T> & texture,
+                   TextureFilter filter,
+                   ZBuffer & zBuffer,
+                   Coord maxZ,
+                   Coord z )
+{
+  detail::drawTriangle( img, A, B, C,
+      detail::TextureAndZBufferInfoStruct<T,Coord,ZBuffer>{
+        zBuffer, maxZ, z, texture, filter, A, B, C, uvA, uvB, uvC, wA, wB, wC } );
+}
+
+
+/// Draws a textured triangle lying in the screen plane, i.e. with the
+/// texture coordinates interpolated affinely.
+template <typename Image, typename Coord, typename T>
+void drawTriangle( Image & img,
+                   Vec<Coord,2> A,
+                   Vec<Coord,2> B,
+                   Vec<Coord,2> C,
+                   Vec<Coord,2> uvA,
+                   Vec<Coord,2> uvB,
+                   Vec<Coord,2> uvC,
+                   const Texture<T> & texture,
+                   TextureFilter filter )
+{
+  drawTriangle( img, A, B, C, uvA, uvB, uvC, Coord(1), Coord(1), Coord(1),
+                texture, filter );
+}
+
+
+template <typename Image, typename Coord, typename T, typename ZBuffer>
+void drawTriangle( Image & img,
+                   Vec<Coord,2> A,
+                   Vec<Coord,2> B,
+                   Vec<Coord,2> C,
+                   Vec<Coord,2> uvA,
+                   Vec<Coord,2> uvB,
+                   Vec<Coord,2> uvC,
+                   const Texture<T> & texture,
+                   TextureFilter filter,
+                   ZBuffer & zBuffer,
+                   Coord maxZ,
+                   Coord z )
+{
+  drawTriangle( img, A, B, C, uvA, uvB, uvC, Coord(1), Coord(1), Coord(1),
+                texture, filter, zBuffer, maxZ, z );
+}
+
+} // namespace cu
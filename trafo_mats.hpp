@@ -66,4 +66,16 @@ Mat<T,N+1,N+1> makeExtendedMat( const Mat<T,N,N> & m )
   return result;
 }
 
+
+/// Appends the row ( 0 ... 0 1 ) to an affine transformation matrix.
+template <typename T, std::size_t N>
+Mat<T,N+1,N+1> makeExtendedMat( const Mat<T,N,N+1> & m )
+{
+  Mat<T,N+1,N+1> result;
+  for ( std::size_t row = 0; row != N; ++row )
+    result[row] = m[row];
+  result[N][N] = 1;
+  return result;
+}
+
 } // namespace cu